@@ -0,0 +1,168 @@
+#include "CostMap.hpp"
+
+#include <algorithm>
+#include <map>
+
+#include <glm/glm.hpp>
+
+#include "Image.hpp"
+#include "MathHelper.hpp"
+
+//---------------------------------------------------------------------------------------
+CostMap::CostMap(uint width, uint height)
+	: m_width(width), m_height(height),
+	  m_nanoseconds(width * height, 0.0),
+	  m_rays(width * height, 0.0),
+	  m_tests(width * height, 0.0),
+	  m_objects(width * height, Raytracer_NO_OBJECT)
+{
+}
+
+//---------------------------------------------------------------------------------------
+uint CostMap::width() const
+{
+	return m_width;
+}
+
+//---------------------------------------------------------------------------------------
+uint CostMap::height() const
+{
+	return m_height;
+}
+
+//---------------------------------------------------------------------------------------
+void CostMap::add(uint x, uint y, double nanoseconds, long rays, long tests, unsigned int object)
+{
+	size_t i = (size_t)y * m_width + x;
+	m_nanoseconds[i] += nanoseconds;
+	m_rays[i] += rays;
+	m_tests[i] += tests;
+	m_objects[i] = object;
+}
+
+//---------------------------------------------------------------------------------------
+double CostMap::totalNanoseconds() const
+{
+	double total = 0.0;
+	for (double value : m_nanoseconds)
+	{
+		total += value;
+	}
+	return total;
+}
+
+//---------------------------------------------------------------------------------------
+long CostMap::totalRays() const
+{
+	double total = 0.0;
+	for (double value : m_rays)
+	{
+		total += value;
+	}
+	return (long)total;
+}
+
+//---------------------------------------------------------------------------------------
+long CostMap::totalTests() const
+{
+	double total = 0.0;
+	for (double value : m_tests)
+	{
+		total += value;
+	}
+	return (long)total;
+}
+
+//---------------------------------------------------------------------------------------
+std::vector<std::pair<unsigned int, double>> CostMap::objectTimes() const
+{
+	std::map<unsigned int, double> totals;
+	for (size_t i = 0; i < m_objects.size(); i++)
+	{
+		totals[m_objects[i]] += m_nanoseconds[i];
+	}
+
+	std::vector<std::pair<unsigned int, double>> times(totals.begin(), totals.end());
+	std::sort(times.begin(), times.end(), [](const std::pair<unsigned int, double> &a, const std::pair<unsigned int, double> &b) {
+		return a.second > b.second;
+	});
+	return times;
+}
+
+// The colour of 't' in [0, 1] on a ramp from black through purple, red and
+// yellow to white
+static glm::vec3 heat_colour(double t)
+{
+	static const glm::vec3 stops[] = {
+		glm::vec3(0.0, 0.0, 0.0),
+		glm::vec3(0.3, 0.0, 0.5),
+		glm::vec3(0.9, 0.1, 0.2),
+		glm::vec3(1.0, 0.8, 0.0),
+		glm::vec3(1.0, 1.0, 1.0)};
+	const int last = sizeof(stops) / sizeof(stops[0]) - 1;
+
+	double position = std::min(std::max(t, 0.0), 1.0) * last;
+	int stop = std::min((int)position, last - 1);
+	float f = position - stop;
+	return stops[stop] * (1.0f - f) + stops[stop + 1] * f;
+}
+
+//---------------------------------------------------------------------------------------
+bool CostMap::saveHeatmap(const std::string &filename, const std::vector<double> &values) const
+{
+	// A few very expensive pixels would leave the rest dark, so the scale
+	// tops out at the 99th percentile
+	std::vector<double> sorted(values);
+	size_t rank = sorted.empty() ? 0 : (sorted.size() - 1) * 99 / 100;
+	double scale = 0.0;
+	if (!sorted.empty())
+	{
+		std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+		scale = sorted[rank];
+	}
+	if (scale <= 0.0)
+	{
+		scale = *std::max_element(values.begin(), values.end());
+	}
+
+	Image image(m_width, m_height);
+	for (uint y = 0; y < m_height; y++)
+	{
+		for (uint x = 0; x < m_width; x++)
+		{
+			double value = values[(size_t)y * m_width + x];
+			glm::vec3 colour = heat_colour(scale > 0.0 ? value / scale : 0.0);
+			image(x, y, 0) = colour.r;
+			image(x, y, 1) = colour.g;
+			image(x, y, 2) = colour.b;
+		}
+	}
+
+	return image.savePng(filename);
+}
+
+//---------------------------------------------------------------------------------------
+bool CostMap::save(const std::string &prefix) const
+{
+	if (m_nanoseconds.empty())
+	{
+		return false;
+	}
+
+	bool saved = saveHeatmap(prefix + "_time.png", m_nanoseconds);
+	saved = saveHeatmap(prefix + "_rays.png", m_rays) && saved;
+	saved = saveHeatmap(prefix + "_tests.png", m_tests) && saved;
+
+	Image raw(m_width, m_height);
+	for (uint y = 0; y < m_height; y++)
+	{
+		for (uint x = 0; x < m_width; x++)
+		{
+			size_t i = (size_t)y * m_width + x;
+			raw(x, y, 0) = m_nanoseconds[i];
+			raw(x, y, 1) = m_rays[i];
+			raw(x, y, 2) = m_tests[i];
+		}
+	}
+	return raw.savePfm(prefix + ".pfm") && saved;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+
+typedef unsigned int uint;
+
+/**
+ * Where the time of a render went: for each pixel, the nanoseconds spent on
+ * its samples, the rays they traced, the intersection tests they made and
+ * the object its primary ray last hit. Each pixel is only written by the
+ * thread rendering its tile, so no locking is needed.
+ *
+ * The map is written out as false colour images, hot where the pixels cost
+ * the most, and as a PFM holding the raw numbers.
+ */
+class CostMap
+{
+  public:
+	CostMap(uint width, uint height);
+
+	uint width() const;
+	uint height() const;
+
+	// Add the cost of a sample to the pixel at ('x', 'y')
+	void add(uint x, uint y, double nanoseconds, long rays, long tests, unsigned int object);
+
+	// Totals over the whole image
+	double totalNanoseconds() const;
+	long totalRays() const;
+	long totalTests() const;
+
+	// The time spent on the pixels whose primary rays hit each object, the
+	// most expensive first. Pixels that hit nothing have Raytracer_NO_OBJECT.
+	std::vector<std::pair<unsigned int, double>> objectTimes() const;
+
+	// Write '<prefix>_time.png', '<prefix>_rays.png' and '<prefix>_tests.png'
+	// as false colour images, scaled so that the 99th percentile of each
+	// is the hottest colour, and '<prefix>.pfm' with the time, rays and
+	// tests of each pixel as its red, green and blue.
+	bool save(const std::string &prefix) const;
+
+  private:
+	bool saveHeatmap(const std::string &filename, const std::vector<double> &values) const;
+
+	uint m_width;
+	uint m_height;
+
+	std::vector<double> m_nanoseconds;
+	std::vector<double> m_rays;
+	std::vector<double> m_tests;
+	std::vector<unsigned int> m_objects;
+};
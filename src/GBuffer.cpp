@@ -0,0 +1,66 @@
+#include "GBuffer.hpp"
+
+//---------------------------------------------------------------------------------------
+bool GBufferView::operator==(const GBufferView &other) const
+{
+	return eye == other.eye && view == other.view && up == other.up && fovy == other.fovy &&
+		   width == other.width && height == other.height &&
+		   crop_x == other.crop_x && crop_y == other.crop_y &&
+		   frame_width == other.frame_width && frame_height == other.frame_height;
+}
+
+//---------------------------------------------------------------------------------------
+GBuffer::GBuffer()
+	: m_filled(false)
+{
+}
+
+//---------------------------------------------------------------------------------------
+bool GBuffer::prepare(const GBufferView &view)
+{
+	if (m_filled && m_view == view)
+	{
+		return true;
+	}
+
+	m_view = view;
+	m_filled = false;
+
+	size_t size = (size_t)view.width * view.height;
+	depth.resize(size);
+	normal.resize(size);
+	material.resize(size);
+	object.resize(size);
+
+	return false;
+}
+
+//---------------------------------------------------------------------------------------
+bool GBuffer::filled() const
+{
+	return m_filled;
+}
+
+//---------------------------------------------------------------------------------------
+void GBuffer::markFilled()
+{
+	m_filled = true;
+}
+
+//---------------------------------------------------------------------------------------
+void GBuffer::clear()
+{
+	m_filled = false;
+}
+
+//---------------------------------------------------------------------------------------
+uint GBuffer::width() const
+{
+	return m_view.width;
+}
+
+//---------------------------------------------------------------------------------------
+uint GBuffer::height() const
+{
+	return m_view.height;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+typedef unsigned int uint;
+
+// The view a G-buffer was filled for
+struct GBufferView
+{
+	glm::vec3 eye, view, up;
+	double fovy;
+
+	// Size of the image, and where it is in the frame when it is cropped
+	uint width, height;
+	uint crop_x, crop_y;
+	uint frame_width, frame_height;
+
+	bool operator==(const GBufferView &other) const;
+};
+
+/**
+ * What the primary ray of each pixel hit, for deferred shading: the distance
+ * along the ray, the surface normal, and the indices of the material and of
+ * the object. Pixels whose ray hit nothing have an infinite depth.
+ *
+ * The buffer is stored as one array per attribute, so that the shading sweep
+ * reads each of them in order.
+ *
+ * A buffer remembers the view it was filled for, and a render of the same
+ * view shades from it without tracing the primary rays again. Changes to the
+ * scene are not noticed, so clear() should be called after editing it.
+ */
+class GBuffer
+{
+  public:
+	GBuffer();
+
+	// Get ready to render 'view'. Returns true if the buffer already holds
+	// the primary hits for it, otherwise sizes it to be filled.
+	bool prepare(const GBufferView &view);
+
+	// Whether the buffer holds the primary hits of its view
+	bool filled() const;
+
+	// Record that the buffer has been filled, or that it no longer holds
+	// anything useful.
+	void markFilled();
+	void clear();
+
+	uint width() const;
+	uint height() const;
+
+	std::vector<float> depth;
+	std::vector<glm::vec3> normal;
+	std::vector<unsigned int> material;
+	std::vector<unsigned int> object;
+
+  private:
+	GBufferView m_view;
+	bool m_filled;
+};
@@ -44,6 +44,7 @@ bool GeometryNode::intersect(Ray &ray, Intersection &i) const
 		i.point = intersection.point;
 		i.normal = intersection.normal;
 		i.material = m_material;
+		i.object_id = m_nodeId;
 
 		return true;
 	}
@@ -2,9 +2,19 @@
 
 #include <iostream>
 #include <cstring>
+#include <cstdio>
+#include <cctype>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <lodepng/lodepng.h>
 
+#include "PngWriter.hpp"
+#include "Trace.hpp"
+
 const uint Image::m_colorComponents = 3; // Red, blue, green
 
 //---------------------------------------------------------------------------------------
@@ -90,35 +100,196 @@ double &Image::operator()(uint x, uint y, uint i)
 }
 
 //---------------------------------------------------------------------------------------
-bool Image::savePng(const std::string &filename)
+bool Image::savePng(const std::string &filename, int compression, int num_threads, const ToneMapSettings &tonemap) const
 {
+  TRACE_SCOPE("Image::savePng");
+
+  ToneMapper mapper(tonemap);
   std::vector<unsigned char> image;
 
-  image.resize(m_width * m_height * m_colorComponents);
+  image.resize(m_width * m_height * mapper.bytesPerPixel());
+  mapper.mapImage(*this, &image[0], num_threads);
+
+  // Encode the image, deflating strips of it in parallel
+  return png_write_parallel(filename, &image[0], m_width, m_height, mapper.bitDepth(), compression, num_threads);
+}
+
+//---------------------------------------------------------------------------------------
+bool Image::savePfm(const std::string &filename) const
+{
+  // A PFM file is a short text header followed by the raw little-endian
+  // floats, with the rows stored from the bottom of the image up. The
+  // header is padded with spaces before its last newline to a multiple of
+  // four bytes, so that the floats are aligned in the mapping.
+  char header[64];
+  int headerSize = snprintf(header, sizeof(header), "PF\n%u %u\n-1.0", m_width, m_height);
+  while ((headerSize + 1) % sizeof(float) != 0)
+  {
+    header[headerSize++] = ' ';
+  }
+  header[headerSize++] = '\n';
+
+  size_t rowElements = m_width * m_colorComponents;
+  size_t fileSize = headerSize + m_height * rowElements * sizeof(float);
+
+  int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, fileSize) != 0)
+  {
+    std::cerr << "could not create " << filename << std::endl;
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return false;
+  }
+
+  // Map the file and convert the image straight into it, so the data is
+  // written without any intermediate buffer
+  void *mapping = mmap(NULL, fileSize, PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (mapping == MAP_FAILED)
+  {
+    std::cerr << "could not map " << filename << std::endl;
+    return false;
+  }
+
+  unsigned char *bytes = static_cast<unsigned char *>(mapping);
+  memcpy(bytes, header, headerSize);
 
-  double color;
+  float *pixels = reinterpret_cast<float *>(bytes + headerSize);
   for (uint y(0); y < m_height; y++)
   {
-    for (uint x(0); x < m_width; x++)
+    const double *src = m_data + rowElements * (m_height - 1 - y);
+    float *dst = pixels + rowElements * y;
+
+    for (size_t i(0); i < rowElements; ++i)
     {
-      for (uint i(0); i < m_colorComponents; ++i)
-      {
-        color = m_data[m_colorComponents * (m_width * y + x) + i];
-        image[m_colorComponents * (m_width * y + x) + i] = (unsigned char)(255 * color);
-      }
+      dst[i] = (float)src[i];
     }
   }
 
-  // Encode the image
-  unsigned error = lodepng::encode(filename, image, m_width, m_height, LCT_RGB);
+  return munmap(mapping, fileSize) == 0;
+}
+
+//---------------------------------------------------------------------------------------
+bool Image::mergePng(const std::string &filename, uint x, uint y, int compression, int num_threads, const ToneMapSettings &tonemap) const
+{
+  ToneMapper mapper(tonemap);
 
+  std::vector<unsigned char> frame;
+  unsigned frameWidth, frameHeight;
+  unsigned error = lodepng::decode(frame, frameWidth, frameHeight, filename, LCT_RGB, mapper.bitDepth());
   if (error)
   {
-    std::cerr << "encoder error " << error << ": " << lodepng_error_text(error)
-              << std::endl;
+    std::cerr << "decoder error " << error << ": " << lodepng_error_text(error) << std::endl;
+    return false;
+  }
+
+  if (x + m_width > frameWidth || y + m_height > frameHeight)
+  {
+    std::cerr << "a " << m_width << "x" << m_height << " window at (" << x << ", " << y
+              << ") does not fit in " << filename << std::endl;
+    return false;
+  }
+
+  // Convert just this window and copy it over the old pixels
+  size_t bpp = mapper.bytesPerPixel();
+  std::vector<unsigned char> window(m_width * m_height * bpp);
+  mapper.mapImage(*this, &window[0], num_threads);
+
+  for (uint row(0); row < m_height; row++)
+  {
+    memcpy(&frame[((y + row) * frameWidth + x) * bpp], &window[row * m_width * bpp], m_width * bpp);
+  }
+
+  return png_write_parallel(filename, &frame[0], frameWidth, frameHeight, mapper.bitDepth(), compression, num_threads);
+}
+
+//---------------------------------------------------------------------------------------
+bool Image::mergePfm(const std::string &filename, uint x, uint y) const
+{
+  int fd = open(filename.c_str(), O_RDWR);
+  if (fd < 0)
+  {
+    std::cerr << "could not open " << filename << std::endl;
+    return false;
+  }
+
+  // Read the header, which is three whitespace separated fields and the
+  // rest of the line, which may be padded, before the data
+  char header[64] = {0};
+  ssize_t headerRead = read(fd, header, sizeof(header) - 1);
+  uint frameWidth = 0, frameHeight = 0;
+  double scale = 0.0;
+  int headerSize = 0;
+
+  if (headerRead <= 0 ||
+      sscanf(header, "PF %u %u %lf%n", &frameWidth, &frameHeight, &scale, &headerSize) != 3 ||
+      scale >= 0.0)
+  {
+    std::cerr << filename << " is not a little-endian colour PFM file" << std::endl;
+    close(fd);
+    return false;
+  }
+  while (headerSize < headerRead && header[headerSize] != '\n' && isspace((unsigned char)header[headerSize]))
+  {
+    headerSize++;
+  }
+  if (headerSize >= headerRead || header[headerSize] != '\n')
+  {
+    std::cerr << filename << " has no newline after its PFM header" << std::endl;
+    close(fd);
+    return false;
+  }
+  headerSize++;
+
+  if (x + m_width > frameWidth || y + m_height > frameHeight)
+  {
+    std::cerr << "a " << m_width << "x" << m_height << " window at (" << x << ", " << y
+              << ") does not fit in " << filename << std::endl;
+    close(fd);
+    return false;
+  }
+
+  size_t frameElements = frameWidth * m_colorComponents;
+  size_t fileSize = headerSize + frameHeight * frameElements * sizeof(float);
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < fileSize)
+  {
+    std::cerr << filename << " is shorter than its header says" << std::endl;
+    close(fd);
+    return false;
+  }
+
+  // Map the file and write the window straight over the old pixels
+  void *mapping = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (mapping == MAP_FAILED)
+  {
+    std::cerr << "could not map " << filename << std::endl;
+    return false;
+  }
+
+  // Files from other writers may not align the floats, so they are copied
+  // in byte by byte
+  unsigned char *pixels = static_cast<unsigned char *>(mapping) + headerSize;
+  size_t rowElements = m_width * m_colorComponents;
+  for (uint row(0); row < m_height; row++)
+  {
+    // Rows are stored from the bottom of the image up
+    const double *src = m_data + rowElements * row;
+    unsigned char *dst = pixels + (frameElements * (frameHeight - 1 - (y + row)) + x * m_colorComponents) * sizeof(float);
+
+    for (size_t i(0); i < rowElements; ++i)
+    {
+      float value = (float)src[i];
+      memcpy(dst + i * sizeof(float), &value, sizeof(float));
+    }
   }
 
-  return true;
+  return munmap(mapping, fileSize) == 0;
 }
 
 //---------------------------------------------------------------------------------------
@@ -2,15 +2,18 @@
 
 #include <string>
 
+#include "ToneMap.hpp"
+
 typedef unsigned int uint;
 
 /**
  * An image, consisting of a rectangle of floating-point elements.
  * Each pixel element consists of 3 components: Red, Blue, and Green.
  *
- * This class makes it easy to save the image as a PNG file.
+ * This class makes it easy to save the image as a PNG or PFM file.
  * Note that colours in the range [0.0, 1.0] are mapped to the integer
- * range [0, 255] when writing PNG files.
+ * range [0, 255] when writing PNG files (see ToneMapSettings for other
+ * mappings), while PFM files keep the unclamped floating-point values.
  */
 class Image
 {
@@ -43,7 +46,27 @@ class Image
 
 	// Save this image into the PNG file with name 'filename'.
 	// Warning: If 'filename' already exists, it will be overwritten.
-	bool savePng(const std::string &filename);
+	// 'compression' is the zlib level from 0 (fastest) to 9 (smallest), or -1
+	// for the default, and the image is compressed on 'num_threads' threads.
+	// 'tonemap' controls how colours are converted to integers.
+	bool savePng(const std::string &filename, int compression = -1, int num_threads = 1,
+				 const ToneMapSettings &tonemap = ToneMapSettings()) const;
+
+	// Save this image into the PFM file with name 'filename'. The colours are
+	// written as 32-bit floats without clamping or quantization, so high
+	// dynamic range values are kept.
+	// Warning: If 'filename' already exists, it will be overwritten.
+	bool savePfm(const std::string &filename) const;
+
+	// Write this image into the existing PNG file 'filename' with its top
+	// left corner at ('x', 'y'), leaving the rest of the file as it was.
+	// The file must be large enough and have the bit depth of 'tonemap'.
+	bool mergePng(const std::string &filename, uint x, uint y, int compression = -1, int num_threads = 1,
+				  const ToneMapSettings &tonemap = ToneMapSettings()) const;
+
+	// Write this image into the existing PFM file 'filename' with its top
+	// left corner at ('x', 'y'). Only the pixels of the window are written.
+	bool mergePfm(const std::string &filename, uint x, uint y) const;
 
 	const double *data() const;
 	double *data();
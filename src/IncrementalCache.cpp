@@ -0,0 +1,306 @@
+#include "IncrementalCache.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+
+//---------------------------------------------------------------------------------------
+static bool same_light(const Light &a, const Light &b)
+{
+	return a.colour == b.colour && a.position == b.position &&
+		   a.falloff[0] == b.falloff[0] && a.falloff[1] == b.falloff[1] && a.falloff[2] == b.falloff[2];
+}
+
+//---------------------------------------------------------------------------------------
+bool IncrementalKey::operator==(const IncrementalKey &other) const
+{
+	if (lights.size() != other.lights.size())
+	{
+		return false;
+	}
+	for (size_t i = 0; i < lights.size(); i++)
+	{
+		if (!same_light(lights[i], other.lights[i]))
+		{
+			return false;
+		}
+	}
+
+	return view == other.view && root == other.root && ambient == other.ambient &&
+		   aa_max_samples == other.aa_max_samples && aa_threshold == other.aa_threshold &&
+		   passes == other.passes && min_passes == other.min_passes &&
+		   variance_threshold == other.variance_threshold &&
+		   light_samples == other.light_samples && light_cutoff == other.light_cutoff &&
+		   max_depth == other.max_depth && min_throughput == other.min_throughput &&
+		   roulette_threshold == other.roulette_threshold;
+}
+
+//---------------------------------------------------------------------------------------
+void TileFootprint::reset(bool bounded, const glm::vec3 &bounds_lo, const glm::vec3 &bounds_hi)
+{
+	touched.clear();
+	has_segments = false;
+	escapes = false;
+	scene_bounded = bounded;
+	scene_lo = bounds_lo;
+	scene_hi = bounds_hi;
+}
+
+//---------------------------------------------------------------------------------------
+void TileFootprint::addSegment(const glm::vec3 &a, const glm::vec3 &b)
+{
+	glm::vec3 seg_lo = glm::min(a, b);
+	glm::vec3 seg_hi = glm::max(a, b);
+
+	lo = has_segments ? glm::min(lo, seg_lo) : seg_lo;
+	hi = has_segments ? glm::max(hi, seg_hi) : seg_hi;
+	has_segments = true;
+}
+
+//---------------------------------------------------------------------------------------
+void TileFootprint::addEscape(const glm::vec3 &origin, const glm::vec3 &direction)
+{
+	escapes = true;
+	if (!scene_bounded)
+	{
+		return;
+	}
+
+	// Clip the ray to the bounds of the scene, where it could still be
+	// blocked by something moved into its way
+	double t0 = 0.0;
+	double t1 = std::numeric_limits<double>::infinity();
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (direction[axis] == 0.0f)
+		{
+			if (origin[axis] < scene_lo[axis] || origin[axis] > scene_hi[axis])
+			{
+				return;
+			}
+			continue;
+		}
+
+		double near = (scene_lo[axis] - origin[axis]) / direction[axis];
+		double far = (scene_hi[axis] - origin[axis]) / direction[axis];
+		if (near > far)
+		{
+			std::swap(near, far);
+		}
+		t0 = std::max(t0, near);
+		t1 = std::min(t1, far);
+	}
+
+	if (t0 <= t1)
+	{
+		addSegment(origin + (float)t0 * direction, origin + (float)t1 * direction);
+	}
+}
+
+//---------------------------------------------------------------------------------------
+void TileFootprint::finish()
+{
+	std::sort(touched.begin(), touched.end());
+	touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+}
+
+//---------------------------------------------------------------------------------------
+bool TileFootprint::touches(const std::vector<unsigned int> &ids) const
+{
+	// Both lists are sorted, so they can be walked together
+	size_t i = 0, j = 0;
+	while (i < touched.size() && j < ids.size())
+	{
+		if (touched[i] == ids[j])
+		{
+			return true;
+		}
+		if (touched[i] < ids[j])
+		{
+			i++;
+		}
+		else
+		{
+			j++;
+		}
+	}
+	return false;
+}
+
+//---------------------------------------------------------------------------------------
+bool TileFootprint::mayHit(const glm::vec3 &box_lo, const glm::vec3 &box_hi) const
+{
+	// Rays that left the scene were only kept up to its bounds, so a box
+	// reaching outside them could be on their way
+	if (escapes)
+	{
+		if (!scene_bounded)
+		{
+			return true;
+		}
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (box_lo[axis] < scene_lo[axis] || box_hi[axis] > scene_hi[axis])
+			{
+				return true;
+			}
+		}
+	}
+
+	if (!has_segments)
+	{
+		return false;
+	}
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (box_hi[axis] < lo[axis] || box_lo[axis] > hi[axis])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//---------------------------------------------------------------------------------------
+IncrementalCache::IncrementalCache()
+	: m_filled(false), m_sceneBounded(false)
+{
+}
+
+//---------------------------------------------------------------------------------------
+bool IncrementalCache::matches(const IncrementalKey &key) const
+{
+	return m_filled && m_key == key;
+}
+
+//---------------------------------------------------------------------------------------
+bool IncrementalCache::changes(const Scene &scene, std::vector<unsigned int> &ids,
+							   std::vector<glm::vec3> &box_lo, std::vector<glm::vec3> &box_hi) const
+{
+	bool bounded = true;
+
+	// A node reached along several paths is matched up path by path, in
+	// the order the scene graph is walked
+	std::unordered_map<const GeometryNode *, std::vector<size_t>> old_places;
+	for (size_t i = 0; i < m_placements.size(); i++)
+	{
+		old_places[m_placements[i].node].push_back(i);
+	}
+
+	std::vector<char> matched(m_placements.size(), 0);
+	std::unordered_map<const GeometryNode *, size_t> seen;
+
+	for (size_t i = 0; i < scene.size(); i++)
+	{
+		const SceneInstance &instance = scene.instance(i);
+		size_t occurrence = seen[instance.node]++;
+
+		bool same = false;
+		auto found = old_places.find(instance.node);
+		if (found != old_places.end() && occurrence < found->second.size())
+		{
+			const Placement &old = m_placements[found->second[occurrence]];
+			matched[found->second[occurrence]] = 1;
+			same = old.trans == instance.trans && old.material == instance.node->m_material;
+		}
+
+		if (!same)
+		{
+			ids.push_back(instance.node->m_nodeId);
+			if (instance.bounded)
+			{
+				box_lo.push_back(instance.lo);
+				box_hi.push_back(instance.hi);
+			}
+			else
+			{
+				bounded = false;
+			}
+		}
+	}
+
+	// Instances that are gone only matter to the tiles that hit them
+	for (size_t i = 0; i < m_placements.size(); i++)
+	{
+		if (!matched[i])
+		{
+			ids.push_back(m_placements[i].node->m_nodeId);
+		}
+	}
+
+	std::sort(ids.begin(), ids.end());
+	ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+	return bounded;
+}
+
+//---------------------------------------------------------------------------------------
+void IncrementalCache::prepare(const IncrementalKey &key, int num_tiles, const Scene &scene, bool keep)
+{
+	m_key = key;
+	m_filled = false;
+
+	m_placements.clear();
+	m_sceneBounded = scene.size() > 0;
+	m_sceneLo = m_sceneHi = glm::vec3(0.0);
+	for (size_t i = 0; i < scene.size(); i++)
+	{
+		const SceneInstance &instance = scene.instance(i);
+
+		Placement placement;
+		placement.node = instance.node;
+		placement.trans = instance.trans;
+		placement.material = instance.node->m_material;
+		m_placements.push_back(placement);
+
+		// An instance without bounds makes the whole scene unbounded
+		m_sceneBounded = m_sceneBounded && instance.bounded;
+		if (m_sceneBounded)
+		{
+			m_sceneLo = i ? glm::min(m_sceneLo, instance.lo) : instance.lo;
+			m_sceneHi = i ? glm::max(m_sceneHi, instance.hi) : instance.hi;
+		}
+	}
+
+	if (!keep)
+	{
+		m_footprints.resize(num_tiles);
+		for (int tile = 0; tile < num_tiles; tile++)
+		{
+			resetTile(tile);
+		}
+	}
+}
+
+//---------------------------------------------------------------------------------------
+void IncrementalCache::markFilled(const Image &image)
+{
+	m_image = image;
+	m_filled = true;
+}
+
+//---------------------------------------------------------------------------------------
+void IncrementalCache::clear()
+{
+	m_filled = false;
+	m_footprints.clear();
+	m_placements.clear();
+}
+
+//---------------------------------------------------------------------------------------
+void IncrementalCache::resetTile(int tile)
+{
+	m_footprints[tile].reset(m_sceneBounded, m_sceneLo, m_sceneHi);
+}
+
+//---------------------------------------------------------------------------------------
+TileFootprint &IncrementalCache::footprint(int tile)
+{
+	return m_footprints[tile];
+}
+
+//---------------------------------------------------------------------------------------
+const Image &IncrementalCache::image() const
+{
+	return m_image;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <list>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "GBuffer.hpp"
+#include "Image.hpp"
+#include "Light.hpp"
+#include "Scene.hpp"
+
+// What an incremental render must share with the one before it for its
+// image to be reused. Anything here changes every pixel, so only the scene
+// graph may differ.
+struct IncrementalKey
+{
+	GBufferView view;
+	const SceneNode *root;
+
+	glm::vec3 ambient;
+	std::vector<Light> lights;
+
+	// Quality settings
+	int aa_max_samples;
+	double aa_threshold;
+	int passes, min_passes;
+	double variance_threshold;
+	int light_samples;
+	double light_cutoff;
+	int max_depth;
+	double min_throughput;
+	double roulette_threshold;
+
+	bool operator==(const IncrementalKey &other) const;
+};
+
+// What the rays of one tile met in the last render: the nodes they hit, and
+// a box around the reflection and shadow rays, which can be hit by geometry
+// moved into their way. The primary rays are not included, since they are
+// covered by the tile's view frustum.
+struct TileFootprint
+{
+	// Ids of the nodes hit, sorted once the tile is done
+	std::vector<unsigned int> touched;
+
+	// Box around the secondary rays, clipped to the bounds of the scene at
+	// the time
+	bool has_segments;
+	glm::vec3 lo, hi;
+
+	// Whether a secondary ray left the bounds of the scene, and what they
+	// were. Rays that leave an unbounded scene cannot be clipped.
+	bool escapes;
+	bool scene_bounded;
+	glm::vec3 scene_lo, scene_hi;
+
+	// Forget everything, ready for rays in a scene with the given bounds
+	void reset(bool bounded, const glm::vec3 &bounds_lo, const glm::vec3 &bounds_hi);
+
+	void touch(unsigned int id)
+	{
+		if (touched.empty() || touched.back() != id)
+		{
+			touched.push_back(id);
+		}
+	}
+
+	// Add the ray segment from 'a' to 'b', or a ray that hits nothing
+	void addSegment(const glm::vec3 &a, const glm::vec3 &b);
+	void addEscape(const glm::vec3 &origin, const glm::vec3 &direction);
+
+	// Sort and remove duplicates from the touched nodes
+	void finish();
+
+	// Whether any node in the sorted list 'ids' was hit
+	bool touches(const std::vector<unsigned int> &ids) const;
+
+	// Whether a secondary ray could pass through the box
+	bool mayHit(const glm::vec3 &box_lo, const glm::vec3 &box_hi) const;
+};
+
+/**
+ * The image of the last incremental render and the footprint of each of its
+ * tiles, with the placement and material of every instance it saw.
+ *
+ * When the next render shares its key, the instances that moved, changed
+ * material, or came or went are found by comparing the scene with the last
+ * one. Only tiles that touched one of their nodes, or whose rays could reach
+ * where they are now, need to be traced again.
+ *
+ * Only the transforms of the instances and the material objects they point
+ * to are compared. Edits to a primitive's own parameters, to the values of
+ * a material in place, or a mesh reloaded in place are not noticed, so the
+ * render after such an edit needs incremental = false.
+ */
+class IncrementalCache
+{
+  public:
+	IncrementalCache();
+
+	// Whether the cache holds a render for 'key'
+	bool matches(const IncrementalKey &key) const;
+
+	// The nodes of 'scene' that differ from the last render, sorted, and the
+	// boxes where they are now. Returns false if a changed instance has no
+	// bounds, so any tile could see it.
+	bool changes(const Scene &scene, std::vector<unsigned int> &ids,
+				 std::vector<glm::vec3> &box_lo, std::vector<glm::vec3> &box_hi) const;
+
+	// Start a render of 'scene' for 'key'. Unless 'keep' is set, every
+	// footprint is forgotten.
+	void prepare(const IncrementalKey &key, int num_tiles, const Scene &scene, bool keep);
+
+	// Record that the render is complete with 'image' as its result.
+	void markFilled(const Image &image);
+	void clear();
+
+	// Forget the footprint of a tile that is about to be traced again
+	void resetTile(int tile);
+
+	TileFootprint &footprint(int tile);
+	const Image &image() const;
+
+  private:
+	// An instance as a render saw it
+	struct Placement
+	{
+		const GeometryNode *node;
+		glm::mat4 trans;
+		const Material *material;
+	};
+
+	IncrementalKey m_key;
+	bool m_filled;
+
+	Image m_image;
+	std::vector<TileFootprint> m_footprints;
+	std::vector<Placement> m_placements;
+
+	bool m_sceneBounded;
+	glm::vec3 m_sceneLo, m_sceneHi;
+};
@@ -0,0 +1,255 @@
+#include "LightTree.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+// Brightness of a colour, used as the power of a light
+static double light_power(const Light *light)
+{
+	return 0.2126 * light->colour.r + 0.7152 * light->colour.g + 0.0722 * light->colour.b;
+}
+
+// Distance at which a light adds less than 'cutoff' to every colour
+// component, from its falloff. Lights without a cutoff, or whose falloff
+// does not grow with distance, reach everywhere.
+static double light_radius(const Light *light, double cutoff)
+{
+	double brightest = std::max(light->colour.r, std::max(light->colour.g, light->colour.b));
+	if (cutoff <= 0.0)
+	{
+		return std::numeric_limits<double>::infinity();
+	}
+	if (brightest <= 0.0)
+	{
+		return 0.0;
+	}
+
+	// Solve falloff[0] + falloff[1] * d + falloff[2] * d^2 = brightest / cutoff
+	const double *falloff = light->falloff;
+	double c = falloff[0] - brightest / cutoff;
+	if (c >= 0.0)
+	{
+		return 0.0;
+	}
+	if (falloff[2] > 0.0)
+	{
+		return (-falloff[1] + sqrt(falloff[1] * falloff[1] - 4.0 * falloff[2] * c)) / (2.0 * falloff[2]);
+	}
+	if (falloff[1] > 0.0)
+	{
+		return -c / falloff[1];
+	}
+	return std::numeric_limits<double>::infinity();
+}
+
+//---------------------------------------------------------------------------------------
+LightTree::LightTree(const std::list<Light *> &lights, double cutoff)
+	: m_size(lights.size()),
+	  m_cutoff(cutoff)
+{
+	if (lights.empty())
+	{
+		return;
+	}
+
+	std::vector<const Light *> sorted(lights.begin(), lights.end());
+	m_nodes.reserve(2 * sorted.size() - 1);
+	m_nodes.resize(1);
+	build(sorted, 0, sorted.size(), 0);
+}
+
+//---------------------------------------------------------------------------------------
+size_t LightTree::size() const
+{
+	return m_size;
+}
+
+//---------------------------------------------------------------------------------------
+void LightTree::build(std::vector<const Light *> &lights, size_t begin, size_t end, int index)
+{
+	Node node;
+	node.lower = glm::vec3(std::numeric_limits<float>::max());
+	node.upper = glm::vec3(-std::numeric_limits<float>::max());
+	node.reach_lower = node.lower;
+	node.reach_upper = node.upper;
+	node.power = 0.0;
+	node.radius = 0.0;
+	node.falloff[0] = node.falloff[1] = node.falloff[2] = std::numeric_limits<double>::max();
+	node.child = -1;
+	node.light = NULL;
+
+	for (size_t i = begin; i < end; i++)
+	{
+		const Light *light = lights[i];
+		node.lower = glm::min(node.lower, light->position);
+		node.upper = glm::max(node.upper, light->position);
+
+		double radius = light_radius(light, m_cutoff);
+		node.reach_lower = glm::min(node.reach_lower, light->position - (float)radius);
+		node.reach_upper = glm::max(node.reach_upper, light->position + (float)radius);
+		node.radius = radius;
+
+		node.power += light_power(light);
+		for (int k = 0; k < 3; k++)
+		{
+			node.falloff[k] = std::min(node.falloff[k], light->falloff[k]);
+		}
+	}
+
+	if (end - begin == 1)
+	{
+		node.light = lights[begin];
+		m_nodes[index] = node;
+		return;
+	}
+
+	// Split at the median along the longest side of the bounds
+	glm::vec3 extent = node.upper - node.lower;
+	int axis = 0;
+	if (extent[1] > extent[axis])
+		axis = 1;
+	if (extent[2] > extent[axis])
+		axis = 2;
+
+	size_t middle = (begin + end) / 2;
+	std::nth_element(lights.begin() + begin, lights.begin() + middle, lights.begin() + end,
+					 [axis](const Light *a, const Light *b) {
+						 return a->position[axis] < b->position[axis];
+					 });
+
+	node.child = m_nodes.size();
+	m_nodes[index] = node;
+	m_nodes.resize(m_nodes.size() + 2);
+
+	build(lights, begin, middle, node.child);
+	build(lights, middle, end, node.child + 1);
+}
+
+//---------------------------------------------------------------------------------------
+bool LightTree::reaches(const Node &node, const glm::vec3 &point) const
+{
+	if (point.x < node.reach_lower.x || point.y < node.reach_lower.y || point.z < node.reach_lower.z ||
+		point.x > node.reach_upper.x || point.y > node.reach_upper.y || point.z > node.reach_upper.z)
+	{
+		return false;
+	}
+
+	// A single light reaches a sphere, not the whole box
+	return node.child >= 0 || glm::length(point - node.light->position) <= node.radius;
+}
+
+//---------------------------------------------------------------------------------------
+double LightTree::importance(const Node &node, const glm::vec3 &point, const glm::vec3 &normal) const
+{
+	if (!reaches(node, point))
+	{
+		return 0.0;
+	}
+
+	// Lights that are all behind the surface cannot light it
+	bool in_front = false;
+	for (int i = 0; i < 8 && !in_front; i++)
+	{
+		glm::vec3 corner((i & 1) ? node.upper.x : node.lower.x,
+						 (i & 2) ? node.upper.y : node.lower.y,
+						 (i & 4) ? node.upper.z : node.lower.z);
+		in_front = glm::dot(corner - point, normal) > 0.0f;
+	}
+	if (!in_front)
+	{
+		return 0.0;
+	}
+
+	// The closest any of the lights could be, for the least attenuation
+	glm::vec3 centre = 0.5f * (node.lower + node.upper);
+	double radius = glm::length(node.upper - centre);
+	double distance = std::max(glm::length(point - centre) - radius, 0.0);
+
+	double attenuation = node.falloff[0] + node.falloff[1] * distance + node.falloff[2] * distance * distance;
+	return node.power / std::max(attenuation, 1e-6);
+}
+
+//---------------------------------------------------------------------------------------
+const Light *LightTree::sample(const glm::vec3 &point, const glm::vec3 &normal, double u, double &pdf) const
+{
+	if (m_nodes.empty())
+	{
+		return NULL;
+	}
+
+	pdf = 1.0;
+	const Node *node = &m_nodes[0];
+
+	while (node->child >= 0)
+	{
+		const Node &left = m_nodes[node->child];
+		const Node &right = m_nodes[node->child + 1];
+
+		double left_importance = importance(left, point, normal);
+		double right_importance = importance(right, point, normal);
+		double total = left_importance + right_importance;
+		if (total <= 0.0)
+		{
+			return NULL;
+		}
+
+		// Choose a child and rescale 'u' so it can be used again below
+		double p = left_importance / total;
+		if (u < p)
+		{
+			u = u / p;
+			pdf *= p;
+			node = &left;
+		}
+		else
+		{
+			u = (u - p) / (1.0 - p);
+			pdf *= 1.0 - p;
+			node = &right;
+		}
+		u = std::min(u, 1.0 - 1e-9);
+	}
+
+	// A single light can still be behind the surface
+	if (m_nodes.size() == 1 && importance(*node, point, normal) <= 0.0)
+	{
+		return NULL;
+	}
+
+	return node->light;
+}
+
+//---------------------------------------------------------------------------------------
+void LightTree::lightsNear(const glm::vec3 &point, std::vector<const Light *> &lights) const
+{
+	lights.clear();
+	if (m_nodes.empty())
+	{
+		return;
+	}
+
+	// Walk down every branch whose influence reaches the point
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const Node &node = m_nodes[stack[--top]];
+		if (!reaches(node, point))
+		{
+			continue;
+		}
+
+		if (node.child < 0)
+		{
+			lights.push_back(node.light);
+		}
+		else
+		{
+			stack[top++] = node.child + 1;
+			stack[top++] = node.child;
+		}
+	}
+}
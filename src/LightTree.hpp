@@ -0,0 +1,72 @@
+#pragma once
+
+#include <list>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Light.hpp"
+
+/**
+ * A bounding volume hierarchy over the point lights of a scene, used to
+ * pick lights at random in proportion to an estimate of how much each one
+ * lights a point.
+ *
+ * Every node keeps the bounds of its lights, their total power and the
+ * smallest falloff coefficients among them, which together bound how bright
+ * the lights below it can be at a given distance. Picking a light walks down
+ * from the root choosing between children by that estimate, so the cost is
+ * logarithmic in the number of lights.
+ *
+ * Given a cutoff, each light also gets an influence radius beyond which it
+ * adds less than the cutoff to any colour component. The tree can then list
+ * just the lights whose influence reaches a point, and never picks a light
+ * for a point out of its reach.
+ */
+class LightTree
+{
+  public:
+	LightTree(const std::list<Light *> &lights, double cutoff = 0.0);
+
+	// Number of lights in the tree
+	size_t size() const;
+
+	// Pick a light for the surface at 'point' with normal 'normal' using the
+	// random number 'u' in [0, 1). Returns NULL when no light can reach the
+	// point, otherwise sets 'pdf' to the probability of the light picked.
+	const Light *sample(const glm::vec3 &point, const glm::vec3 &normal, double u, double &pdf) const;
+
+	// Replace the contents of 'lights' with the lights whose influence
+	// reaches 'point'.
+	void lightsNear(const glm::vec3 &point, std::vector<const Light *> &lights) const;
+
+  private:
+	struct Node
+	{
+		// Bounds of the light positions
+		glm::vec3 lower, upper;
+
+		// Bounds of the space the lights have influence over
+		glm::vec3 reach_lower, reach_upper;
+
+		// Total brightness of the lights, and their smallest falloff
+		double power;
+		double falloff[3];
+
+		// Influence radius of a leaf's light
+		double radius;
+
+		// Index of the first child, with the second straight after it, or -1
+		// for a leaf holding a single light
+		int child;
+		const Light *light;
+	};
+
+	void build(std::vector<const Light *> &lights, size_t begin, size_t end, int index);
+	double importance(const Node &node, const glm::vec3 &point, const glm::vec3 &normal) const;
+	bool reaches(const Node &node, const glm::vec3 &point) const;
+
+	std::vector<Node> m_nodes;
+	size_t m_size;
+	double m_cutoff;
+};
@@ -1,15 +1,189 @@
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <csignal>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
 #include "scene_lua.hpp"
+#include "RenderServer.hpp"
+#include "TileFarm.hpp"
+#include "Trace.hpp"
+
+// Start 'count' worker processes running 'filename' for a coordinator on
+// this machine, passing on the time budget if there is one
+static std::vector<pid_t> spawn_workers(const char *program, int count, int port,
+                                        const char *time_budget, const std::string &filename)
+{
+  std::vector<pid_t> workers;
+  std::string address = "127.0.0.1:" + std::to_string(port);
+
+  for (int i = 0; i < count; i++)
+  {
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      std::vector<const char *> args;
+      args.push_back(program);
+      args.push_back("--worker");
+      args.push_back(address.c_str());
+      if (time_budget)
+      {
+        args.push_back("--time-budget");
+        args.push_back(time_budget);
+      }
+      args.push_back(filename.c_str());
+      args.push_back(NULL);
+
+      execv(program, (char *const *)&args[0]);
+      std::cerr << "Could not start a worker: " << strerror(errno) << std::endl;
+      _exit(1);
+    }
+    else if (pid > 0)
+    {
+      workers.push_back(pid);
+    }
+  }
+
+  return workers;
+}
 
 int main(int argc, char **argv)
 {
+  // A reader of a tile stream going away through a FIFO or standard output
+  // should end the stream, not the render. Sockets are written without
+  // raising the signal.
+  signal(SIGPIPE, SIG_IGN);
+
   std::string filename = "assets/simple.lua";
-  if (argc >= 2)
+  std::string server_path;
+  std::string trace_path;
+  const char *time_budget = NULL;
+
+  // Distributed rendering
+  std::string coordinator_address;
+  int coordinator_port = 0;
+  int num_workers = 0;
+  std::string worker_address;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--time-budget") == 0 && i + 1 < argc)
+    {
+      // Seconds each render may take before it stops with what it has
+      time_budget = argv[++i];
+      set_default_time_budget(atof(time_budget));
+    }
+    else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+    {
+      // Seconds between checkpoints of each render, kept next to its
+      // output. Running the same script again carries on from them.
+      set_checkpoint_interval(atof(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+    {
+      // Append the statistics of each render to this file as JSON
+      set_stats_file(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+    {
+      // Write a timeline of the run that chrome://tracing or Perfetto can
+      // open
+      trace_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc)
+    {
+      // Keep running and take render jobs from a Unix domain socket
+      server_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--coordinator") == 0 && i + 1 < argc)
+    {
+      // Share the tiles of each render with workers connecting to this
+      // port, on the loopback address unless given as address:port
+      std::string listen = argv[++i];
+      size_t colon = listen.rfind(':');
+      if (colon != std::string::npos)
+      {
+        coordinator_address = listen.substr(0, colon);
+        listen = listen.substr(colon + 1);
+      }
+      coordinator_port = atoi(listen.c_str());
+    }
+    else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+    {
+      // Start this many workers on this machine for the coordinator
+      num_workers = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc)
+    {
+      // Render tiles for the coordinator at host:port
+      worker_address = argv[++i];
+    }
+    else
+    {
+      filename = argv[i];
+    }
+  }
+
+  if (!trace_path.empty())
+  {
+    trace_start(trace_path);
+  }
+
+  if (!server_path.empty())
+  {
+    RenderServer server(server_path);
+    bool served = server.run();
+    trace_finish();
+    return served ? 0 : 1;
+  }
+
+  TileFarm *farm = NULL;
+  std::vector<pid_t> workers;
+  if (coordinator_port > 0)
+  {
+    farm = new TileFarm(true, coordinator_address, coordinator_port);
+    if (!farm->isOpen())
+    {
+      return 1;
+    }
+    workers = spawn_workers(argv[0], num_workers, coordinator_port, time_budget, filename);
+  }
+  else if (!worker_address.empty())
+  {
+    size_t colon = worker_address.rfind(':');
+    if (colon == std::string::npos)
+    {
+      std::cerr << "Expected host:port after --worker, not " << worker_address << std::endl;
+      return 1;
+    }
+    farm = new TileFarm(false, worker_address.substr(0, colon), atoi(worker_address.c_str() + colon + 1));
+  }
+  set_tile_farm(farm);
+
+  bool ok = run_lua(filename);
+
+  // Workers still starting up are told there is nothing left to render
+  if (farm && farm->isCoordinator())
+  {
+    farm->finishRenders();
+  }
+  for (pid_t worker : workers)
+  {
+    waitpid(worker, NULL, 0);
+  }
+  if (farm && farm->isCoordinator())
   {
-    filename = argv[1];
+    farm->endRender();
   }
+  delete farm;
+  trace_finish();
 
-  if (!run_lua(filename))
+  if (!ok)
   {
     std::cerr << "Could not open " << filename << std::endl;
     return 1;
@@ -1,6 +1,7 @@
 #include "Material.hpp"
 
-Material::Material()
+Material::Material(MaterialType type)
+    : m_materialType(type)
 {
 }
 
@@ -1,10 +1,20 @@
 #pragma once
 
+// The kinds of material, so that shading can tell them apart without RTTI
+enum class MaterialType
+{
+  Phong
+};
+
 class Material
 {
 public:
   virtual ~Material();
 
+  MaterialType m_materialType;
+
 protected:
-  Material();
+  // Every kind of material gives its own tag, which decides how the scene
+  // reads its parameters
+  explicit Material(MaterialType type);
 };
@@ -7,6 +7,9 @@
 
 #define Raytracer_INFINITY std::numeric_limits<double>::infinity()
 
+// Object id of an intersection that has not hit anything
+#define Raytracer_NO_OBJECT ((unsigned int)-1)
+
 // Determines the inverse of the projection matrix based on the parameters
 static glm::mat4 Raytracer_get_proj_inverse(int width, int height, double fov, double dist, const glm::vec3 &eye, const glm::vec3 &view, const glm::vec3 &up)
 {
@@ -52,9 +55,11 @@ class Intersection
     glm::vec3 point; // intersection point
     glm::vec3 normal;
     const Material *material;
+    unsigned int object_id; // id of the node that was hit
+    unsigned int material_index; // index into the material table of the render
 
-    Intersection() : point(glm::vec3(Raytracer_INFINITY, Raytracer_INFINITY, Raytracer_INFINITY)), normal(glm::vec3(0.0, 0.0, 0.0)), material(NULL) {}
-    Intersection(glm::vec3 &p, glm::vec3 &n, const Material *m) : point(p), normal(n), material(m) {}
+    Intersection() : point(glm::vec3(Raytracer_INFINITY, Raytracer_INFINITY, Raytracer_INFINITY)), normal(glm::vec3(0.0, 0.0, 0.0)), material(NULL), object_id(Raytracer_NO_OBJECT), material_index(0) {}
+    Intersection(glm::vec3 &p, glm::vec3 &n, const Material *m) : point(p), normal(n), material(m), object_id(Raytracer_NO_OBJECT), material_index(0) {}
 
     // Transforms the intersection
     void transform(const glm::mat4 transform)
@@ -80,6 +85,8 @@ class Intersection
         point = intersection.point;
         normal = intersection.normal;
         material = intersection.material;
+        object_id = intersection.object_id;
+        material_index = intersection.material_index;
     }
 };
 
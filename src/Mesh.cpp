@@ -5,10 +5,14 @@
 
 // #include "cs488-framework/ObjFileDecoder.hpp"
 #include "Mesh.hpp"
+#include "RenderCounters.hpp"
+#include "Trace.hpp"
 
 Mesh::Mesh(const std::string &fname)
 	: m_vertices(), m_faces(), m_bounding(NULL)
 {
+	TRACE_SCOPE("Mesh::Mesh");
+
 	std::string code;
 	double vx, vy, vz;
 	size_t s1, s2, s3;
@@ -63,6 +67,23 @@ NonhierBox *Mesh::getBounding(const std::vector<glm::vec3> &vertices)
 	return box;
 }
 
+// Gets the box around the vertices
+bool Mesh::bounds(glm::vec3 &lo, glm::vec3 &hi) const
+{
+	if (m_vertices.empty())
+	{
+		return false;
+	}
+
+	lo = hi = m_vertices[0];
+	for (const glm::vec3 &vertex : m_vertices)
+	{
+		lo = glm::min(lo, vertex);
+		hi = glm::max(hi, vertex);
+	}
+	return true;
+}
+
 // Intersection for the mesh
 bool Mesh::intersect(const Ray &ray, Intersection &intersection) const
 {
@@ -77,6 +98,9 @@ bool Mesh::intersect(const Ray &ray, Intersection &intersection) const
 		return false;
 	}
 
+	// Every face is tested
+	rt_counters.triangle_tests += m_faces.size();
+
 	double epsilon = std::numeric_limits<double>::epsilon();
 
 	// Attempted design but failed causing a mesh of non-sense
@@ -42,6 +42,7 @@ class Mesh : public Primitive
 	Mesh(const std::string &fname);
 
 	virtual bool intersect(const Ray &ray, Intersection &intersection) const;
+	virtual bool bounds(glm::vec3 &lo, glm::vec3 &hi) const;
 	NonhierBox *getBounding(const std::vector<glm::vec3> &vertices);
 
   private:
@@ -2,7 +2,7 @@
 
 PhongMaterial::PhongMaterial(
 	const glm::vec3 &kd, const glm::vec3 &ks, double shininess)
-	: m_kd(kd), m_ks(ks), m_shininess(shininess)
+	: Material(MaterialType::Phong), m_kd(kd), m_ks(ks), m_shininess(shininess)
 {
 }
 
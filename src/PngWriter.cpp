@@ -0,0 +1,649 @@
+#include "PngWriter.hpp"
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <cstdio>
+
+// Size of the compressed output buffer, and so the largest IDAT chunk we write
+#define PNG_IDAT_SIZE (64 * 1024)
+
+#define PNG_FILTER_COUNT 5
+
+static const unsigned char PNG_SIGNATURE[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+// Stores a 32-bit value in network byte order
+static void png_put_u32(unsigned char *out, uint value)
+{
+	out[0] = (value >> 24) & 0xFF;
+	out[1] = (value >> 16) & 0xFF;
+	out[2] = (value >> 8) & 0xFF;
+	out[3] = value & 0xFF;
+}
+
+// Paeth predictor as defined by the PNG specification
+static unsigned char png_paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+// Applies filter 'type' to 'row', writing the result to 'out'. Returns the
+// sum of the filtered bytes taken as signed values, which is the usual
+// heuristic for how well the row will compress.
+static unsigned long png_filter_row(int type, const unsigned char *row, const unsigned char *prev, size_t size, size_t bpp, unsigned char *out)
+{
+	unsigned long sum = 0;
+	for (size_t i = 0; i < size; i++)
+	{
+		int a = (i >= bpp) ? row[i - bpp] : 0;
+		int b = prev[i];
+		int c = (i >= bpp) ? prev[i - bpp] : 0;
+
+		unsigned char value = row[i];
+		switch (type)
+		{
+		case 1:
+			value -= a;
+			break;
+		case 2:
+			value -= b;
+			break;
+		case 3:
+			value -= (a + b) / 2;
+			break;
+		case 4:
+			value -= png_paeth(a, b, c);
+			break;
+		default:
+			break;
+		}
+
+		out[i] = value;
+		sum += (value < 128) ? value : 256 - value;
+	}
+	return sum;
+}
+
+// Writes a chunk with its length and CRC
+static bool png_write_chunk(FILE *file, const char *type, const unsigned char *data, size_t size)
+{
+	unsigned char length[4], crc[4];
+	png_put_u32(length, size);
+
+	uLong check = crc32(0L, Z_NULL, 0);
+	check = crc32(check, (const Bytef *)type, 4);
+	if (size > 0)
+	{
+		check = crc32(check, data, size);
+	}
+	png_put_u32(crc, check);
+
+	bool ok = fwrite(length, 1, 4, file) == 4 &&
+			  fwrite(type, 1, 4, file) == 4 &&
+			  (size == 0 || fwrite(data, 1, size, file) == size) &&
+			  fwrite(crc, 1, 4, file) == 4;
+
+	if (!ok)
+	{
+		std::cerr << "encoder error: failed writing " << type << " chunk" << std::endl;
+	}
+	return ok;
+}
+
+// Writes the signature and image header for truecolour, no interlacing
+static bool png_write_header(FILE *file, uint width, uint height, int bit_depth)
+{
+	unsigned char header[13];
+	png_put_u32(header, width);
+	png_put_u32(header + 4, height);
+	header[8] = bit_depth;
+	header[9] = 2;
+	header[10] = 0;
+	header[11] = 0;
+	header[12] = 0;
+
+	if (fwrite(PNG_SIGNATURE, 1, sizeof(PNG_SIGNATURE), file) != sizeof(PNG_SIGNATURE))
+	{
+		std::cerr << "encoder error: failed writing signature" << std::endl;
+		return false;
+	}
+	return png_write_chunk(file, "IHDR", header, sizeof(header));
+}
+
+// Filters a single row with every filter type, and writes the filter type
+// byte followed by the residuals of whichever gave the smallest sum to
+// 'out'. 'scratch' must hold PNG_FILTER_COUNT rows.
+static void png_filter_best(const unsigned char *row, const unsigned char *prev, size_t stride, size_t bpp, unsigned char *scratch, unsigned char *out)
+{
+	int best = 0;
+	unsigned long best_sum = 0;
+	for (int type = 0; type < PNG_FILTER_COUNT; type++)
+	{
+		unsigned long sum = png_filter_row(type, row, prev, stride, bpp, scratch + type * stride);
+		if (type == 0 || sum < best_sum)
+		{
+			best = type;
+			best_sum = sum;
+		}
+	}
+
+	out[0] = best;
+	memcpy(out + 1, scratch + best * stride, stride);
+}
+
+// Filters rows [y0, y1) of a packed RGB image into 'out'
+static void png_filter_rows(const unsigned char *rgb, size_t stride, size_t bpp, uint y0, uint y1, unsigned char *out)
+{
+	std::vector<unsigned char> scratch(stride * PNG_FILTER_COUNT);
+	std::vector<unsigned char> zeros(stride, 0);
+
+	for (uint y = y0; y < y1; y++)
+	{
+		const unsigned char *row = rgb + y * stride;
+		const unsigned char *prev = (y == 0) ? &zeros[0] : row - stride;
+
+		png_filter_best(row, prev, stride, bpp, &scratch[0], out);
+		out += 1 + stride;
+	}
+}
+
+//---------------------------------------------------------------------------------------
+PngWriter::PngWriter()
+	: m_file(NULL),
+	  m_streamOpen(false),
+	  m_width(0),
+	  m_height(0),
+	  m_bitDepth(8),
+	  m_rowsWritten(0)
+{
+}
+
+//---------------------------------------------------------------------------------------
+PngWriter::~PngWriter()
+{
+	if (m_streamOpen)
+	{
+		deflateEnd(&m_stream);
+	}
+	if (m_file)
+	{
+		fclose(m_file);
+	}
+}
+
+//---------------------------------------------------------------------------------------
+bool PngWriter::open(const std::string &filename, uint width, uint height, int level, int bit_depth)
+{
+	m_file = fopen(filename.c_str(), "wb");
+	if (!m_file)
+	{
+		std::cerr << "encoder error: could not open " << filename << std::endl;
+		return false;
+	}
+
+	m_width = width;
+	m_height = height;
+	m_bitDepth = bit_depth;
+	m_rowsWritten = 0;
+
+	size_t stride = m_width * 3 * (m_bitDepth / 8);
+	m_previous.assign(stride, 0);
+	m_filtered.resize(1 + stride);
+	m_scratch.resize(stride * PNG_FILTER_COUNT);
+	m_out.resize(PNG_IDAT_SIZE);
+
+	memset(&m_stream, 0, sizeof(m_stream));
+	if (deflateInit(&m_stream, level) != Z_OK)
+	{
+		std::cerr << "encoder error: " << m_stream.msg << std::endl;
+		return false;
+	}
+	m_streamOpen = true;
+	m_stream.next_out = &m_out[0];
+	m_stream.avail_out = m_out.size();
+
+	return png_write_header(m_file, m_width, m_height, m_bitDepth);
+}
+
+//---------------------------------------------------------------------------------------
+bool PngWriter::deflateRow(int flush)
+{
+	while (true)
+	{
+		int ret = deflate(&m_stream, flush);
+		if (ret == Z_STREAM_ERROR)
+		{
+			std::cerr << "encoder error: deflate failed" << std::endl;
+			return false;
+		}
+
+		// Emit an IDAT chunk whenever the output buffer fills, or at the end
+		size_t pending = m_out.size() - m_stream.avail_out;
+		if (m_stream.avail_out == 0 || (ret == Z_STREAM_END && pending > 0))
+		{
+			if (!png_write_chunk(m_file, "IDAT", &m_out[0], pending))
+			{
+				return false;
+			}
+			m_stream.next_out = &m_out[0];
+			m_stream.avail_out = m_out.size();
+		}
+
+		if (flush == Z_FINISH)
+		{
+			if (ret == Z_STREAM_END)
+				return true;
+		}
+		else if (m_stream.avail_in == 0 && m_stream.avail_out > 0)
+		{
+			return true;
+		}
+	}
+}
+
+//---------------------------------------------------------------------------------------
+bool PngWriter::writeRows(const unsigned char *rows, uint count)
+{
+	if (!m_streamOpen)
+	{
+		return false;
+	}
+
+	size_t bpp = 3 * (m_bitDepth / 8);
+	size_t stride = m_width * bpp;
+
+	for (uint r = 0; r < count && m_rowsWritten < m_height; r++, m_rowsWritten++)
+	{
+		const unsigned char *row = rows + r * stride;
+
+		png_filter_best(row, &m_previous[0], stride, bpp, &m_scratch[0], &m_filtered[0]);
+		memcpy(&m_previous[0], row, stride);
+
+		m_stream.next_in = &m_filtered[0];
+		m_stream.avail_in = 1 + stride;
+		if (!deflateRow(Z_NO_FLUSH))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------------------------------
+bool PngWriter::close()
+{
+	if (!m_streamOpen)
+	{
+		return false;
+	}
+
+	if (m_rowsWritten != m_height)
+	{
+		std::cerr << "encoder error: only " << m_rowsWritten << " of " << m_height << " rows written" << std::endl;
+	}
+
+	m_stream.next_in = Z_NULL;
+	m_stream.avail_in = 0;
+	bool ok = deflateRow(Z_FINISH);
+
+	deflateEnd(&m_stream);
+	m_streamOpen = false;
+
+	ok = ok && png_write_chunk(m_file, "IEND", NULL, 0);
+	ok = (fclose(m_file) == 0) && ok;
+	m_file = NULL;
+
+	return ok && m_rowsWritten == m_height;
+}
+
+//---------------------------------------------------------------------------------------
+PngStreamer::PngStreamer(const std::string &filename, uint width, uint height, int level, const ToneMapSettings &tonemap)
+	: m_filename(filename),
+	  m_width(width),
+	  m_height(height),
+	  m_mapper(tonemap),
+	  m_ok(false),
+	  m_done(height, false),
+	  m_image(NULL),
+	  m_started(false),
+	  m_finished(false)
+{
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_rowReady, NULL);
+
+	m_ok = m_writer.open(m_filename, m_width, m_height, level, m_mapper.bitDepth());
+	if (m_ok)
+	{
+		m_started = pthread_create(&m_thread, NULL, EncoderThread_Run, this) == 0;
+		m_ok = m_started;
+	}
+}
+
+//---------------------------------------------------------------------------------------
+PngStreamer::~PngStreamer()
+{
+	if (m_started && !m_finished)
+	{
+		// Release the encoder thread from any rows that never arrived
+		pthread_mutex_lock(&m_lock);
+		m_finished = true;
+		pthread_cond_signal(&m_rowReady);
+		pthread_mutex_unlock(&m_lock);
+
+		pthread_join(m_thread, NULL);
+	}
+
+	pthread_cond_destroy(&m_rowReady);
+	pthread_mutex_destroy(&m_lock);
+}
+
+//---------------------------------------------------------------------------------------
+void PngStreamer::rowDone(const Image &image, uint y)
+{
+	pthread_mutex_lock(&m_lock);
+	m_image = &image;
+	m_done[y] = true;
+	pthread_cond_signal(&m_rowReady);
+	pthread_mutex_unlock(&m_lock);
+}
+
+//---------------------------------------------------------------------------------------
+void *PngStreamer::EncoderThread_Run(void *streamer)
+{
+	static_cast<PngStreamer *>(streamer)->encode();
+	return NULL;
+}
+
+//---------------------------------------------------------------------------------------
+void PngStreamer::encode()
+{
+	std::vector<unsigned char> rows;
+	uint next = 0;
+
+	while (next < m_height)
+	{
+		// Wait for the next row from the top to be finished, then take
+		// every finished row that directly follows it
+		pthread_mutex_lock(&m_lock);
+		while (!m_done[next] && !m_finished)
+		{
+			pthread_cond_wait(&m_rowReady, &m_lock);
+		}
+		if (!m_done[next])
+		{
+			pthread_mutex_unlock(&m_lock);
+			return;
+		}
+
+		uint end = next + 1;
+		while (end < m_height && m_done[end])
+		{
+			end++;
+		}
+		const Image *image = m_image;
+		pthread_mutex_unlock(&m_lock);
+
+		// Finished rows are never written again, so they can be read
+		// without holding the lock
+		uint count = end - next;
+		rows.resize(count * m_width * m_mapper.bytesPerPixel());
+		m_mapper.mapRows(*image, next, count, &rows[0]);
+
+		if (m_ok && !m_writer.writeRows(&rows[0], count))
+		{
+			m_ok = false;
+		}
+		next = end;
+	}
+}
+
+//---------------------------------------------------------------------------------------
+bool PngStreamer::finish()
+{
+	if (!m_started)
+	{
+		return false;
+	}
+
+	// Release the encoder thread from any rows that never arrived, such
+	// as those of a render that stopped early
+	pthread_mutex_lock(&m_lock);
+	m_finished = true;
+	pthread_cond_broadcast(&m_rowReady);
+	pthread_mutex_unlock(&m_lock);
+
+	pthread_join(m_thread, NULL);
+
+	uint missing = std::count(m_done.begin(), m_done.end(), false);
+	bool ok = m_writer.close() && m_ok && missing == 0;
+	if (missing > 0)
+	{
+		std::cerr << "encoder error: " << missing << " rows of " << m_filename << " were never rendered" << std::endl;
+	}
+	else if (!ok)
+	{
+		std::cerr << "encoder error: could not stream " << m_filename << std::endl;
+	}
+	return ok;
+}
+
+//---------------------------------------------------------------------------------------
+PngPreviewWriter::PngPreviewWriter(const std::string &filename, double interval, const ToneMapSettings &tonemap)
+	: m_filename(filename),
+	  m_interval(interval),
+	  m_tonemap(tonemap),
+	  m_last(std::chrono::steady_clock::now())
+{
+}
+
+//---------------------------------------------------------------------------------------
+void PngPreviewWriter::passDone(const Image &image, int /* pass */)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (std::chrono::duration<double>(now - m_last).count() < m_interval)
+	{
+		return;
+	}
+	m_last = now;
+
+	// Write next to the preview and move it into place, so that a viewer
+	// never reads a half written file
+	std::string temp = m_filename + ".tmp";
+	if (!image.savePng(temp, 1, 1, m_tonemap) || rename(temp.c_str(), m_filename.c_str()) != 0)
+	{
+		std::cerr << "Could not write preview " << m_filename << std::endl;
+	}
+}
+
+// A horizontal strip of the image, deflated on its own thread by
+// png_write_parallel
+struct PngStrip
+{
+	const unsigned char *rgb;
+	size_t stride;
+	size_t bpp;
+
+	// Rows covered by the strip
+	uint y0, y1;
+
+	int level;
+	bool last;
+
+	// Raw deflate data, and the adler-32 of the uncompressed strip
+	std::vector<unsigned char> compressed;
+	uLong adler;
+	bool ok;
+};
+
+static void *PngStrip_Run(void *strip_args)
+{
+	PngStrip &strip = *static_cast<PngStrip *>(strip_args);
+	size_t row_size = 1 + strip.stride;
+
+	// Deflate can refer back up to 32K into data it has already seen. The
+	// strips are compressed independently, so each one re-filters the rows
+	// that precede it and primes the compressor with their last 32K. The
+	// concatenated strips decode to the same data as a single continuous
+	// stream, and compress nearly as well, though the bytes differ where
+	// each strip is flushed and restarted.
+	uint window_rows = (32768 + row_size - 1) / row_size;
+	uint dict_y = (strip.y0 > window_rows) ? strip.y0 - window_rows : 0;
+
+	std::vector<unsigned char> filtered((strip.y1 - dict_y) * row_size + 1);
+	png_filter_rows(strip.rgb, strip.stride, strip.bpp, dict_y, strip.y1, &filtered[0]);
+
+	unsigned char *data = &filtered[(strip.y0 - dict_y) * row_size];
+	size_t size = (strip.y1 - strip.y0) * row_size;
+	size_t dict_size = std::min<size_t>(data - &filtered[0], 32768);
+
+	strip.adler = adler32(adler32(0L, Z_NULL, 0), data, size);
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	strip.ok = deflateInit2(&stream, strip.level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	if (!strip.ok)
+	{
+		return NULL;
+	}
+	if (dict_size > 0)
+	{
+		deflateSetDictionary(&stream, data - dict_size, dict_size);
+	}
+
+	// Every strip but the last ends on a byte-aligned sync point rather
+	// than a final block, so the next strip can follow straight after it
+	int flush = strip.last ? Z_FINISH : Z_SYNC_FLUSH;
+
+	strip.compressed.resize(deflateBound(&stream, size) + 64);
+	stream.next_in = data;
+	stream.avail_in = size;
+	stream.next_out = &strip.compressed[0];
+	stream.avail_out = strip.compressed.size();
+
+	while (true)
+	{
+		int ret = deflate(&stream, flush);
+		if (ret == Z_STREAM_ERROR)
+		{
+			strip.ok = false;
+			break;
+		}
+		if ((flush == Z_FINISH && ret == Z_STREAM_END) ||
+			(flush != Z_FINISH && stream.avail_in == 0 && stream.avail_out > 0))
+		{
+			break;
+		}
+
+		// Out of room, so grow the buffer and carry on
+		size_t used = stream.total_out;
+		strip.compressed.resize(strip.compressed.size() * 2);
+		stream.next_out = &strip.compressed[used];
+		stream.avail_out = strip.compressed.size() - used;
+	}
+
+	strip.compressed.resize(stream.total_out);
+	deflateEnd(&stream);
+
+	return NULL;
+}
+
+//---------------------------------------------------------------------------------------
+bool png_write_parallel(const std::string &filename, const unsigned char *rgb, uint width, uint height, int bit_depth, int level, int num_threads)
+{
+	int num_strips = std::max(1, std::min<int>(num_threads, height));
+	std::vector<PngStrip> strips(num_strips);
+	std::vector<pthread_t> threads(num_strips);
+	std::vector<bool> started(num_strips, false);
+
+	size_t bpp = 3 * (bit_depth / 8);
+
+	for (int i = 0; i < num_strips; i++)
+	{
+		PngStrip &strip = strips[i];
+		strip.rgb = rgb;
+		strip.stride = width * bpp;
+		strip.bpp = bpp;
+		strip.y0 = (uint)((unsigned long)height * i / num_strips);
+		strip.y1 = (uint)((unsigned long)height * (i + 1) / num_strips);
+		strip.level = level;
+		strip.last = (i == num_strips - 1);
+		strip.ok = false;
+	}
+
+	// The first strip is compressed on this thread while the rest run
+	bool ok = true;
+	for (int i = 1; i < num_strips; i++)
+	{
+		started[i] = pthread_create(&threads[i], NULL, PngStrip_Run, &strips[i]) == 0;
+		if (!started[i])
+		{
+			PngStrip_Run(&strips[i]);
+		}
+	}
+	PngStrip_Run(&strips[0]);
+
+	for (int i = 1; i < num_strips; i++)
+	{
+		if (started[i])
+		{
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	// Combine the strip checksums into the one for the whole stream
+	uLong adler = strips[0].adler;
+	for (int i = 0; i < num_strips; i++)
+	{
+		ok = ok && strips[i].ok;
+		if (i > 0)
+		{
+			uLong size = (strips[i].y1 - strips[i].y0) * (1 + width * bpp);
+			adler = adler32_combine(adler, strips[i].adler, size);
+		}
+	}
+
+	if (!ok)
+	{
+		std::cerr << "encoder error: deflate failed" << std::endl;
+		return false;
+	}
+
+	// Wrap the raw deflate data in a zlib header and trailer
+	int flevel = (level == Z_DEFAULT_COMPRESSION) ? 2 : (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+	unsigned char header[2] = {0x78, (unsigned char)(flevel << 6)};
+	header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+
+	unsigned char trailer[4];
+	png_put_u32(trailer, adler);
+
+	strips.front().compressed.insert(strips.front().compressed.begin(), header, header + 2);
+	strips.back().compressed.insert(strips.back().compressed.end(), trailer, trailer + 4);
+
+	FILE *file = fopen(filename.c_str(), "wb");
+	if (!file)
+	{
+		std::cerr << "encoder error: could not open " << filename << std::endl;
+		return false;
+	}
+
+	ok = png_write_header(file, width, height, bit_depth);
+	for (int i = 0; i < num_strips && ok; i++)
+	{
+		ok = png_write_chunk(file, "IDAT", &strips[i].compressed[0], strips[i].compressed.size());
+	}
+	ok = ok && png_write_chunk(file, "IEND", NULL, 0);
+	ok = (fclose(file) == 0) && ok;
+
+	return ok;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdio>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <zlib.h>
+
+#include "Image.hpp"
+#include "RenderListener.hpp"
+#include "ToneMap.hpp"
+
+/**
+ * An incremental PNG encoder for 8 or 16-bit RGB images.
+ *
+ * Rows are handed over from top to bottom and are filtered and deflated
+ * as soon as they arrive, so a file can be written while the rest of the
+ * image is still being produced.
+ */
+class PngWriter
+{
+  public:
+	PngWriter();
+	~PngWriter();
+
+	// Create 'filename' and write the PNG header for an image of the given
+	// size. 'level' is the zlib compression level, trading size for speed.
+	bool open(const std::string &filename, uint width, uint height, int level = Z_DEFAULT_COMPRESSION, int bit_depth = 8);
+
+	// Append 'count' packed RGB rows to the image, 16-bit components are
+	// most significant byte first.
+	bool writeRows(const unsigned char *rows, uint count);
+
+	// Flush the compressed stream and finish the file. Every row of the image
+	// must have been written before calling this.
+	bool close();
+
+  private:
+	bool deflateRow(int flush);
+
+	FILE *m_file;
+	z_stream m_stream;
+	bool m_streamOpen;
+
+	uint m_width;
+	uint m_height;
+	int m_bitDepth;
+	uint m_rowsWritten;
+
+	// Unfiltered previous row, and the filtered row handed to zlib
+	std::vector<unsigned char> m_previous;
+	std::vector<unsigned char> m_filtered;
+	std::vector<unsigned char> m_scratch;
+	std::vector<unsigned char> m_out;
+};
+
+/**
+ * Streams an image into a PNG file while it is being rendered.
+ *
+ * Completed rows are reported through the RenderListener interface and a
+ * dedicated encoder thread compresses every contiguous run of finished rows
+ * from the top of the image, so once rendering ends only the last strip is
+ * left to encode.
+ */
+class PngStreamer : public RenderListener
+{
+  public:
+	PngStreamer(const std::string &filename, uint width, uint height, int level = Z_DEFAULT_COMPRESSION,
+				const ToneMapSettings &tonemap = ToneMapSettings());
+	virtual ~PngStreamer();
+
+	virtual void rowDone(const Image &image, uint y);
+
+	// Wait until the rows rendered so far have been encoded and close the
+	// file. Returns false if any row was never rendered, without waiting
+	// for it.
+	bool finish();
+
+  private:
+	static void *EncoderThread_Run(void *streamer);
+	void encode();
+
+	std::string m_filename;
+	uint m_width;
+	uint m_height;
+
+	ToneMapper m_mapper;
+	PngWriter m_writer;
+	bool m_ok;
+
+	// Row completion state, guarded by m_lock
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_rowReady;
+	std::vector<bool> m_done;
+	const Image *m_image;
+
+	pthread_t m_thread;
+	bool m_started;
+	bool m_finished;
+};
+
+/**
+ * Saves the image so far between the passes of a progressive render, at
+ * most once every 'interval' seconds.
+ */
+class PngPreviewWriter : public RenderListener
+{
+  public:
+	PngPreviewWriter(const std::string &filename, double interval,
+					 const ToneMapSettings &tonemap = ToneMapSettings());
+
+	virtual void passDone(const Image &image, int pass);
+
+  private:
+	std::string m_filename;
+	double m_interval;
+	ToneMapSettings m_tonemap;
+
+	std::chrono::steady_clock::time_point m_last;
+};
+
+// Write a packed RGB image to the PNG file 'filename', splitting it into
+// 'num_threads' strips that are deflated in parallel and joined into a
+// single valid stream. 'level' is the zlib compression level.
+bool png_write_parallel(const std::string &filename, const unsigned char *rgb, uint width, uint height, int bit_depth, int level, int num_threads);
@@ -1,4 +1,5 @@
 #include "Primitive.hpp"
+#include "RenderCounters.hpp"
 #include <iostream>
 
 Primitive::~Primitive()
@@ -15,6 +16,13 @@ bool Sphere::intersect(const Ray &ray, Intersection &intersection) const
     return sphere.intersect(ray, intersection);
 }
 
+bool Sphere::bounds(glm::vec3 &lo, glm::vec3 &hi) const
+{
+    lo = glm::vec3(-1.0);
+    hi = glm::vec3(1.0);
+    return true;
+}
+
 Cube::~Cube()
 {
 }
@@ -25,12 +33,21 @@ bool Cube::intersect(const Ray &ray, Intersection &intersection) const
     return box.intersect(ray, intersection);
 }
 
+bool Cube::bounds(glm::vec3 &lo, glm::vec3 &hi) const
+{
+    lo = glm::vec3(0.0);
+    hi = glm::vec3(1.0);
+    return true;
+}
+
 NonhierSphere::~NonhierSphere()
 {
 }
 
 bool NonhierSphere::intersect(const Ray &ray, Intersection &intersection) const
 {
+    rt_counters.sphere_tests++;
+
     // Have to compute the intersection of a sphere
 
     double roots[2];
@@ -83,12 +100,21 @@ bool NonhierSphere::intersect(const Ray &ray, Intersection &intersection) const
     return false;
 }
 
+bool NonhierSphere::bounds(glm::vec3 &lo, glm::vec3 &hi) const
+{
+    lo = m_pos - glm::vec3(m_radius);
+    hi = m_pos + glm::vec3(m_radius);
+    return true;
+}
+
 NonhierBox::~NonhierBox()
 {
 }
 
 bool NonhierBox::intersect(const Ray &ray, Intersection &intersection) const
 {
+    rt_counters.box_tests++;
+
     // Falling back on using the design that was used by the mesh checker
     // Consider the box as if it was a 3d polygon, then perform the check
     // based on this.
@@ -190,3 +216,10 @@ bool NonhierBox::intersect(const Ray &ray, Intersection &intersection) const
 
     return intersects;
 }
+
+bool NonhierBox::bounds(glm::vec3 &lo, glm::vec3 &hi) const
+{
+    lo = m_pos;
+    hi = m_pos + glm::vec3(m_size);
+    return true;
+}
@@ -15,6 +15,13 @@ public:
     // Always false as default
     return false;
   }
+
+  // Gives the corners of an axis-aligned box around the primitive, in its
+  // own coordinates. Returns false if the primitive has no finite bounds.
+  virtual bool bounds(glm::vec3 &, glm::vec3 &) const
+  {
+    return false;
+  }
 };
 
 class Sphere : public Primitive
@@ -22,6 +29,7 @@ class Sphere : public Primitive
 public:
   virtual ~Sphere();
   virtual bool intersect(const Ray &ray, Intersection &intersection) const;
+  virtual bool bounds(glm::vec3 &lo, glm::vec3 &hi) const;
 };
 
 class Cube : public Primitive
@@ -29,6 +37,7 @@ class Cube : public Primitive
 public:
   virtual ~Cube();
   virtual bool intersect(const Ray &ray, Intersection &intersection) const;
+  virtual bool bounds(glm::vec3 &lo, glm::vec3 &hi) const;
 };
 
 class NonhierSphere : public Primitive
@@ -40,6 +49,7 @@ public:
   }
   virtual ~NonhierSphere();
   virtual bool intersect(const Ray &ray, Intersection &intersection) const;
+  virtual bool bounds(glm::vec3 &lo, glm::vec3 &hi) const;
 
 private:
   glm::vec3 m_pos;
@@ -56,6 +66,7 @@ public:
 
   virtual ~NonhierBox();
   virtual bool intersect(const Ray &ray, Intersection &intersection) const;
+  virtual bool bounds(glm::vec3 &lo, glm::vec3 &hi) const;
 
 private:
   glm::vec3 m_pos;
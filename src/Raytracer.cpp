@@ -2,14 +2,269 @@
 
 #include <unistd.h>
 
-#include "A4.hpp"
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <typeinfo>
+#include <vector>
+
+#include "Raytracer.hpp"
 #include "MathHelper.hpp"
-#include "PhongMaterial.hpp"
+#include "LightTree.hpp"
+#include "Scene.hpp"
+#include "GBuffer.hpp"
+#include "RelightCache.hpp"
+#include "IncrementalCache.hpp"
+#include "WorkerPool.hpp"
+#include "TileFarm.hpp"
+#include "RenderCheckpoint.hpp"
+#include "RenderCounters.hpp"
+#include "Trace.hpp"
 
 #define THREAD_RENDER_INIT 0
 #define THREAD_RENDER_DONE 2
 
-// Defines the area of the image that the thread will be rendering
+// The image is split into square tiles of this size (in pixels) that the
+// threads take in turn
+#define RT_TILE_SIZE 32
+
+// The coarse preview of a time budgeted render takes one sample for each
+// square of this many pixels across
+#define RT_COARSE_STEP 4
+
+// The most passes a time budgeted render makes when no limit is given
+#define RT_BUDGET_MAX_PASSES 256
+
+// Number of lights each thread remembers the last occluder of
+#define RT_SHADOW_CACHE_SIZE 256
+
+// The tiles of the image that are still to be rendered. Tiles are handed
+// out in order from the top left, so whole rows of tiles finish in close
+// to top-to-bottom order.
+struct TileQueue
+{
+	int width, height;
+	int tiles_x, tiles_y;
+
+	// The tiles to hand out in this pass, and the next one to hand out
+	std::vector<int> order;
+	std::atomic<int> next;
+
+	// The number of finished tiles in each row of tiles
+	std::atomic<int> *row_done;
+
+	// Tiles with samples the checkpoint has not saved yet
+	std::atomic<char> *unsaved;
+
+	// Tiles given back by workers of a distributed render that went away,
+	// which are handed out again before the rest
+	std::vector<int> retry;
+	std::atomic<int> retry_count;
+	pthread_mutex_t retry_lock;
+
+	TileQueue(int w, int h)
+		: width(w), height(h),
+		  tiles_x((w + RT_TILE_SIZE - 1) / RT_TILE_SIZE),
+		  tiles_y((h + RT_TILE_SIZE - 1) / RT_TILE_SIZE)
+	{
+		next.store(0);
+		retry_count.store(0);
+		pthread_mutex_init(&retry_lock, NULL);
+		for (int i = 0; i < tiles_x * tiles_y; i++)
+		{
+			order.push_back(i);
+		}
+
+		row_done = new std::atomic<int>[tiles_y];
+		for (int i = 0; i < tiles_y; i++)
+		{
+			row_done[i].store(0);
+		}
+
+		unsaved = new std::atomic<char>[tiles_x * tiles_y];
+		for (int i = 0; i < tiles_x * tiles_y; i++)
+		{
+			unsaved[i].store(0);
+		}
+	}
+
+	// Hand out just the given tiles, from the start
+	void restart(const std::vector<int> &tiles)
+	{
+		order = tiles;
+		next.store(0);
+	}
+
+	// The next tile to render, or -1 when there are none left
+	int take()
+	{
+		if (retry_count.load() > 0)
+		{
+			pthread_mutex_lock(&retry_lock);
+			int tile = -1;
+			if (!retry.empty())
+			{
+				tile = retry.back();
+				retry.pop_back();
+				retry_count--;
+			}
+			pthread_mutex_unlock(&retry_lock);
+			if (tile >= 0)
+			{
+				return tile;
+			}
+		}
+
+		int index = next++;
+		return index < (int)order.size() ? order[index] : -1;
+	}
+
+	// Hand out a tile again
+	void giveBack(int tile)
+	{
+		pthread_mutex_lock(&retry_lock);
+		retry.push_back(tile);
+		retry_count++;
+		pthread_mutex_unlock(&retry_lock);
+	}
+
+	// The tiles given back and not handed out again
+	std::vector<int> takeRetries()
+	{
+		pthread_mutex_lock(&retry_lock);
+		std::vector<int> tiles;
+		tiles.swap(retry);
+		retry_count.store(0);
+		pthread_mutex_unlock(&retry_lock);
+		return tiles;
+	}
+
+	// The number of pixels in the tiles handed out
+	long pixels() const
+	{
+		long count = 0;
+		for (int tile : order)
+		{
+			int x0 = (tile % tiles_x) * RT_TILE_SIZE;
+			int y0 = (tile / tiles_x) * RT_TILE_SIZE;
+			count += (long)(std::min(x0 + RT_TILE_SIZE, width) - x0) * (std::min(y0 + RT_TILE_SIZE, height) - y0);
+		}
+		return count;
+	}
+
+	~TileQueue()
+	{
+		pthread_mutex_destroy(&retry_lock);
+		delete[] row_done;
+		delete[] unsaved;
+	}
+};
+
+// Samples accumulated over the passes of a progressive render
+struct ProgressiveState
+{
+	// The pass being rendered, starting from 0
+	int pass;
+
+	// Whether this pass is the coarse preview of a time budgeted render
+	bool coarse;
+
+	// When the time budget runs out, if there is one
+	bool has_deadline;
+	std::chrono::steady_clock::time_point deadline;
+
+	// Sum of the samples of each pixel, and of their displayed luminance
+	// and its square, from which the variance of the pixel is estimated
+	std::vector<glm::vec3> sum;
+	std::vector<double> sum_lum;
+	std::vector<double> sum_sq;
+
+	// For each tile, the number of samples each of its pixels has, its
+	// estimated error and whether it has stopped taking samples
+	std::vector<int> samples;
+	std::vector<double> error;
+	std::vector<char> converged;
+
+	ProgressiveState(int w, int h, int num_tiles)
+		: pass(0), coarse(false), has_deadline(false),
+		  sum(w * h, glm::vec3(0.0)),
+		  sum_lum(w * h, 0.0),
+		  sum_sq(w * h, 0.0),
+		  samples(num_tiles, 0),
+		  error(num_tiles, 0.0),
+		  converged(num_tiles, 0) {}
+
+	bool expired() const
+	{
+		return has_deadline && std::chrono::steady_clock::now() >= deadline;
+	}
+};
+
+// The first sample of every pixel of an adaptive render. Every tile is
+// sampled once before any is refined, so that pixels on the edge of a tile
+// can be compared with their neighbours in the next one.
+struct AdaptiveState
+{
+	// Whether this sweep takes the first samples, rather than refining them
+	bool sampling;
+
+	// The colour of the first sample of each pixel, and what it hit
+	std::vector<glm::vec3> colours;
+	std::vector<unsigned int> ids;
+
+	// Whether each tile has had its first samples taken
+	std::vector<char> sampled;
+
+	AdaptiveState(int w, int h, int num_tiles)
+		: sampling(false),
+		  colours(w * h, glm::vec3(0.0)),
+		  ids(w * h, Raytracer_NO_OBJECT),
+		  sampled(num_tiles, 0) {}
+};
+
+// The instance that last blocked the shadow rays to each light, kept by
+// each thread. Neighbouring hits are usually shadowed by the same object,
+// so it is worth testing before anything else.
+struct ShadowCache
+{
+	struct Entry
+	{
+		const Light *light;
+		int occluder;
+	};
+	Entry entries[RT_SHADOW_CACHE_SIZE];
+
+	// Shadow rays blocked by the remembered instance, and shadow rays that
+	// needed a search through the scene
+	long hits;
+	long misses;
+
+	ShadowCache()
+		: hits(0), misses(0)
+	{
+		for (Entry &entry : entries)
+		{
+			entry.light = NULL;
+			entry.occluder = -1;
+		}
+	}
+
+	Entry &lookup(const Light *light)
+	{
+		Entry &entry = entries[((uintptr_t)light / sizeof(Light)) % RT_SHADOW_CACHE_SIZE];
+		if (entry.light != light)
+		{
+			entry.light = light;
+			entry.occluder = -1;
+		}
+		return entry;
+	}
+};
+
+// Everything a thread needs to render its share of the image
 struct ThreadRenderMap
 {
 
@@ -19,46 +274,88 @@ struct ThreadRenderMap
 	// The width and height of the image
 	int width, height;
 
-	// The position where we start rendering
+	// The index of the thread, and where it gets its tiles from
 	int index;
-	int num_thread;
+	TileQueue *tiles;
 
 	SceneNode *root;
 
+	// Flattened scene for shadow rays, and this thread's shadow cache
+	const Scene *scene;
+	ShadowCache *shadow_cache;
+
 	glm::mat4 inv_proj;
 	const glm::vec3 &eye;
 
 	const glm::vec3 &ambient;
 	const std::list<Light *> &lights;
 
+	// Number of pixels rendered by the thread so far
 	int *progress;
 	int *status;
 
+	// Number of samples taken by the thread so far
+	long *samples;
+
+	RenderListener *listener;
+	const RenderSettings &settings;
+
+	// Tree to pick lights from when only some are sampled, otherwise NULL
+	const LightTree *light_tree;
+
+	// Accumulated samples when rendering progressively, otherwise NULL
+	ProgressiveState *progressive;
+
+	// The first samples of an adaptive render, otherwise NULL
+	AdaptiveState *adaptive;
+
+	// Cache of an incremental render, and the footprint of the tile being
+	// rendered, otherwise NULL
+	IncrementalCache *incremental;
+	TileFootprint *footprint;
+
+	// Where the cost of each sample is recorded, otherwise NULL
+	CostMap *cost_map;
+
+	// Where the work done by the thread is added up
+	RenderCounters *counters;
+
 	ThreadRenderMap(
 		Image &m_img,
-		int nthread,
+		TileQueue *queue,
 		int ind,
 		int w, int h,
 		SceneNode *node,
+		const Scene *sc,
+		ShadowCache *cache,
 		glm::mat4 mat,
 		const glm::vec3 &e,
 		const glm::vec3 &a,
 		const std::list<Light *> &ls,
-		int *prog, int *stat)
+		int *prog, int *stat,
+		long *samp,
+		RenderListener *lis,
+		const RenderSettings &set,
+		const LightTree *tree,
+		ProgressiveState *prog_state)
 		: img(m_img),
-		  num_thread(nthread), index(ind),
 		  width(w), height(h),
-		  root(node), inv_proj(mat),
+		  index(ind), tiles(queue),
+		  root(node), scene(sc), shadow_cache(cache),
+		  inv_proj(mat),
 		  eye(e), ambient(a),
-		  lights(ls), progress(prog), status(stat) {}
+		  lights(ls), progress(prog), status(stat),
+		  samples(samp),
+		  listener(lis), settings(set), light_tree(tree),
+		  progressive(prog_state), adaptive(NULL),
+		  incremental(NULL), footprint(NULL), cost_map(NULL), counters(NULL) {}
 };
 
-glm::vec3 rt_lighting(Ray &ray, Intersection intersection, const Light *light)
+static glm::vec3 rt_phong_lighting(Ray &ray, const Intersection &intersection, const SceneMaterial &material, const Light *light)
 {
 	// Get details from intersection
 	glm::vec3 point = intersection.point;
 	glm::vec3 normal = intersection.normal;
-	const PhongMaterial *material = dynamic_cast<const PhongMaterial *>(intersection.material);
 
 	// We need to setup a couple of variables for the lights
 	// For this we need to figure out how far from the surface point
@@ -87,291 +384,2433 @@ glm::vec3 rt_lighting(Ray &ray, Intersection intersection, const Light *light)
 	// To determine the brightness, we look at the two vectors
 	// Specifically the normal of the surface and where the light is pointing
 	double diffuse_brightness = std::max(0.0f, glm::dot(normal, light_direction));
-	glm::vec3 diffuse = diffuse_brightness * material->diffuse() * lcolour;
+	glm::vec3 diffuse = diffuse_brightness * material.kd * lcolour;
 
 	// Compute all the specular components
 	double specular_brightness = 0;
 	if (diffuse_brightness > 0)
 	{
 		double base = std::max(0.0f, glm::dot(camera_eye, reflected));
-		specular_brightness = pow(base, material->shininess());
+		specular_brightness = pow(base, material.shininess);
 	}
 	else
 	{
 		specular_brightness = 0.0;
 	}
-	glm::vec3 specular = specular_brightness * material->specular() * lcolour;
+	glm::vec3 specular = specular_brightness * material.ks * lcolour;
 
 	glm::vec3 lighting = diffuse + specular;
 	return lighting;
 }
 
-glm::vec3 trace_ray(Ray &ray, SceneNode *root, glm::vec3 &background, const glm::vec3 &ambient, const std::list<Light *> &lights, int recurse_level)
+// Light reflected towards the ray's origin from 'light', shaded according
+// to the type of the material
+glm::vec3 rt_lighting(Ray &ray, const Intersection &intersection, const SceneMaterial &material, const Light *light)
 {
-	// Assume that the colour is the background
-	glm::vec3 colour = background;
-	Intersection inter;
+	switch (material.type)
+	{
+	case MaterialType::Phong:
+		return rt_phong_lighting(ray, intersection, material, light);
+	}
+	return glm::vec3(0.0);
+}
 
-	double epsilon = std::numeric_limits<double>::epsilon();
-	double shift_epsilon = 0.01;
+// Everything trace_ray needs to know about the scene, along with the state
+// of the random numbers used by the rays of one sample
+struct TraceContext
+{
+	SceneNode *root;
+	const Scene *scene;
+	ShadowCache *shadow_cache;
 
-	bool intersected = root->intersect(ray, inter);
-	if (intersected)
-	{
+	const glm::vec3 &ambient;
+	const std::list<Light *> &lights;
 
-		// We need to calculate the hit point
-		// Note: We move the above just a little way from the object
-		glm::vec3 hit = inter.point + shift_epsilon * inter.normal;
+	// Tree over the lights when they are sampled or culled, otherwise NULL
+	const LightTree *light_tree;
 
-		// Get the material that we intersected with
-		const PhongMaterial *material = dynamic_cast<const PhongMaterial *>(inter.material);
-		colour = ambient * material->diffuse();
+	// Light sampling and path termination settings
+	const RenderSettings &settings;
 
-		// We have two iterate through the light sources with two things in mind
-		// First: Can the intersection see a light source? (Shadows)
-		// Second Lighting of the object
-		for (Light *light : lights)
-		{
-			// Create the shadow ray (from point of hit to the light position)
-			glm::vec3 lightIncident = glm::normalize(light->position - hit);
-			Ray shadow_ray(hit, lightIncident);
-			Intersection s_inter;
+	// Lights that reach the current hit, when culling
+	std::vector<const Light *> nearby;
 
-			if (root->intersect(shadow_ray, s_inter))
-			{
-				double dist1 = glm::length(s_inter.point - shadow_ray.origin);
-				double dist2 = glm::length(light->position - shadow_ray.origin);
+	// Where the hits are recorded when capturing for relighting, otherwise
+	// NULL
+	RelightTile *relight;
 
-				// Make sure that the intersection occurs before the light source
-				// If this intersection does not, then there is a problem
-				if (fabs(dist2 - dist1) > epsilon)
-				{
-					continue;
-				}
-			}
+	// What the rays meet is recorded here for incremental renders,
+	// otherwise NULL
+	TileFootprint *footprint;
 
-			// We now add the lighting compone for it
-			colour = colour + rt_lighting(ray, inter, light);
-		}
+	unsigned int rng;
 
-		// Added reflection
-		glm::vec3 reflected_colour(0.0);
-		if (recurse_level > 0)
-		{
-			Ray reflected_ray(hit, ray.direction - glm::dot(2 * ray.direction, inter.normal) * inter.normal);
-			reflected_colour = trace_ray(reflected_ray, root, reflected_colour, ambient, lights, --recurse_level);
-		}
+	TraceContext(SceneNode *node, const Scene *sc, ShadowCache *cache,
+				 const glm::vec3 &a, const std::list<Light *> &ls,
+				 const LightTree *tree, const RenderSettings &set, unsigned int seed)
+		: root(node), scene(sc), shadow_cache(cache),
+		  ambient(a), lights(ls),
+		  light_tree(tree), settings(set),
+		  relight(NULL), footprint(NULL),
+		  rng(seed ? seed : 1) {}
 
-		colour = colour + (1.0 / lights.size()) * reflected_colour * material->specular();
+	// A random number in [0, 1), from a xorshift generator
+	double random()
+	{
+		rng ^= rng << 13;
+		rng ^= rng >> 17;
+		rng ^= rng << 5;
+		return rng / 4294967296.0;
 	}
+};
 
-	return colour;
-}
-
-double rt_math_clamp(double value, double min, double max)
+// Whether instance 'index' blocks 'shadow_ray' on its way to a light
+// 'light_distance' away
+static bool rt_blocks_light(const Scene &scene, size_t index, Ray &shadow_ray, double light_distance)
 {
-	return (value < min) ? min : (value > max) ? max : value;
-}
+	double epsilon = std::numeric_limits<double>::epsilon();
+	Intersection s_inter;
 
-void *RenderThread_Run(void *thread_args)
-{
-	ThreadRenderMap renderMap = *static_cast<ThreadRenderMap *>(thread_args);
+	if (!scene.intersect(index, shadow_ray, s_inter))
+	{
+		return false;
+	}
 
-	// The initial y position is equal to the index of the thread
-	int init_y = renderMap.index;
-	int advance = renderMap.num_thread;
+	double dist1 = glm::length(s_inter.point - shadow_ray.origin);
 
-	// Dimensions of the image
-	int width = renderMap.width;
-	int height = renderMap.height;
+	// Make sure that the intersection occurs before the light source
+	// If this intersection does not, then there is a problem
+	return fabs(light_distance - dist1) > epsilon;
+}
 
-	// The number of pixels this thread is likely to render
-	int total_pixels = ceil((width * height) / renderMap.num_thread);
-	int count = 0;
+// Whether anything lies between the start of 'shadow_ray' and 'light'. The
+// instance that blocked the light last time on this thread is tried first,
+// and only if it misses is the rest of the scene searched.
+static bool rt_occluded(Ray &shadow_ray, const Light *light, TraceContext &context)
+{
+	const Scene &scene = *context.scene;
+	ShadowCache &cache = *context.shadow_cache;
+	ShadowCache::Entry &entry = cache.lookup(light);
+	double light_distance = glm::length(light->position - shadow_ray.origin);
+
+	rt_counters.shadow_rays++;
 
-	glm::mat4 inv_proj = renderMap.inv_proj;
-	glm::vec3 eye = renderMap.eye;
+	TileFootprint *footprint = context.footprint;
+	if (footprint)
+	{
+		footprint->addSegment(shadow_ray.origin, light->position);
+	}
 
-	// We now apply a pixel by pixel basis for rendering
-	for (int y = init_y; y < height; y += advance)
+	if (entry.occluder >= 0 && rt_blocks_light(scene, entry.occluder, shadow_ray, light_distance))
 	{
-		for (int x = 0; x < width; x++)
+		cache.hits++;
+		if (footprint)
 		{
+			footprint->touch(scene.instance(entry.occluder).node->m_nodeId);
+		}
+		return true;
+	}
+	cache.misses++;
 
-			// We need to get pixel onto projection plane
-			glm::vec4 pixel(x, y, 0.0, 1.0);
-			glm::vec4 pixel_world = inv_proj * pixel;
+	// Any blocker will do, so the search stops at the first
+	for (size_t i = 0; i < scene.size(); i++)
+	{
+		if ((int)i != entry.occluder && rt_blocks_light(scene, i, shadow_ray, light_distance))
+		{
+			entry.occluder = i;
+			if (footprint)
+			{
+				footprint->touch(scene.instance(i).node->m_nodeId);
+			}
+			return true;
+		}
+	}
 
-			// Take the world pixel and convert it into a ray direction
-			glm::vec3 pworld = glm::vec3(pixel_world);
-			glm::vec3 rayDir = glm::normalize(pworld - eye);
+	return false;
+}
 
-			// Create a ray
-			Ray ray(eye, rayDir);
+// Light arriving from 'light' at the intersection, or nothing if something
+// is in the way
+static glm::vec3 rt_direct_light(Ray &ray, const Intersection &inter, const SceneMaterial &material, const glm::vec3 &hit, const Light *light, TraceContext &context)
+{
+	// Create the shadow ray (from point of hit to the light position)
+	glm::vec3 lightIncident = glm::normalize(light->position - hit);
+	Ray shadow_ray(hit, lightIncident);
 
-			// Create a three colour gradient background
-			glm::vec3 bg_colour(1 - ((double)x / width), 1 - ((double)y / height), 0.0);
+	if (rt_occluded(shadow_ray, light, context))
+	{
+		return glm::vec3(0.0);
+	}
 
-			// Launch the ray into the scene and determine the returned colour
-			glm::vec3 colour(0.0, 0.0, 0.0);
-			colour = trace_ray(ray, renderMap.root, bg_colour, renderMap.ambient, renderMap.lights, 1);
+	// We now add the lighting compone for it
+	return rt_lighting(ray, inter, material, light);
+}
 
-			// set RGB values in the image
-			renderMap.img(x, y, 0) = rt_math_clamp(colour.r, 0.0, 1.0);
-			renderMap.img(x, y, 1) = rt_math_clamp(colour.g, 0.0, 1.0);
-			renderMap.img(x, y, 2) = rt_math_clamp(colour.b, 0.0, 1.0);
+// Light arriving from every light at the intersection, recording the hit
+// and which of the lights are visible from it for relighting
+static glm::vec3 rt_capture_lights(Ray &ray, const Intersection &inter, const SceneMaterial &material, const glm::vec3 &hit,
+								   const glm::vec3 &throughput, TraceContext &context)
+{
+	RelightTile &tile = *context.relight;
+	size_t words = context.settings.relight->words();
+
+	RelightVertex vertex;
+	vertex.point = inter.point;
+	vertex.normal = inter.normal;
+	vertex.origin = ray.origin;
+	vertex.weight = throughput;
+	vertex.material = inter.material_index;
+	tile.vertices.push_back(vertex);
+
+	size_t first = tile.visibility.size();
+	tile.visibility.resize(first + words, 0);
+
+	glm::vec3 colour(0.0);
+	size_t j = 0;
+	for (Light *light : context.lights)
+	{
+		glm::vec3 lightIncident = glm::normalize(light->position - hit);
+		Ray shadow_ray(hit, lightIncident);
 
-			// Increment the number of pixels we have handled
-			count++;
-			*renderMap.progress = (int)((count * 100) / total_pixels);
+		if (!rt_occluded(shadow_ray, light, context))
+		{
+			tile.visibility[first + j / 64] |= (uint64_t)1 << (j % 64);
+			colour = colour + rt_lighting(ray, inter, material, light);
 		}
+		j++;
 	}
 
-	*renderMap.progress = 100;
-	*renderMap.status = THREAD_RENDER_DONE;
+	return colour;
 }
 
-void rt_Render(
-	// What to render
-	SceneNode *root,
+glm::vec3 trace_ray(Ray &ray, TraceContext &context, glm::vec3 &background, int recurse_level,
+					const glm::vec3 &throughput = glm::vec3(1.0), unsigned int *object_id = NULL);
 
-	// Image to write to, set to a given width and height
-	Image &image,
+// Colour seen along 'ray' at the intersection 'inter'. 'throughput' is how
+// much the colour will be scaled by on its way back to the camera, which
+// decides whether reflections are worth following.
+static glm::vec3 rt_shade_hit(Ray &ray, const Intersection &inter, TraceContext &context, int recurse_level, const glm::vec3 &throughput)
+{
+	rt_counters.shading_calls++;
 
-	// Viewing parameters
-	const glm::vec3 &eye,
-	const glm::vec3 &view,
-	const glm::vec3 &up,
-	double fovy,
+	double shift_epsilon = 0.01;
 
-	// Lighting parameters
-	const glm::vec3 &ambient,
-	const std::list<Light *> &lights)
-{
+	const std::list<Light *> &lights = context.lights;
 
-	const int PROGRAM_FAILURE = 4;
+	// We need to calculate the hit point
+	// Note: We move the above just a little way from the object
+	glm::vec3 hit = inter.point + shift_epsilon * inter.normal;
 
-	// Printing the details of the render system
-	std::cout << "Calling rt_Render(\n"
-			  << "\t" << *root << "\t"
-			  << "Image(width:" << image.width() << ", height:" << image.height() << ")\n"
-																					 "\t"
-			  << "eye:  " << glm::to_string(eye) << std::endl
-			  << "\t"
-			  << "view: " << glm::to_string(view) << std::endl
-			  << "\t"
-			  << "up:   " << glm::to_string(up) << std::endl
-			  << "\t"
-			  << "fovy: " << fovy << std::endl
-			  << "\t"
-			  << "ambient: " << glm::to_string(ambient) << std::endl
-			  << "\t"
-			  << "lights{" << std::endl;
+	// Get the material that we intersected with
+	const SceneMaterial &material = context.scene->material(inter.material_index);
+	glm::vec3 colour = context.ambient * material.kd;
 
-	for (const Light *light : lights)
+	// We have two iterate through the light sources with two things in mind
+	// First: Can the intersection see a light source? (Shadows)
+	// Second Lighting of the object
+	if (context.relight)
 	{
-		std::cout << "\t\t" << *light << std::endl;
+		colour = colour + rt_capture_lights(ray, inter, material, hit, throughput, context);
+	}
+	else if (context.light_tree && context.settings.light_samples > 0)
+	{
+		// Only a few lights are used, picked in proportion to how much
+		// they are likely to add and weighted so that the result is
+		// right on average
+		int samples = context.settings.light_samples;
+		for (int i = 0; i < samples; i++)
+		{
+			double pdf;
+			const Light *light = context.light_tree->sample(hit, inter.normal, context.random(), pdf);
+			if (light)
+			{
+				colour = colour + rt_direct_light(ray, inter, material, hit, light, context) * (float)(1.0 / (pdf * samples));
+			}
+		}
+	}
+	else if (context.light_tree)
+	{
+		// Lights too far away to make a difference are skipped, along
+		// with their shadow rays
+		context.light_tree->lightsNear(hit, context.nearby);
+		for (const Light *light : context.nearby)
+		{
+			colour = colour + rt_direct_light(ray, inter, material, hit, light, context);
+		}
+	}
+	else
+	{
+		for (Light *light : lights)
+		{
+			colour = colour + rt_direct_light(ray, inter, material, hit, light, context);
+		}
 	}
-	std::cout << "\t}" << std::endl;
-	std::cout << ")" << std::endl;
-
-	// Printing ends
-
-	// Get the project matrix inverted
-	double dist = glm::length(view);
-	glm::mat4 unproj = rt_get_proj_inverse(image.width(), image.height(), fovy, dist, eye, view, up);
-
-	size_t h = image.height();
-	size_t w = image.width();
 
-	// In order to speed up the process we are going to use multi-threading
-	// This is fairly easily in this case, as we are only really being read-only
-	// on the data
+	// Added reflection. The reflected colour is scaled down before it
+	// is added, and rays that could only add too little are not traced.
+	glm::vec3 reflectance = (float)(1.0 / lights.size()) * material.ks;
+	glm::vec3 reflected_throughput = throughput * reflectance;
+	double contribution = std::max(reflected_throughput.r, std::max(reflected_throughput.g, reflected_throughput.b));
 
-	const int num_threads = 8;
+	bool reflect = recurse_level > 0 && contribution > context.settings.min_throughput;
 
-	int thread_progress[num_threads];
-	int thread_status[num_threads];
-	ThreadRenderMap *renderMap[num_threads];
+	// Russian roulette: rays that would add little are traced only some
+	// of the time, and count for more when they are, so the image is
+	// right on average
+	double roulette = context.settings.roulette_threshold;
+	if (reflect && contribution < roulette)
+	{
+		double survival = contribution / roulette;
+		reflect = context.random() < survival;
+		reflectance /= survival;
+		reflected_throughput /= survival;
+	}
 
-	// We let each thread iterate over the entire x path then increment
-	// forward based on the y.  The result is that an entire 'row' is being
-	// handled by the threading manager
-	for (int i = 0; i < num_threads; i++)
+	glm::vec3 reflected_colour(0.0);
+	if (reflect)
 	{
-		thread_progress[i] = 0;
-		thread_status[i] = THREAD_RENDER_INIT;
+		Ray reflected_ray(hit, ray.direction - glm::dot(2 * ray.direction, inter.normal) * inter.normal);
+		reflected_colour = trace_ray(reflected_ray, context, reflected_colour, --recurse_level, reflected_throughput);
+	}
 
-		// Setup the details of the rendering platform
-		ThreadRenderMap *map = new ThreadRenderMap(
-			image,
-			num_threads,
-			i,
-			w, h,
-			root, unproj,
-			eye, ambient,
-			lights,
-			&thread_progress[i],
-			&thread_status[i]);
+	colour = colour + reflected_colour * reflectance;
 
-		renderMap[i] = map;
-	}
+	return colour;
+}
 
-	std::cout << "Rendering with " << num_threads << " threads." << std::endl;
+// Traces 'ray' into the scene, giving the background colour if it hits
+// nothing.
+glm::vec3 trace_ray(Ray &ray, TraceContext &context, glm::vec3 &background, int recurse_level,
+					const glm::vec3 &throughput, unsigned int *object_id)
+{
+	// Assume that the colour is the background
+	glm::vec3 colour = background;
+	Intersection inter;
 
-	pthread_t threads[num_threads];
-	int ret = 0;
-	for (int i = 0; i < num_threads; i++)
+	if (recurse_level == context.settings.max_depth)
 	{
-		ret = pthread_create(&threads[i], NULL, RenderThread_Run, renderMap[i]);
-		if (ret)
-		{
-			std::cerr << "Application had to abort:  pthread_Create failed with error code: " << ret << std::endl;
-			exit(PROGRAM_FAILURE);
-		}
+		rt_counters.primary_rays++;
+	}
+	else
+	{
+		rt_counters.reflection_rays++;
 	}
 
-	std::cout << "Starting rendering process" << std::endl;
-
-	const int update_interval = 100 * 1000; // 100 milliseconds in microseconds
+	bool intersected = context.root->intersect(ray, inter);
+	if (intersected)
+	{
+		inter.material_index = context.scene->materialIndex(inter.object_id);
+	}
 
-	bool is_processing = true;
-	while (is_processing)
+	// Let the caller know what was hit
+	if (object_id)
 	{
-		// Is the program done?
-		bool is_done = true;
-		for (int i = 0; i < num_threads; i++)
-		{
-			is_done = is_done && thread_status[i];
-		}
+		*object_id = intersected ? inter.object_id : Raytracer_NO_OBJECT;
+	}
 
-		// output the progress
-		int overall_progress = 0;
-		for (int i = 0; i < num_threads; i++)
+	// Record what the ray met for incremental renders. Primary rays are
+	// covered by the frustum of their tile, so only later rays need their
+	// path kept.
+	if (context.footprint)
+	{
+		if (intersected)
 		{
-			overall_progress += thread_progress[i];
+			context.footprint->touch(inter.object_id);
 		}
-		overall_progress = overall_progress / num_threads;
-
-		std::cout << "Progress: " << overall_progress << "% \r" << std::flush;
-
-		if (is_done)
+		if (recurse_level < context.settings.max_depth)
 		{
-			is_processing = false;
+			if (intersected)
+			{
+				context.footprint->addSegment(ray.origin, inter.point);
+			}
+			else
+			{
+				context.footprint->addEscape(ray.origin, ray.direction);
+			}
 		}
+	}
 
-		// Wait a bit before printing
-		usleep(update_interval);
+	if (intersected)
+	{
+		colour = rt_shade_hit(ray, inter, context, recurse_level, throughput);
 	}
 
-	std::cout << "Rendering process complete" << std::endl;
+	return colour;
+}
+
+// A hash of four numbers, used to seed random numbers so that they do not
+// depend on which thread renders a pixel
+static inline unsigned int rt_hash(unsigned int a, unsigned int b, unsigned int c, unsigned int d)
+{
+	unsigned int h = (a * 73856093u) ^ (b * 19349663u) ^ (c * 83492791u) ^ (d * 2654435761u);
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+// The ray through the point (x, y) of the image
+static Ray rt_primary_ray(const ThreadRenderMap &renderMap, double x, double y)
+{
+	// Place the pixels of a crop window within the whole frame
+	x += renderMap.settings.crop_x;
+	y += renderMap.settings.crop_y;
+
+	// We need to get pixel onto projection plane
+	glm::vec4 pixel(x, y, 0.0, 1.0);
+	glm::vec4 pixel_world = renderMap.inv_proj * pixel;
+
+	// Take the world pixel and convert it into a ray direction
+	glm::vec3 pworld = glm::vec3(pixel_world);
+	glm::vec3 rayDir = glm::normalize(pworld - renderMap.eye);
+
+	// Create a ray
+	return Ray(renderMap.eye, rayDir);
+}
+
+// Colour seen at the point (x, y) of the image when nothing is hit
+static glm::vec3 rt_background(const ThreadRenderMap &renderMap, double x, double y)
+{
+	const RenderSettings &settings = renderMap.settings;
+	x += settings.crop_x;
+	y += settings.crop_y;
+	double frame_width = settings.frame_width ? settings.frame_width : renderMap.width;
+	double frame_height = settings.frame_height ? settings.frame_height : renderMap.height;
+
+	// Create a three colour gradient background
+	return glm::vec3(1 - (x / frame_width), 1 - (y / frame_height), 0.0);
+}
+
+// Each sample position gets its own random numbers
+static unsigned int rt_sample_seed(const ThreadRenderMap &renderMap, double x, double y)
+{
+	x += renderMap.settings.crop_x;
+	y += renderMap.settings.crop_y;
+	return rt_hash((unsigned int)(x * 256.0), (unsigned int)(y * 256.0), 0, 2);
+}
+
+glm::vec3 rt_render_pixel(const ThreadRenderMap &renderMap, double x, double y, unsigned int *object_id = NULL)
+{
+	Ray ray = rt_primary_ray(renderMap, x, y);
+	glm::vec3 bg_colour = rt_background(renderMap, x, y);
+
+	TraceContext context(renderMap.root, renderMap.scene, renderMap.shadow_cache,
+						 renderMap.ambient, renderMap.lights,
+						 renderMap.light_tree, renderMap.settings, rt_sample_seed(renderMap, x, y));
+	context.footprint = renderMap.footprint;
+
+	// Launch the ray into the scene and determine the returned colour
+	if (!renderMap.cost_map)
+	{
+		return trace_ray(ray, context, bg_colour, renderMap.settings.max_depth, glm::vec3(1.0), object_id);
+	}
+
+	// Measure the sample, and add it to the pixel it falls in
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	long rays = rt_counters.rays();
+	long tests = rt_counters.primitiveTests();
+
+	unsigned int hit;
+	glm::vec3 colour = trace_ray(ray, context, bg_colour, renderMap.settings.max_depth, glm::vec3(1.0), &hit);
+	if (object_id)
+	{
+		*object_id = hit;
+	}
+
+	double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	int px = std::min(std::max((int)floor(x + 0.5), 0), renderMap.width - 1);
+	int py = std::min(std::max((int)floor(y + 0.5), 0), renderMap.height - 1);
+	renderMap.cost_map->add(px, py, elapsed, rt_counters.rays() - rays, rt_counters.primitiveTests() - tests, hit);
+
+	return colour;
+}
+
+// Renders a tile in two sweeps. First the primary ray of every pixel is
+// intersected with the scene and what it hit is written to the G-buffer,
+// then every pixel is shaded from the G-buffer. The first sweep is skipped
+// when the G-buffer already holds this view.
+static void rt_render_tile_deferred(const ThreadRenderMap &renderMap, int x0, int y0, int x1, int y1)
+{
+	GBuffer &gbuffer = *renderMap.settings.gbuffer;
+	int width = renderMap.width;
+
+	if (!gbuffer.filled())
+	{
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = x0; x < x1; x++)
+			{
+				int i = y * width + x;
+				Ray ray = rt_primary_ray(renderMap, x, y);
+				Intersection inter;
+
+				rt_counters.primary_rays++;
+				if (renderMap.root->intersect(ray, inter))
+				{
+					gbuffer.depth[i] = glm::length(inter.point - ray.origin);
+					gbuffer.normal[i] = inter.normal;
+					gbuffer.material[i] = renderMap.scene->materialIndex(inter.object_id);
+					gbuffer.object[i] = inter.object_id;
+				}
+				else
+				{
+					gbuffer.depth[i] = std::numeric_limits<float>::infinity();
+					gbuffer.normal[i] = glm::vec3(0.0);
+					gbuffer.material[i] = 0;
+					gbuffer.object[i] = Raytracer_NO_OBJECT;
+				}
+			}
+		}
+	}
+
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			int i = y * width + x;
+			Ray ray = rt_primary_ray(renderMap, x, y);
+			glm::vec3 colour;
+
+			if (std::isinf(gbuffer.depth[i]))
+			{
+				colour = rt_background(renderMap, x, y);
+			}
+			else
+			{
+				// Rebuild the intersection from the buffer
+				Intersection inter;
+				inter.point = ray.origin + gbuffer.depth[i] * ray.direction;
+				inter.normal = gbuffer.normal[i];
+				inter.material_index = gbuffer.material[i];
+				inter.object_id = gbuffer.object[i];
+
+				TraceContext context(renderMap.root, renderMap.scene, renderMap.shadow_cache,
+									 renderMap.ambient, renderMap.lights,
+									 renderMap.light_tree, renderMap.settings, rt_sample_seed(renderMap, x, y));
+				colour = rt_shade_hit(ray, inter, context, renderMap.settings.max_depth, glm::vec3(1.0));
+			}
+
+			renderMap.img(x, y, 0) = colour.r;
+			renderMap.img(x, y, 1) = colour.g;
+			renderMap.img(x, y, 2) = colour.b;
+		}
+	}
+}
+
+// Renders a tile with one sample per pixel, recording in the relighting
+// cache every hit along the way, which lights each hit can see, and the
+// background of the pixels that miss everything
+static void rt_render_tile_capture(const ThreadRenderMap &renderMap, int tile, int x0, int y0, int x1, int y1)
+{
+	RelightTile &cached = renderMap.settings.relight->tile(tile);
+	cached.x0 = x0;
+	cached.y0 = y0;
+	cached.x1 = x1;
+	cached.y1 = y1;
+	cached.first.clear();
+	cached.vertices.clear();
+	cached.visibility.clear();
+	cached.background.clear();
+
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			cached.first.push_back(cached.vertices.size());
+
+			Ray ray = rt_primary_ray(renderMap, x, y);
+			glm::vec3 bg_colour = rt_background(renderMap, x, y);
+
+			TraceContext context(renderMap.root, renderMap.scene, renderMap.shadow_cache,
+								 renderMap.ambient, renderMap.lights,
+								 renderMap.light_tree, renderMap.settings, rt_sample_seed(renderMap, x, y));
+			context.relight = &cached;
+
+			unsigned int object_id;
+			glm::vec3 colour = trace_ray(ray, context, bg_colour, renderMap.settings.max_depth, glm::vec3(1.0), &object_id);
+			cached.background.push_back(object_id == Raytracer_NO_OBJECT ? bg_colour : glm::vec3(0.0));
+
+			renderMap.img(x, y, 0) = colour.r;
+			renderMap.img(x, y, 1) = colour.g;
+			renderMap.img(x, y, 2) = colour.b;
+		}
+	}
+	cached.first.push_back(cached.vertices.size());
+}
+
+// Whether two samples are different enough that the pixels they are in
+// need more samples. Colours are compared as they will be displayed.
+static bool rt_samples_differ(const glm::vec3 &a, unsigned int a_id, const glm::vec3 &b, unsigned int b_id, double threshold)
+{
+	if (a_id != b_id)
+	{
+		return true;
+	}
+
+	glm::vec3 diff = glm::abs(glm::clamp(a, 0.0f, 1.0f) - glm::clamp(b, 0.0f, 1.0f));
+	return std::max(diff.r, std::max(diff.g, diff.b)) > threshold;
+}
+
+// Supersamples the square of side 'size' centred on (x, y), whose centre
+// has already been sampled. Each quadrant of the square is sampled at its
+// centre, and quadrants that still differ from the centre are split again
+// while there are samples left in 'budget'. Returns the average colour
+// over the square.
+static glm::vec3 rt_refine_square(const ThreadRenderMap &renderMap, double x, double y, double size,
+								  const glm::vec3 &centre, unsigned int centre_id, int &budget)
+{
+	if (budget < 4)
+	{
+		return centre;
+	}
+	budget -= 4;
+
+	double offset = size / 4.0;
+	glm::vec3 colours[4];
+	unsigned int ids[4];
+
+	for (int i = 0; i < 4; i++)
+	{
+		double qx = x + ((i & 1) ? offset : -offset);
+		double qy = y + ((i & 2) ? offset : -offset);
+		colours[i] = rt_render_pixel(renderMap, qx, qy, &ids[i]);
+	}
+
+	glm::vec3 sum(0.0);
+	for (int i = 0; i < 4; i++)
+	{
+		if (rt_samples_differ(colours[i], ids[i], centre, centre_id, renderMap.settings.aa_threshold))
+		{
+			double qx = x + ((i & 1) ? offset : -offset);
+			double qy = y + ((i & 2) ? offset : -offset);
+			colours[i] = rt_refine_square(renderMap, qx, qy, size / 2.0, colours[i], ids[i], budget);
+		}
+		sum += colours[i];
+	}
+
+	return sum / 4.0f;
+}
+
+// Takes the first sample of every pixel of a tile of an adaptive render,
+// and keeps it for this tile and its neighbours to be refined from
+static void rt_render_tile_first(const ThreadRenderMap &renderMap, int tile, int x0, int y0, int x1, int y1)
+{
+	AdaptiveState &state = *renderMap.adaptive;
+
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			int i = y * renderMap.width + x;
+			glm::vec3 colour = rt_render_pixel(renderMap, x, y, &state.ids[i]);
+			state.colours[i] = colour;
+
+			renderMap.img(x, y, 0) = colour.r;
+			renderMap.img(x, y, 1) = colour.g;
+			renderMap.img(x, y, 2) = colour.b;
+		}
+	}
+	state.sampled[tile] = 1;
+}
+
+// Renders the pixels of a tile with adaptive anti-aliasing. Pixels that
+// differ from one of their four neighbours, in this tile or the next, are
+// refined with more samples, up to the maximum for each pixel. The first
+// samples of the tile and of the pixels bordering it are taken from the
+// sampling sweep, and only traced here for tiles it did not cover.
+static void rt_render_tile_adaptive(const ThreadRenderMap &renderMap, int x0, int y0, int x1, int y1, long &samples)
+{
+	// The border lets pixels on the edge of the tile see their neighbours
+	int bx0 = std::max(x0 - 1, 0);
+	int by0 = std::max(y0 - 1, 0);
+	int bx1 = std::min(x1 + 1, renderMap.width);
+	int by1 = std::min(y1 + 1, renderMap.height);
+	int bw = bx1 - bx0;
+
+	std::vector<glm::vec3> colours(bw * (by1 - by0));
+	std::vector<unsigned int> ids(colours.size());
+	const AdaptiveState *state = renderMap.adaptive;
+
+	for (int y = by0; y < by1; y++)
+	{
+		for (int x = bx0; x < bx1; x++)
+		{
+			// The corners of the border are not neighbours of the tile
+			if ((x < x0 || x >= x1) && (y < y0 || y >= y1))
+			{
+				continue;
+			}
+
+			int i = (y - by0) * bw + (x - bx0);
+			int tile = (y / RT_TILE_SIZE) * renderMap.tiles->tiles_x + x / RT_TILE_SIZE;
+			if (state && state->sampled[tile])
+			{
+				colours[i] = state->colours[y * renderMap.width + x];
+				ids[i] = state->ids[y * renderMap.width + x];
+			}
+			else
+			{
+				colours[i] = rt_render_pixel(renderMap, x, y, &ids[i]);
+				samples++;
+			}
+		}
+	}
+
+	const int neighbours[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+	double threshold = renderMap.settings.aa_threshold;
+
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			int i = (y - by0) * bw + (x - bx0);
+			glm::vec3 colour = colours[i];
+
+			bool refine = false;
+			for (int n = 0; n < 4 && !refine; n++)
+			{
+				int nx = x + neighbours[n][0];
+				int ny = y + neighbours[n][1];
+				if (nx < bx0 || nx >= bx1 || ny < by0 || ny >= by1)
+				{
+					continue;
+				}
+
+				int j = (ny - by0) * bw + (nx - bx0);
+				refine = rt_samples_differ(colour, ids[i], colours[j], ids[j], threshold);
+			}
+
+			if (refine)
+			{
+				int budget = renderMap.settings.aa_max_samples - 1;
+				int available = budget;
+				colour = rt_refine_square(renderMap, x, y, 1.0, colour, ids[i], budget);
+				samples += available - budget;
+			}
+
+			renderMap.img(x, y, 0) = colour.r;
+			renderMap.img(x, y, 1) = colour.g;
+			renderMap.img(x, y, 2) = colour.b;
+		}
+	}
+}
+
+// An offset in [-0.5, 0.5) from the pixel and pass. The sample
+// positions do not depend on which thread renders the tile, so progressive
+// renders are repeatable.
+static inline double rt_sample_offset(unsigned int x, unsigned int y, unsigned int pass, unsigned int dim)
+{
+	return rt_hash(x, y, pass, dim) / 4294967296.0 - 0.5;
+}
+
+// Adds one pass of samples to a tile of a progressive render and writes
+// the mean of each pixel to the image. Returns true once the tile has
+// converged, which is when the average standard error of its pixels is
+// below the threshold, or when it has had the most passes allowed.
+static bool rt_render_tile_pass(const ThreadRenderMap &renderMap, int tile, int x0, int y0, int x1, int y1)
+{
+	ProgressiveState &state = *renderMap.progressive;
+	const RenderSettings &settings = renderMap.settings;
+
+	// Tiles can miss passes when time runs out, so each keeps its own count
+	int sample = state.samples[tile];
+	int n = sample + 1;
+	double error = 0.0;
+
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			// The first sample is at the centre of the pixel, later ones
+			// are spread over it
+			uint fx = x + settings.crop_x;
+			uint fy = y + settings.crop_y;
+			double dx = sample ? rt_sample_offset(fx, fy, sample, 0) : 0.0;
+			double dy = sample ? rt_sample_offset(fx, fy, sample, 1) : 0.0;
+			glm::vec3 colour = rt_render_pixel(renderMap, x + dx, y + dy);
+
+			// The error is measured on the displayed brightness
+			glm::vec3 display = glm::clamp(colour, 0.0f, 1.0f);
+			double luminance = 0.2126 * display.r + 0.7152 * display.g + 0.0722 * display.b;
+
+			int i = y * renderMap.width + x;
+			state.sum[i] += colour;
+			state.sum_lum[i] += luminance;
+			state.sum_sq[i] += luminance * luminance;
+
+			glm::vec3 mean = state.sum[i] / (float)n;
+			renderMap.img(x, y, 0) = mean.r;
+			renderMap.img(x, y, 1) = mean.g;
+			renderMap.img(x, y, 2) = mean.b;
+
+			// The variance is of the displayed luminance of the samples, so
+			// the mean is of the same clamped values
+			if (n > 1)
+			{
+				double mean_luminance = state.sum_lum[i] / n;
+				double variance = std::max(0.0, (state.sum_sq[i] - n * mean_luminance * mean_luminance) / (n - 1));
+				error += sqrt(variance / n);
+			}
+		}
+	}
+
+	error /= (x1 - x0) * (y1 - y0);
+
+	// A single sample says nothing about the noise, so at least two are
+	// needed before a tile can converge
+	bool converged = n >= settings.passes ||
+					 (n >= std::max(settings.min_passes, 2) && error < settings.variance_threshold);
+	state.samples[tile] = n;
+	state.error[tile] = error;
+	state.converged[tile] = converged;
+	return converged;
+}
+
+// Fills a tile with one sample for each square of RT_COARSE_STEP pixels,
+// as a quick preview that the full passes then replace
+static void rt_render_tile_coarse(const ThreadRenderMap &renderMap, int x0, int y0, int x1, int y1, long &samples)
+{
+	for (int by = y0; by < y1; by += RT_COARSE_STEP)
+	{
+		for (int bx = x0; bx < x1; bx += RT_COARSE_STEP)
+		{
+			int ex = std::min(bx + RT_COARSE_STEP, x1);
+			int ey = std::min(by + RT_COARSE_STEP, y1);
+
+			glm::vec3 colour = rt_render_pixel(renderMap, (bx + ex - 1) / 2.0, (by + ey - 1) / 2.0);
+			samples++;
+
+			for (int y = by; y < ey; y++)
+			{
+				for (int x = bx; x < ex; x++)
+				{
+					renderMap.img(x, y, 0) = colour.r;
+					renderMap.img(x, y, 1) = colour.g;
+					renderMap.img(x, y, 2) = colour.b;
+				}
+			}
+		}
+	}
+}
+
+void *RenderThread_Run(void *thread_args)
+{
+	TRACE_SCOPE("RenderThread_Run");
+
+	ThreadRenderMap renderMap = *static_cast<ThreadRenderMap *>(thread_args);
+	TileQueue &tiles = *renderMap.tiles;
+
+	// Dimensions of the image
+	int width = renderMap.width;
+	int height = renderMap.height;
+
+	int count = 0;
+	bool adaptive = renderMap.settings.aa_max_samples > 1;
+
+	// The pool thread keeps its counters from task to task, so only what
+	// they move by in this one is the render's
+	RenderCounters start = rt_counters;
+
+	// Keep taking tiles until there are none left
+	for (int tile = tiles.take(); tile >= 0; tile = tiles.take())
+	{
+		TRACE_SCOPE("tile");
+
+		// Leave the rest of the pass when the time budget has run out
+		if (renderMap.progressive && renderMap.progressive->expired())
+		{
+			break;
+		}
+		int tile_x = tile % tiles.tiles_x;
+		int tile_y = tile / tiles.tiles_x;
+
+		int x0 = tile_x * RT_TILE_SIZE;
+		int y0 = tile_y * RT_TILE_SIZE;
+		int x1 = std::min(x0 + RT_TILE_SIZE, width);
+		int y1 = std::min(y0 + RT_TILE_SIZE, height);
+
+		if (renderMap.incremental)
+		{
+			renderMap.footprint = &renderMap.incremental->footprint(tile);
+		}
+
+		long samples = 0;
+		bool finished = true;
+
+		if (renderMap.settings.relight)
+		{
+			rt_render_tile_capture(renderMap, tile, x0, y0, x1, y1);
+			samples += (x1 - x0) * (y1 - y0);
+		}
+		else if (renderMap.settings.gbuffer)
+		{
+			rt_render_tile_deferred(renderMap, x0, y0, x1, y1);
+			samples += (x1 - x0) * (y1 - y0);
+		}
+		else if (renderMap.progressive && renderMap.progressive->coarse)
+		{
+			rt_render_tile_coarse(renderMap, x0, y0, x1, y1, samples);
+			finished = false;
+		}
+		else if (renderMap.progressive)
+		{
+			finished = rt_render_tile_pass(renderMap, tile, x0, y0, x1, y1);
+			samples += (x1 - x0) * (y1 - y0);
+		}
+		else if (renderMap.adaptive && renderMap.adaptive->sampling)
+		{
+			rt_render_tile_first(renderMap, tile, x0, y0, x1, y1);
+			samples += (x1 - x0) * (y1 - y0);
+			finished = false;
+		}
+		else if (adaptive)
+		{
+			rt_render_tile_adaptive(renderMap, x0, y0, x1, y1, samples);
+		}
+		else
+		{
+			// We now apply a pixel by pixel basis for rendering
+			for (int y = y0; y < y1; y++)
+			{
+				for (int x = x0; x < x1; x++)
+				{
+					glm::vec3 colour = rt_render_pixel(renderMap, x, y);
+
+					// set RGB values in the image, keeping the full range so that
+					// high dynamic range output is possible. Clamping to [0, 1]
+					// happens when the image is quantized.
+					renderMap.img(x, y, 0) = colour.r;
+					renderMap.img(x, y, 1) = colour.g;
+					renderMap.img(x, y, 2) = colour.b;
+				}
+			}
+			samples += (x1 - x0) * (y1 - y0);
+		}
+
+		if (renderMap.footprint)
+		{
+			renderMap.footprint->finish();
+		}
+
+		// The coarse preview and the first samples of an adaptive render do
+		// not count as samples worth saving
+		if (!(renderMap.progressive && renderMap.progressive->coarse) &&
+			!(renderMap.adaptive && renderMap.adaptive->sampling))
+		{
+			tiles.unsaved[tile].store(1);
+		}
+
+		// Increment the number of pixels we have handled
+		count += (x1 - x0) * (y1 - y0);
+		*renderMap.progress = count;
+		*renderMap.samples += samples;
+
+		if (renderMap.listener)
+		{
+			// The tile is complete, so let anyone waiting on it know. When
+			// it is the last of its row of tiles those rows are done too.
+			// Progressive renders update a tile on every pass, but it is
+			// only done once it has converged.
+			renderMap.listener->tileDone(renderMap.img, x0, y0, x1 - x0, y1 - y0);
+
+			if (finished && ++tiles.row_done[tile_y] == tiles.tiles_x)
+			{
+				for (int y = y0; y < y1; y++)
+				{
+					renderMap.listener->rowDone(renderMap.img, y);
+				}
+			}
+		}
+	}
+
+	if (renderMap.counters)
+	{
+		renderMap.counters->add(rt_counters.since(start));
+	}
+
+	*renderMap.status = THREAD_RENDER_DONE;
+
+	return NULL;
+}
+
+// Hands the tiles of a distributed render out to the coordinator's workers
+// from the same queue as the local threads, and puts the pixels they send
+// back into the image
+struct FarmTiles : public TileFarmSource
+{
+	TileQueue &tiles;
+	Image &image;
+	RenderListener *listener;
+
+	// Pixels and tiles rendered by workers
+	std::atomic<long> pixels;
+	std::atomic<int> rendered;
+
+	FarmTiles(TileQueue &queue, Image &img, RenderListener *lis)
+		: tiles(queue), image(img), listener(lis)
+	{
+		pixels.store(0);
+		rendered.store(0);
+	}
+
+	virtual bool takeTile(FarmTile &tile)
+	{
+		int index = tiles.take();
+		if (index < 0)
+		{
+			return false;
+		}
+
+		tile.tile = index;
+		tile.x = (index % tiles.tiles_x) * RT_TILE_SIZE;
+		tile.y = (index / tiles.tiles_x) * RT_TILE_SIZE;
+		tile.w = std::min<int>(RT_TILE_SIZE, tiles.width - tile.x);
+		tile.h = std::min<int>(RT_TILE_SIZE, tiles.height - tile.y);
+		return true;
+	}
+
+	virtual void tileReceived(const FarmTile &tile, const float *colours)
+	{
+		for (uint y = tile.y; y < tile.y + tile.h; y++)
+		{
+			for (uint x = tile.x; x < tile.x + tile.w; x++)
+			{
+				image(x, y, 0) = *colours++;
+				image(x, y, 1) = *colours++;
+				image(x, y, 2) = *colours++;
+			}
+		}
+		pixels += tile.w * tile.h;
+		rendered++;
+		tiles.unsaved[tile.tile].store(1);
+
+		if (listener)
+		{
+			listener->tileDone(image, tile.x, tile.y, tile.w, tile.h);
+
+			int tile_y = tile.tile / tiles.tiles_x;
+			if (++tiles.row_done[tile_y] == tiles.tiles_x)
+			{
+				for (uint y = tile.y; y < tile.y + tile.h; y++)
+				{
+					listener->rowDone(image, y);
+				}
+			}
+		}
+	}
+
+	virtual void tileLost(const FarmTile &tile)
+	{
+		tiles.giveBack(tile.tile);
+	}
+};
+
+// Whether any primary ray of the tile from ('x0', 'y0') to ('x1', 'y1')
+// could pass through the box from 'lo' to 'hi'. The box is tested against
+// the four sides of the tile's view frustum, widened by a pixel to take in
+// samples away from the pixel centres.
+static bool rt_tile_sees_box(const glm::mat4 &unproj, const glm::vec3 &eye, const RenderSettings &settings,
+							 int x0, int y0, int x1, int y1, const glm::vec3 &lo, const glm::vec3 &hi)
+{
+	double left = x0 - 1.0 + settings.crop_x, right = x1 + settings.crop_x;
+	double top = y0 - 1.0 + settings.crop_y, bottom = y1 + settings.crop_y;
+
+	// Directions through the corners of the tile, going round it
+	glm::vec3 corners[4];
+	double corner_x[4] = {left, right, right, left};
+	double corner_y[4] = {top, top, bottom, bottom};
+	for (int i = 0; i < 4; i++)
+	{
+		corners[i] = glm::vec3(unproj * glm::vec4(corner_x[i], corner_y[i], 0.0, 1.0)) - eye;
+	}
+	glm::vec3 centre = corners[0] + corners[1] + corners[2] + corners[3];
+
+	for (int i = 0; i < 4; i++)
+	{
+		// The side through two neighbouring corners, facing into the frustum
+		glm::vec3 normal = glm::cross(corners[i], corners[(i + 1) % 4]);
+		if (glm::dot(normal, centre) < 0.0f)
+		{
+			normal = -normal;
+		}
+
+		// The box is outside when every corner of it is behind the side
+		bool outside = true;
+		for (int corner = 0; corner < 8 && outside; corner++)
+		{
+			glm::vec3 point((corner & 1) ? hi.x : lo.x, (corner & 2) ? hi.y : lo.y, (corner & 4) ? hi.z : lo.z);
+			outside = glm::dot(normal, point - eye) < 0.0f;
+		}
+		if (outside)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Tells the listener about tiles that are in the image before any are
+// rendered, as when they are kept from an earlier render. 'kept' is 1 for
+// tiles that will get more samples and 2 for finished ones, which complete
+// their rows of tiles.
+static void rt_notify_kept_tiles(RenderListener *listener, const Image &image, TileQueue &tiles, const std::vector<char> &kept)
+{
+	for (int tile = 0; tile < tiles.tiles_x * tiles.tiles_y; tile++)
+	{
+		if (kept[tile])
+		{
+			int x0 = (tile % tiles.tiles_x) * RT_TILE_SIZE;
+			int y0 = (tile / tiles.tiles_x) * RT_TILE_SIZE;
+			listener->tileDone(image, x0, y0, std::min(RT_TILE_SIZE, tiles.width - x0), std::min(RT_TILE_SIZE, tiles.height - y0));
+		}
+		if (kept[tile] == 2)
+		{
+			tiles.row_done[tile / tiles.tiles_x]++;
+		}
+	}
+
+	for (int tile_y = 0; tile_y < tiles.tiles_y; tile_y++)
+	{
+		if (tiles.row_done[tile_y] == tiles.tiles_x)
+		{
+			int y1 = std::min((tile_y + 1) * RT_TILE_SIZE, tiles.height);
+			for (int y = tile_y * RT_TILE_SIZE; y < y1; y++)
+			{
+				listener->rowDone(image, y);
+			}
+		}
+	}
+}
+
+// A hash of everything that decides the pixels of a render, other than the
+// time budget, which only decides how far it gets. The scene is taken to be
+// the same when its primitives have the same types, transforms, bounds and
+// materials.
+static uint64_t rt_checkpoint_key(const Scene &scene, const GBufferView &view, const glm::vec3 &ambient,
+								  const std::list<Light *> &lights, const RenderSettings &settings, bool progressive)
+{
+	CheckpointKey key;
+	key.add(view.eye);
+	key.add(view.view);
+	key.add(view.up);
+	key.add(view.fovy);
+	key.add(view.width);
+	key.add(view.height);
+	key.add(view.crop_x);
+	key.add(view.crop_y);
+	key.add(view.frame_width);
+	key.add(view.frame_height);
+
+	key.add(ambient);
+	for (const Light *light : lights)
+	{
+		key.add(light->colour);
+		key.add(light->position);
+		key.add(light->falloff);
+	}
+
+	key.add(settings.aa_max_samples);
+	key.add(settings.aa_threshold);
+	key.add(settings.passes);
+	key.add(settings.min_passes);
+	key.add(settings.variance_threshold);
+	key.add(settings.light_samples);
+	key.add(settings.light_cutoff);
+	key.add(settings.max_depth);
+	key.add(settings.min_throughput);
+	key.add(settings.roulette_threshold);
+	key.add(progressive);
+
+	for (size_t i = 0; i < scene.size(); i++)
+	{
+		const SceneInstance &instance = scene.instance(i);
+		const char *type = typeid(*instance.node->m_primitive).name();
+		key.add(type, strlen(type));
+		key.add(instance.trans);
+		key.add(instance.bounded);
+		if (instance.bounded)
+		{
+			key.add(instance.lo);
+			key.add(instance.hi);
+		}
+
+		const SceneMaterial &material = scene.material(instance.material_index);
+		key.add(material.type);
+		key.add(material.kd);
+		key.add(material.ks);
+		key.add(material.shininess);
+	}
+
+	return key.hash;
+}
+
+// Copies the tiles that have new samples into the checkpoint. No thread may
+// be rendering them, which holds until the next pass starts.
+static void rt_save_checkpoint(RenderCheckpoint &checkpoint, TileQueue &tiles, const Image &image, const ProgressiveState *progressive)
+{
+	float *colours = checkpoint.colours();
+	double *squares = checkpoint.squares();
+
+	for (int tile = 0; tile < tiles.tiles_x * tiles.tiles_y; tile++)
+	{
+		if (!tiles.unsaved[tile].exchange(0))
+		{
+			continue;
+		}
+
+		int x0 = (tile % tiles.tiles_x) * RT_TILE_SIZE;
+		int y0 = (tile / tiles.tiles_x) * RT_TILE_SIZE;
+		int x1 = std::min(x0 + RT_TILE_SIZE, tiles.width);
+		int y1 = std::min(y0 + RT_TILE_SIZE, tiles.height);
+
+		checkpoint.setTile(tile, 0, 0.0, false);
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = x0; x < x1; x++)
+			{
+				size_t i = (size_t)y * tiles.width + x;
+				if (progressive)
+				{
+					colours[3 * i + 0] = progressive->sum[i].r;
+					colours[3 * i + 1] = progressive->sum[i].g;
+					colours[3 * i + 2] = progressive->sum[i].b;
+					squares[2 * i + 0] = progressive->sum_lum[i];
+					squares[2 * i + 1] = progressive->sum_sq[i];
+				}
+				else
+				{
+					colours[3 * i + 0] = image(x, y, 0);
+					colours[3 * i + 1] = image(x, y, 1);
+					colours[3 * i + 2] = image(x, y, 2);
+				}
+			}
+		}
+
+		if (progressive)
+		{
+			checkpoint.setTile(tile, progressive->samples[tile], progressive->error[tile], progressive->converged[tile]);
+		}
+		else
+		{
+			checkpoint.setTile(tile, 1, 0.0, true);
+		}
+	}
+}
+
+// Puts the tiles saved in the checkpoint back into the image, along with
+// their samples when rendering progressively, and hands out the rest. Sets
+// 'kept' for the tiles restored as for rt_notify_kept_tiles() and returns
+// how many there were.
+static int rt_resume_checkpoint(RenderCheckpoint &checkpoint, TileQueue &tiles, Image &image, ProgressiveState *progressive,
+								std::vector<char> &kept)
+{
+	const float *colours = checkpoint.colours();
+	const double *squares = checkpoint.squares();
+	int num_kept = 0;
+
+	std::vector<int> remaining;
+	for (int tile = 0; tile < tiles.tiles_x * tiles.tiles_y; tile++)
+	{
+		int n = checkpoint.samples(tile);
+		if (n > 0)
+		{
+			int x0 = (tile % tiles.tiles_x) * RT_TILE_SIZE;
+			int y0 = (tile / tiles.tiles_x) * RT_TILE_SIZE;
+			int x1 = std::min(x0 + RT_TILE_SIZE, tiles.width);
+			int y1 = std::min(y0 + RT_TILE_SIZE, tiles.height);
+
+			for (int y = y0; y < y1; y++)
+			{
+				for (int x = x0; x < x1; x++)
+				{
+					size_t i = (size_t)y * tiles.width + x;
+					glm::vec3 colour(colours[3 * i + 0], colours[3 * i + 1], colours[3 * i + 2]);
+					if (progressive)
+					{
+						progressive->sum[i] = colour;
+						progressive->sum_lum[i] = squares[2 * i + 0];
+						progressive->sum_sq[i] = squares[2 * i + 1];
+						colour /= (float)n;
+					}
+					image(x, y, 0) = colour.r;
+					image(x, y, 1) = colour.g;
+					image(x, y, 2) = colour.b;
+				}
+			}
+
+			if (progressive)
+			{
+				progressive->samples[tile] = n;
+				progressive->error[tile] = checkpoint.error(tile);
+				progressive->converged[tile] = checkpoint.converged(tile);
+			}
+			kept[tile] = checkpoint.converged(tile) ? 2 : 1;
+			num_kept++;
+		}
+
+		if (kept[tile] != 2)
+		{
+			remaining.push_back(tile);
+		}
+	}
+
+	// Tiles without samples first, then the noisiest, as the passes would
+	// have had them
+	if (progressive)
+	{
+		std::stable_sort(remaining.begin(), remaining.end(), [progressive](int a, int b) {
+			return (progressive->samples[a] == 0 && progressive->samples[b] > 0) ||
+				   (progressive->samples[a] > 0 && progressive->samples[b] > 0 && progressive->error[a] > progressive->error[b]);
+		});
+	}
+	tiles.restart(remaining);
+
+	return num_kept;
+}
+
+// Prints the totals of a cost map, and the objects whose pixels took the
+// most time
+static void rt_report_costs(const CostMap &costs, const Scene &scene)
+{
+	double total = costs.totalNanoseconds();
+	std::cout << "Cost map: " << total / 1e6 << " ms in samples, " << costs.totalRays() << " rays, "
+			  << costs.totalTests() << " intersection tests" << std::endl;
+
+	std::vector<std::pair<unsigned int, double>> times = costs.objectTimes();
+	for (size_t i = 0; i < times.size() && i < 5 && total > 0.0; i++)
+	{
+		std::string name = "(background)";
+		for (size_t j = 0; j < scene.size() && times[i].first != Raytracer_NO_OBJECT; j++)
+		{
+			if (scene.instance(j).node->m_nodeId == times[i].first)
+			{
+				name = scene.instance(j).node->m_name;
+				break;
+			}
+		}
+		std::cout << "\t" << name << ": " << (100.0 * times[i].second) / total << "% of the time" << std::endl;
+	}
+}
+
+// Prints the work done by the threads of a render and how fast it went,
+// and appends it to the statistics file if there is one
+static void rt_report_counters(const std::vector<RenderCounters> &thread_counters, double seconds,
+							   long pixels, int num_threads, long shadow_hits, long shadow_misses,
+							   const RenderSettings &settings)
+{
+	RenderCounters total = RenderCounters();
+	for (const RenderCounters &counters : thread_counters)
+	{
+		total.add(counters);
+	}
+	double rays_per_second = seconds > 0.0 ? total.rays() / seconds : 0.0;
+
+	std::cout << "Statistics: " << seconds << " s, " << rays_per_second / 1e6 << " million rays/s" << std::endl
+			  << "	"
+			  << "rays: " << total.primary_rays << " primary, " << total.shadow_rays << " shadow, "
+			  << total.reflection_rays << " reflection" << std::endl
+			  << "	"
+			  << "node visits: " << total.node_visits << std::endl
+			  << "	"
+			  << "intersection tests: " << total.box_tests << " box, " << total.sphere_tests << " sphere, "
+			  << total.triangle_tests << " triangle" << std::endl
+			  << "	"
+			  << "shading calls: " << total.shading_calls << std::endl;
+
+	if (settings.stats_file.empty())
+	{
+		return;
+	}
+
+	std::ofstream out(settings.stats_file, std::ios::app);
+	if (!out)
+	{
+		std::cerr << "could not write statistics to " << settings.stats_file << std::endl;
+		return;
+	}
+
+	out << "{\"pixels\": " << pixels
+		<< ", \"threads\": " << num_threads
+		<< ", \"seconds\": " << seconds
+		<< ", \"rays_per_second\": " << rays_per_second
+		<< ", \"primary_rays\": " << total.primary_rays
+		<< ", \"shadow_rays\": " << total.shadow_rays
+		<< ", \"reflection_rays\": " << total.reflection_rays
+		<< ", \"node_visits\": " << total.node_visits
+		<< ", \"box_tests\": " << total.box_tests
+		<< ", \"sphere_tests\": " << total.sphere_tests
+		<< ", \"triangle_tests\": " << total.triangle_tests
+		<< ", \"shading_calls\": " << total.shading_calls
+		<< ", \"shadow_cache_hits\": " << shadow_hits
+		<< ", \"shadow_cache_misses\": " << shadow_misses
+		<< "}" << std::endl;
+}
+
+// Everything a thread needs to relight its share of the image
+struct RelightThreadArgs
+{
+	const RelightCache *cache;
+	Image *image;
+	TileQueue *tiles;
+
+	const glm::vec3 *ambient;
+	const std::vector<const Light *> *lights;
+
+	RenderListener *listener;
+};
+
+// Colours a tile from the relighting cache. Each hit recorded for a pixel
+// adds its ambient light and the light from each light it could see, scaled
+// by how much it is reflected towards the camera.
+static void rt_relight_tile(const RelightCache &cache, const RelightTile &tile, Image &image,
+							const glm::vec3 &ambient, const std::vector<const Light *> &lights)
+{
+	size_t words = cache.words();
+	uint tile_width = tile.x1 - tile.x0;
+
+	for (uint y = tile.y0; y < tile.y1; y++)
+	{
+		for (uint x = tile.x0; x < tile.x1; x++)
+		{
+			uint i = (y - tile.y0) * tile_width + (x - tile.x0);
+			glm::vec3 colour = tile.background[i];
+
+			for (uint v = tile.first[i]; v < tile.first[i + 1]; v++)
+			{
+				const RelightVertex &vertex = tile.vertices[v];
+				const SceneMaterial &material = cache.material(vertex.material);
+
+				// Only the origin of the ray and the hit are used for lighting
+				Ray ray(vertex.origin, vertex.point - vertex.origin);
+				Intersection inter;
+				inter.point = vertex.point;
+				inter.normal = vertex.normal;
+				inter.material_index = vertex.material;
+
+				glm::vec3 lit = ambient * material.kd;
+				const uint64_t *visible = &tile.visibility[v * words];
+				for (size_t w = 0; w < words; w++)
+				{
+					for (uint64_t bits = visible[w]; bits; bits &= bits - 1)
+					{
+						lit = lit + rt_lighting(ray, inter, material, lights[w * 64 + __builtin_ctzll(bits)]);
+					}
+				}
+
+				colour = colour + lit * vertex.weight;
+			}
+
+			image(x, y, 0) = colour.r;
+			image(x, y, 1) = colour.g;
+			image(x, y, 2) = colour.b;
+		}
+	}
+}
+
+void *RelightThread_Run(void *thread_args)
+{
+	RelightThreadArgs &args = *static_cast<RelightThreadArgs *>(thread_args);
+	TileQueue &tiles = *args.tiles;
+	int total_tiles = tiles.order.size();
+
+	for (int next = tiles.next++; next < total_tiles; next = tiles.next++)
+	{
+		int tile_index = tiles.order[next];
+		const RelightTile &tile = args.cache->tile(tile_index);
+		rt_relight_tile(*args.cache, tile, *args.image, *args.ambient, *args.lights);
+
+		if (args.listener)
+		{
+			args.listener->tileDone(*args.image, tile.x0, tile.y0, tile.x1 - tile.x0, tile.y1 - tile.y0);
+
+			if (++tiles.row_done[tile_index / tiles.tiles_x] == tiles.tiles_x)
+			{
+				for (uint y = tile.y0; y < tile.y1; y++)
+				{
+					args.listener->rowDone(*args.image, y);
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
+// Recomputes the image from the relighting cache, without tracing any rays
+static void rt_relight(const RelightCache &cache, Image &image, const glm::vec3 &ambient,
+					   const std::list<Light *> &lights, RenderListener *listener)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// The visibility bits are in the order of the list
+	std::vector<const Light *> light_list(lights.begin(), lights.end());
+	TileQueue tiles(image.width(), image.height());
+
+	RelightThreadArgs args;
+	args.cache = &cache;
+	args.image = &image;
+	args.tiles = &tiles;
+	args.ambient = &ambient;
+	args.lights = &light_list;
+	args.listener = listener;
+
+	WorkerPool &pool = WorkerPool::shared();
+	std::vector<void *> thread_args(pool.size(), &args);
+	pool.start(RelightThread_Run, thread_args.data(), pool.size());
+	pool.wait();
+
+	double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Relit " << cache.size() << " cached hits in " << elapsed << " ms" << std::endl;
+}
+
+void rt_Render(
+	// What to render
+	SceneNode *root,
+
+	// Image to write to, set to a given width and height
+	Image &image,
+
+	// Viewing parameters
+	const glm::vec3 &eye,
+	const glm::vec3 &view,
+	const glm::vec3 &up,
+	double fovy,
+
+	// Lighting parameters
+	const glm::vec3 &ambient,
+	const std::list<Light *> &lights,
+
+	// Optional observer notified as rows of the image are completed
+	RenderListener *listener,
+
+	// Quality settings
+	const RenderSettings &settings)
+{
+	TRACE_SCOPE("rt_Render");
+
+	// Printing the details of the render system
+	std::cout << "Calling rt_Render(\n"
+			  << "\t" << *root << "\t"
+			  << "Image(width:" << image.width() << ", height:" << image.height() << ")\n"
+																					 "\t"
+			  << "eye:  " << glm::to_string(eye) << std::endl
+			  << "\t"
+			  << "view: " << glm::to_string(view) << std::endl
+			  << "\t"
+			  << "up:   " << glm::to_string(up) << std::endl
+			  << "\t"
+			  << "fovy: " << fovy << std::endl
+			  << "\t"
+			  << "ambient: " << glm::to_string(ambient) << std::endl
+			  << "\t"
+			  << "lights{" << std::endl;
+
+	for (const Light *light : lights)
+	{
+		std::cout << "\t\t" << *light << std::endl;
+	}
+	std::cout << "\t}" << std::endl;
+	std::cout << ")" << std::endl;
+
+	// Printing ends
+
+	// Get the project matrix inverted. A crop window uses the projection
+	// of the whole frame.
+	uint frame_width = settings.frame_width ? settings.frame_width : image.width();
+	uint frame_height = settings.frame_height ? settings.frame_height : image.height();
+	if (settings.frame_width)
+	{
+		std::cout << "Cropped to " << image.width() << "x" << image.height() << " at (" << settings.crop_x << ", "
+				  << settings.crop_y << ") of a " << frame_width << "x" << frame_height << " frame" << std::endl;
+	}
+
+	double dist = glm::length(view);
+	glm::mat4 unproj = Raytracer_get_proj_inverse(frame_width, frame_height, fovy, dist, eye, view, up);
+
+	GBufferView gview;
+	gview.eye = eye;
+	gview.view = view;
+	gview.up = up;
+	gview.fovy = fovy;
+	gview.width = image.width();
+	gview.height = image.height();
+	gview.crop_x = settings.crop_x;
+	gview.crop_y = settings.crop_y;
+	gview.frame_width = frame_width;
+	gview.frame_height = frame_height;
+
+	// When the relighting cache holds this view with the lights in the same
+	// places, only the lighting needs to be done again
+	bool is_capture = settings.relight != NULL;
+	RelightKey relight_key;
+	if (is_capture)
+	{
+		relight_key.view = gview;
+		relight_key.root = root;
+		for (const Light *light : lights)
+		{
+			relight_key.light_positions.push_back(light->position);
+		}
+		relight_key.max_depth = settings.max_depth;
+		relight_key.min_throughput = settings.min_throughput;
+		relight_key.roulette_threshold = settings.roulette_threshold;
+
+		if (settings.relight->matches(relight_key))
+		{
+			std::cout << "Relighting from the cache of an earlier render" << std::endl;
+			rt_relight(*settings.relight, image, ambient, lights, listener);
+			std::cout << "Scene rendered" << std::endl;
+			return;
+		}
+
+		std::cout << "Capturing the scene for relighting" << std::endl;
+		if (settings.aa_max_samples > 1 || settings.passes > 1 || settings.time_budget > 0.0 ||
+			settings.gbuffer || settings.light_samples > 0 || settings.light_cutoff > 0.0)
+		{
+			std::cout << "Capturing takes one sample per pixel with every light, so anti-aliasing, passes, "
+						 "time budgets, deferred shading and light sampling are ignored"
+					  << std::endl;
+		}
+	}
+
+	// A deferred render writes the primary hits to the G-buffer before
+	// shading them, unless it already has them for this view
+	bool is_deferred = settings.gbuffer != NULL && !is_capture;
+	if (is_deferred)
+	{
+		if (settings.gbuffer->prepare(gview))
+		{
+			std::cout << "Shading from the G-buffer of an earlier render" << std::endl;
+		}
+		if (settings.aa_max_samples > 1 || settings.passes > 1 || settings.time_budget > 0.0)
+		{
+			std::cout << "Deferred shading takes one sample per pixel, so anti-aliasing, passes and time budgets are ignored" << std::endl;
+		}
+	}
+
+	size_t h = image.height();
+	size_t w = image.width();
+
+	// In order to speed up the process we are going to use multi-threading
+	// This is fairly easily in this case, as we are only really being read-only
+	// on the data. The threads come from a pool kept for the life of the
+	// process, so that processes rendering many images only start them once.
+
+	WorkerPool &pool = WorkerPool::shared();
+	const int num_threads = RT_NUM_THREADS;
+
+	int thread_progress[num_threads];
+	int thread_status[num_threads];
+	long thread_samples[num_threads];
+	ThreadRenderMap *renderMap[num_threads];
+
+	// The threads take tiles of the image from a shared queue until none
+	// are left, so that threads that finish early pick up the slack
+	TileQueue tiles(w, h);
+
+	// A progressive render goes over the image in passes, each adding a
+	// sample to every tile that has not converged yet
+	bool has_budget = settings.time_budget > 0.0 && !is_deferred && !is_capture;
+	bool is_progressive = (settings.passes > 1 && !is_deferred && !is_capture) || has_budget;
+
+	// Single pass renders refine the pixels that differ from their
+	// neighbours when anti-aliasing is on
+	bool is_adaptive = settings.aa_max_samples > 1 && !is_deferred && !is_capture && !is_progressive;
+
+	// An incremental render starts from the image of the last one, and
+	// only traces the tiles that the scene edits since could have changed.
+	// Renders that stop when time runs out do not leave a complete image.
+	bool is_incremental = settings.incremental != NULL && !is_capture && !is_deferred && !has_budget;
+	if (settings.incremental && !is_incremental)
+	{
+		std::cout << "Incremental rendering is not used with relighting, deferred shading or time budgets" << std::endl;
+	}
+
+	// A distributed render shares its tiles with other processes. The
+	// coordinator hands them out and writes the image, and its workers
+	// render the tiles they are sent.
+	bool is_farmed = settings.farm != NULL && !is_capture && !is_deferred && !is_progressive && !is_incremental;
+	bool is_farm_worker = is_farmed && !settings.farm->isCoordinator();
+	if (settings.farm && !is_farmed)
+	{
+		std::cout << "Distributed rendering is only used for single pass renders without relighting, "
+					 "deferred shading or incremental rendering"
+				  << std::endl;
+	}
+	ProgressiveState *progressive = NULL;
+	if (is_progressive)
+	{
+		progressive = new ProgressiveState(w, h, tiles.tiles_x * tiles.tiles_y);
+	}
+
+	// With a time budget, a coarse preview comes before the full passes so
+	// that there is a whole image to show however little time there is
+	int num_passes = is_progressive ? settings.passes : 1;
+	int first_pass = 0;
+	if (has_budget)
+	{
+		progressive->has_deadline = true;
+		progressive->deadline = std::chrono::steady_clock::now() +
+								std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+									std::chrono::duration<double>(settings.time_budget));
+
+		if (settings.passes <= 1)
+		{
+			num_passes = RT_BUDGET_MAX_PASSES;
+		}
+		first_pass = -1;
+	}
+
+	// An adaptive render takes the first sample of every pixel in a sweep
+	// of its own, so that the refinement of each tile can see the pixels
+	// around it. The tiles of a distributed render are spread over many
+	// processes, so each is sampled where it is refined instead.
+	AdaptiveState *adaptive = NULL;
+	if (is_adaptive && !is_farmed)
+	{
+		adaptive = new AdaptiveState(w, h, tiles.tiles_x * tiles.tiles_y);
+		first_pass = -1;
+	}
+
+	// With many lights, each hit only looks at a few picked from a tree,
+	// or at the ones close enough to matter
+	LightTree *light_tree = NULL;
+	bool use_light_tree = (settings.light_samples > 0 || settings.light_cutoff > 0.0) && !is_capture;
+	if (use_light_tree)
+	{
+		light_tree = new LightTree(lights, settings.light_cutoff);
+	}
+	if (use_light_tree && settings.light_samples > 0)
+	{
+		std::cout << "Sampling " << settings.light_samples << " of " << lights.size() << " lights at each hit" << std::endl;
+	}
+	if (use_light_tree && settings.light_cutoff > 0.0)
+	{
+		std::cout << "Skipping lights adding less than " << settings.light_cutoff << " to a hit" << std::endl;
+	}
+
+	// Shadow rays test the instances of a flattened copy of the scene, and
+	// each thread remembers which instance last blocked each light. Building
+	// it also gathers the materials into the table that hits index into.
+	Scene scene(root);
+	std::vector<ShadowCache> shadow_caches(num_threads);
+	std::vector<RenderCounters> thread_counters(num_threads, RenderCounters());
+
+	if (is_capture)
+	{
+		settings.relight->prepare(relight_key, tiles.tiles_x * tiles.tiles_y, lights.size(), scene);
+	}
+
+	if (is_incremental)
+	{
+		IncrementalCache &cache = *settings.incremental;
+		int num_tiles = tiles.tiles_x * tiles.tiles_y;
+
+		IncrementalKey key;
+		key.view = gview;
+		key.root = root;
+		key.ambient = ambient;
+		for (const Light *light : lights)
+		{
+			key.lights.push_back(*light);
+		}
+		key.aa_max_samples = settings.aa_max_samples;
+		key.aa_threshold = settings.aa_threshold;
+		key.passes = settings.passes;
+		key.min_passes = settings.min_passes;
+		key.variance_threshold = settings.variance_threshold;
+		key.light_samples = settings.light_samples;
+		key.light_cutoff = settings.light_cutoff;
+		key.max_depth = settings.max_depth;
+		key.min_throughput = settings.min_throughput;
+		key.roulette_threshold = settings.roulette_threshold;
+
+		bool reuse = cache.matches(key);
+		std::vector<int> dirty;
+		if (reuse)
+		{
+			// A tile is traced again if its rays hit a changed node where it
+			// was, or could reach one where it is now
+			std::vector<unsigned int> changed;
+			std::vector<glm::vec3> box_lo, box_hi;
+			bool bounded = cache.changes(scene, changed, box_lo, box_hi);
+
+			for (int tile = 0; tile < num_tiles; tile++)
+			{
+				int x0 = (tile % tiles.tiles_x) * RT_TILE_SIZE;
+				int y0 = (tile / tiles.tiles_x) * RT_TILE_SIZE;
+				int x1 = std::min<int>(x0 + RT_TILE_SIZE, w);
+				int y1 = std::min<int>(y0 + RT_TILE_SIZE, h);
+
+				const TileFootprint &footprint = cache.footprint(tile);
+				bool redo = !bounded || footprint.touches(changed);
+				for (size_t b = 0; !redo && b < box_lo.size(); b++)
+				{
+					redo = footprint.mayHit(box_lo[b], box_hi[b]) ||
+						   rt_tile_sees_box(unproj, eye, settings, x0, y0, x1, y1, box_lo[b], box_hi[b]);
+				}
+				if (redo)
+				{
+					dirty.push_back(tile);
+				}
+			}
+
+			// Anti-aliased tiles are refined against the first samples of
+			// the tiles around them, so those are traced again as well
+			if (is_adaptive)
+			{
+				const int neighbours[5][2] = {{0, 0}, {-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+				std::vector<char> near_dirty(num_tiles, 0);
+				for (int tile : dirty)
+				{
+					for (int n = 0; n < 5; n++)
+					{
+						int tile_x = tile % tiles.tiles_x + neighbours[n][0];
+						int tile_y = tile / tiles.tiles_x + neighbours[n][1];
+						if (tile_x >= 0 && tile_x < tiles.tiles_x && tile_y >= 0 && tile_y < tiles.tiles_y)
+						{
+							near_dirty[tile_y * tiles.tiles_x + tile_x] = 1;
+						}
+					}
+				}
+
+				dirty.clear();
+				for (int tile = 0; tile < num_tiles; tile++)
+				{
+					if (near_dirty[tile])
+					{
+						dirty.push_back(tile);
+					}
+				}
+			}
+
+			image = cache.image();
+			std::cout << changed.size() << " objects changed since the last render, tracing "
+					  << dirty.size() << " of " << num_tiles << " tiles again" << std::endl;
+		}
+
+		cache.prepare(key, num_tiles, scene, reuse);
+
+		if (reuse)
+		{
+			std::vector<char> kept(num_tiles, 2);
+			for (int tile : dirty)
+			{
+				cache.resetTile(tile);
+				kept[tile] = 0;
+			}
+			tiles.restart(dirty);
+
+			// The tiles kept from the last render are done already
+			if (listener)
+			{
+				rt_notify_kept_tiles(listener, image, tiles, kept);
+			}
+		}
+	}
+
+	// A checkpointed render saves its tiles as they finish, and carries on
+	// from a checkpoint of the same render left by a process that did not
+	// get to the end
+	RenderCheckpoint *checkpoint = NULL;
+	bool is_checkpointed = settings.checkpoint != NULL && !is_capture && !is_deferred && !is_incremental && !is_farm_worker;
+	if (is_checkpointed)
+	{
+		int num_tiles = tiles.tiles_x * tiles.tiles_y;
+		uint64_t key = rt_checkpoint_key(scene, gview, ambient, lights, settings, is_progressive);
+		bool resume = settings.checkpoint->open(key, w, h, num_tiles, is_progressive);
+		if (settings.checkpoint->isOpen())
+		{
+			checkpoint = settings.checkpoint;
+		}
+
+		std::vector<char> kept(num_tiles, 0);
+		int num_kept = resume ? rt_resume_checkpoint(*checkpoint, tiles, image, progressive, kept) : 0;
+		if (num_kept > 0)
+		{
+			std::cout << "Resuming from " << checkpoint->path() << " with " << num_kept << " of " << num_tiles
+					  << " tiles rendered" << std::endl;
+
+			// Passes carry on from the tile with the fewest samples, without
+			// a preview, since the image is already there
+			if (progressive)
+			{
+				first_pass = num_passes;
+				for (int tile : tiles.order)
+				{
+					first_pass = std::min(first_pass, progressive->samples[tile]);
+				}
+			}
+
+			if (listener)
+			{
+				rt_notify_kept_tiles(listener, image, tiles, kept);
+			}
+		}
+	}
+	else if (settings.checkpoint)
+	{
+		std::cout << "Checkpoints are not kept for relighting, deferred or incremental renders, "
+					 "or by the workers of distributed ones"
+				  << std::endl;
+	}
+
+	// A cost map records where the time of the render goes, sample by
+	// sample
+	bool is_cost_mapped = settings.cost_map != NULL && !is_capture && !is_deferred;
+	if (settings.cost_map && !is_cost_mapped)
+	{
+		std::cout << "Costs are not measured for relighting or deferred renders" << std::endl;
+	}
+	if (is_cost_mapped && (settings.cost_map->width() != w || settings.cost_map->height() != h))
+	{
+		std::cerr << "The cost map is " << settings.cost_map->width() << "x" << settings.cost_map->height()
+				  << ", not the size of the image" << std::endl;
+		is_cost_mapped = false;
+	}
+
+	for (int i = 0; i < num_threads; i++)
+	{
+		thread_samples[i] = 0;
+
+		// Setup the details of the rendering platform
+		ThreadRenderMap *map = new ThreadRenderMap(
+			image,
+			&tiles,
+			i,
+			w, h,
+			root, &scene, &shadow_caches[i],
+			unproj,
+			eye, ambient,
+			lights,
+			&thread_progress[i],
+			&thread_status[i],
+			&thread_samples[i],
+			listener,
+			settings,
+			light_tree,
+			progressive);
+		map->adaptive = adaptive;
+		map->incremental = is_incremental ? settings.incremental : NULL;
+		map->cost_map = is_cost_mapped ? settings.cost_map : NULL;
+		map->counters = &thread_counters[i];
+
+		renderMap[i] = map;
+	}
+
+	std::cout << "Rendering with " << num_threads << " threads." << std::endl;
+	std::chrono::steady_clock::time_point render_start = std::chrono::steady_clock::now();
+
+	FarmTiles farm_tiles(tiles, image, listener);
+	if (is_farm_worker)
+	{
+		// Render the tiles the coordinator sends until it has no more. The
+		// queue is left empty, so there are no passes of its own.
+		if (settings.farm->joinRender(w, h, num_threads))
+		{
+			std::cout << "Rendering tiles for the coordinator" << std::endl;
+
+			std::vector<FarmTile> batch;
+			bool connected = true;
+			while (connected && settings.farm->nextBatch(batch))
+			{
+				std::vector<int> order;
+				for (const FarmTile &tile : batch)
+				{
+					connected = connected && tile.tile < (uint)(tiles.tiles_x * tiles.tiles_y) &&
+								tile.x + tile.w <= w && tile.y + tile.h <= h;
+					order.push_back(tile.tile);
+				}
+				if (!connected)
+				{
+					std::cerr << "The coordinator sent a tile outside of the image" << std::endl;
+					break;
+				}
+
+				tiles.restart(order);
+				pool.start(RenderThread_Run, (void **)renderMap, num_threads);
+				pool.wait();
+
+				for (const FarmTile &tile : batch)
+				{
+					connected = connected && settings.farm->sendTile(tile, image);
+				}
+			}
+			settings.farm->leaveRender();
+		}
+		else
+		{
+			std::cout << "The coordinator does not need this render" << std::endl;
+		}
+		tiles.restart(std::vector<int>());
+	}
+	else if (is_farmed)
+	{
+		settings.farm->beginRender(w, h, &farm_tiles);
+	}
+
+	// When the checkpoint is next written out
+	std::chrono::steady_clock::time_point next_checkpoint = std::chrono::steady_clock::now();
+	if (checkpoint)
+	{
+		next_checkpoint += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(checkpoint->interval()));
+	}
+
+	for (int pass = first_pass; pass < num_passes && !tiles.order.empty(); pass++)
+	{
+		if (progressive)
+		{
+			if (progressive->expired())
+			{
+				break;
+			}
+			progressive->pass = pass;
+			progressive->coarse = pass < 0;
+		}
+		if (adaptive)
+		{
+			adaptive->sampling = pass < 0;
+		}
+
+		long pass_pixels = tiles.pixels();
+		for (int i = 0; i < num_threads; i++)
+		{
+			thread_progress[i] = 0;
+			thread_status[i] = THREAD_RENDER_INIT;
+		}
+
+		pool.start(RenderThread_Run, (void **)renderMap, num_threads);
+
+		if (pass == 0)
+		{
+			std::cout << "Starting rendering process" << std::endl;
+		}
+
+		const int update_interval = 100 * 1000; // 100 milliseconds in microseconds
+
+		bool is_processing = true;
+		while (is_processing)
+		{
+			// Is the program done?
+			bool is_done = true;
+			for (int i = 0; i < num_threads; i++)
+			{
+				is_done = is_done && thread_status[i];
+			}
+
+			// output the progress
+			long pixels_done = farm_tiles.pixels;
+			for (int i = 0; i < num_threads; i++)
+			{
+				pixels_done += thread_progress[i];
+			}
+			int overall_progress = (pass_pixels > 0) ? (int)((pixels_done * 100) / pass_pixels) : 100;
+
+			if (is_progressive && pass < 0)
+			{
+				std::cout << "Preview: ";
+			}
+			else if (adaptive && pass < 0)
+			{
+				std::cout << "Sampling: ";
+			}
+			else if (is_progressive)
+			{
+				std::cout << "Pass " << pass + 1 << " of " << num_passes << " (" << tiles.order.size() << " tiles): ";
+			}
+			std::cout << "Progress: " << overall_progress << "% \r" << std::flush;
+
+			// Save the tiles finished since the last checkpoint, and start
+			// writing them to disk
+			if (checkpoint && std::chrono::steady_clock::now() >= next_checkpoint)
+			{
+				rt_save_checkpoint(*checkpoint, tiles, image, progressive);
+				checkpoint->sync();
+				next_checkpoint = std::chrono::steady_clock::now() +
+								  std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+									  std::chrono::duration<double>(checkpoint->interval()));
+			}
+
+			if (is_done)
+			{
+				is_processing = false;
+			}
+			else
+			{
+				// Wait a bit before printing
+				usleep(update_interval);
+			}
+		}
+
+		// Wait on all threads to finish the pass
+		pool.wait();
+
+		// The tiles of the pass must be saved before the next pass adds to
+		// them
+		if (checkpoint)
+		{
+			rt_save_checkpoint(*checkpoint, tiles, image, progressive);
+		}
+
+		// The tiles just sampled are refined next
+		if (adaptive && pass < 0)
+		{
+			tiles.restart(std::vector<int>(tiles.order));
+		}
+
+		if (progressive)
+		{
+			// Only the tiles that are still noisy go into the next pass,
+			// the noisiest first in case time runs out before the end
+			std::vector<int> remaining;
+			for (int tile : tiles.order)
+			{
+				if (!progressive->converged[tile])
+				{
+					remaining.push_back(tile);
+				}
+			}
+			if (pass > 0)
+			{
+				std::stable_sort(remaining.begin(), remaining.end(), [progressive](int a, int b) {
+					return progressive->error[a] > progressive->error[b];
+				});
+			}
+			tiles.restart(remaining);
+
+			if (listener)
+			{
+				listener->passDone(image, pass);
+			}
+		}
+	}
+
+	if (is_farmed && !is_farm_worker)
+	{
+		int workers = settings.farm->endRender();
+
+		// Tiles lost with workers after the local threads had finished
+		std::vector<int> lost = tiles.takeRetries();
+		if (!lost.empty())
+		{
+			std::cout << "Rendering " << lost.size() << " tiles lost with workers" << std::endl;
+			tiles.restart(lost);
+			pool.start(RenderThread_Run, (void **)renderMap, num_threads);
+			pool.wait();
+		}
+
+		std::cout << farm_tiles.rendered << " of " << tiles.tiles_x * tiles.tiles_y << " tiles were rendered by "
+				  << workers << " workers" << std::endl;
+	}
+
+	std::cout << "Rendering process complete" << std::endl;
+
+	// The checkpoint is kept until the output is written
+	if (checkpoint)
+	{
+		rt_save_checkpoint(*checkpoint, tiles, image, progressive);
+		checkpoint->sync();
+		checkpoint->close();
+	}
+
+	if (is_deferred)
+	{
+		settings.gbuffer->markFilled();
+	}
+	if (is_incremental)
+	{
+		settings.incremental->markFilled(image);
+	}
+	if (is_capture)
+	{
+		settings.relight->markFilled();
+		std::cout << "Cached " << settings.relight->size() << " hits for relighting" << std::endl;
+	}
+
+	if (progressive && progressive->expired())
+	{
+		std::cout << "Time budget of " << settings.time_budget << "s used, "
+				  << tiles.order.size() << " tiles were still being refined" << std::endl;
+	}
+
+	// Rows left unfinished when the time ran out hold the best image there
+	// is, so they are final now
+	if (listener)
+	{
+		for (int tile_y = 0; tile_y < tiles.tiles_y; tile_y++)
+		{
+			if (tiles.row_done[tile_y] < tiles.tiles_x)
+			{
+				int y1 = std::min<int>((tile_y + 1) * RT_TILE_SIZE, h);
+				for (int y = tile_y * RT_TILE_SIZE; y < y1; y++)
+				{
+					listener->rowDone(image, y);
+				}
+			}
+		}
+	}
 
-	// Wait on all threads to finish
 	for (int i = 0; i < num_threads; i++)
 	{
-		pthread_join(threads[i], NULL);
 		delete renderMap[i];
 	}
+	delete progressive;
+	delete adaptive;
+	delete light_tree;
+
+	if (settings.aa_max_samples > 1 || is_progressive)
+	{
+		long samples = 0;
+		for (int i = 0; i < num_threads; i++)
+		{
+			samples += thread_samples[i];
+		}
+		std::cout << "Average samples per pixel: " << (double)samples / std::max<size_t>(w * h, 1) << std::endl;
+	}
+
+	long shadow_hits = 0, shadow_misses = 0;
+	for (const ShadowCache &cache : shadow_caches)
+	{
+		shadow_hits += cache.hits;
+		shadow_misses += cache.misses;
+	}
+	if (shadow_hits + shadow_misses > 0)
+	{
+		std::cout << "Shadow cache: " << shadow_hits << " hits, " << shadow_misses << " misses ("
+				  << (100.0 * shadow_hits) / (shadow_hits + shadow_misses) << "% hit rate)" << std::endl;
+	}
+
+	double render_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - render_start).count();
+	rt_report_counters(thread_counters, render_seconds, (long)w * h, num_threads, shadow_hits, shadow_misses, settings);
+
+	if (is_cost_mapped)
+	{
+		rt_report_costs(*settings.cost_map, scene);
+	}
+
+	std::cout << "Scene rendered" << std::endl;
+}
+
+//---------------------------------------------------------------------------------------
+bool rt_views_share_render(const RenderSettings &settings)
+{
+	return settings.passes <= 1 && settings.time_budget <= 0.0 && !settings.gbuffer && !settings.relight &&
+		   !settings.incremental && !settings.farm && !settings.checkpoint;
+}
+
+void rt_RenderViews(
+	// What to render
+	SceneNode *root,
+
+	// The cameras to render from, and the images to render to
+	const std::vector<RenderView> &views,
+
+	// Lighting parameters
+	const glm::vec3 &ambient,
+	const std::list<Light *> &lights,
+
+	// Quality settings
+	const RenderSettings &settings)
+{
+	// Renders that keep state for their view between passes or renders go
+	// one view at a time
+	if (views.size() == 1 || !rt_views_share_render(settings))
+	{
+		for (const RenderView &v : views)
+		{
+			rt_Render(root, *v.image, v.eye, v.view, v.up, v.fovy, ambient, lights, v.listener, settings);
+		}
+		return;
+	}
+
+	TRACE_SCOPE("rt_RenderViews");
+
+	std::cout << "Calling rt_RenderViews(\n"
+			  << "\t" << *root << "\t"
+			  << "ambient: " << glm::to_string(ambient) << std::endl
+			  << "\t"
+			  << lights.size() << " lights" << std::endl;
+	for (const RenderView &v : views)
+	{
+		std::cout << "\t"
+				  << "Image(width:" << v.image->width() << ", height:" << v.image->height() << ") "
+				  << "eye: " << glm::to_string(v.eye) << " view: " << glm::to_string(v.view)
+				  << " up: " << glm::to_string(v.up) << " fovy: " << v.fovy << std::endl;
+	}
+	std::cout << ")" << std::endl;
+
+	// The scene and the light tree are built once for every view
+	LightTree *light_tree = NULL;
+	if (settings.light_samples > 0 || settings.light_cutoff > 0.0)
+	{
+		light_tree = new LightTree(lights, settings.light_cutoff);
+	}
+	Scene scene(root);
+
+	WorkerPool &pool = WorkerPool::shared();
+	const int num_threads = RT_NUM_THREADS;
+
+	// Every view has a queue of tiles and a set of tasks taking from it. The
+	// pool runs the tasks in order, so threads move on to the next view as
+	// the tiles of one run out, without waiting for the others to finish
+	// theirs. Tasks of different views run at once, so each task has its own
+	// shadow cache.
+	size_t num_tasks = views.size() * num_threads;
+	std::vector<TileQueue *> queues;
+	std::vector<AdaptiveState *> adaptive_states;
+	std::vector<glm::mat4> unprojs(views.size());
+	std::vector<int> task_progress(num_tasks, 0);
+	std::vector<int> task_status(num_tasks, THREAD_RENDER_INIT);
+	std::vector<long> task_samples(num_tasks, 0);
+	std::vector<ShadowCache> shadow_caches(num_tasks);
+	std::vector<RenderCounters> task_counters(num_tasks, RenderCounters());
+	std::vector<ThreadRenderMap *> renderMap;
+
+	long total_pixels = 0;
+	for (size_t v = 0; v < views.size(); v++)
+	{
+		const RenderView &view = views[v];
+		uint w = view.image->width();
+		uint h = view.image->height();
+		uint frame_width = settings.frame_width ? settings.frame_width : w;
+		uint frame_height = settings.frame_height ? settings.frame_height : h;
+		unprojs[v] = Raytracer_get_proj_inverse(frame_width, frame_height, view.fovy, glm::length(view.view), view.eye, view.view, view.up);
+
+		queues.push_back(new TileQueue(w, h));
+		total_pixels += (long)w * h;
+
+		// Anti-aliased views have their first samples taken in a sweep of
+		// their own, as in rt_Render
+		AdaptiveState *adaptive = NULL;
+		if (settings.aa_max_samples > 1)
+		{
+			adaptive = new AdaptiveState(w, h, queues[v]->tiles_x * queues[v]->tiles_y);
+			adaptive_states.push_back(adaptive);
+		}
+
+		for (int i = 0; i < num_threads; i++)
+		{
+			size_t task = v * num_threads + i;
+			renderMap.push_back(new ThreadRenderMap(
+				*view.image,
+				queues[v],
+				i,
+				w, h,
+				root, &scene, &shadow_caches[task],
+				unprojs[v],
+				view.eye, ambient,
+				lights,
+				&task_progress[task],
+				&task_status[task],
+				&task_samples[task],
+				view.listener,
+				settings,
+				light_tree,
+				NULL));
+			renderMap.back()->adaptive = adaptive;
+			renderMap.back()->counters = &task_counters[task];
+		}
+	}
+
+	std::cout << "Rendering " << views.size() << " views with " << num_threads << " threads." << std::endl;
+	std::chrono::steady_clock::time_point render_start = std::chrono::steady_clock::now();
+
+	// The sampling sweep of every anti-aliased view finishes before any
+	// tile is refined
+	int first_sweep = adaptive_states.empty() ? 1 : 0;
+	for (int sweep = first_sweep; sweep < 2; sweep++)
+	{
+		for (AdaptiveState *adaptive : adaptive_states)
+		{
+			adaptive->sampling = sweep == 0;
+		}
+		for (TileQueue *queue : queues)
+		{
+			queue->restart(std::vector<int>(queue->order));
+		}
+		for (size_t task = 0; task < num_tasks; task++)
+		{
+			task_progress[task] = 0;
+			task_status[task] = THREAD_RENDER_INIT;
+		}
+
+		pool.start(RenderThread_Run, (void **)&renderMap[0], num_tasks);
+
+		const int update_interval = 100 * 1000; // 100 milliseconds in microseconds
+
+		bool is_processing = true;
+		while (is_processing)
+		{
+			bool is_done = true;
+			long pixels_done = 0;
+			for (size_t task = 0; task < num_tasks; task++)
+			{
+				is_done = is_done && task_status[task];
+				pixels_done += task_progress[task];
+			}
+
+			if (sweep == 0)
+			{
+				std::cout << "Sampling: ";
+			}
+			std::cout << "Progress: " << (int)((pixels_done * 100) / std::max(total_pixels, 1L)) << "% \r" << std::flush;
+
+			if (is_done)
+			{
+				is_processing = false;
+			}
+			else
+			{
+				usleep(update_interval);
+			}
+		}
+
+		pool.wait();
+	}
+	std::cout << "Rendering process complete" << std::endl;
+
+	for (ThreadRenderMap *map : renderMap)
+	{
+		delete map;
+	}
+	for (TileQueue *queue : queues)
+	{
+		delete queue;
+	}
+	for (AdaptiveState *adaptive : adaptive_states)
+	{
+		delete adaptive;
+	}
+	delete light_tree;
+
+	if (settings.aa_max_samples > 1)
+	{
+		long samples = 0;
+		for (long count : task_samples)
+		{
+			samples += count;
+		}
+		std::cout << "Average samples per pixel: " << (double)samples / std::max(total_pixels, 1L) << std::endl;
+	}
+
+	long shadow_hits = 0, shadow_misses = 0;
+	for (const ShadowCache &cache : shadow_caches)
+	{
+		shadow_hits += cache.hits;
+		shadow_misses += cache.misses;
+	}
+	if (shadow_hits + shadow_misses > 0)
+	{
+		std::cout << "Shadow cache: " << shadow_hits << " hits, " << shadow_misses << " misses ("
+				  << (100.0 * shadow_hits) / (shadow_hits + shadow_misses) << "% hit rate)" << std::endl;
+	}
+
+	double render_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - render_start).count();
+	rt_report_counters(task_counters, render_seconds, total_pixels, num_threads, shadow_hits, shadow_misses, settings);
 
 	std::cout << "Scene rendered" << std::endl;
 }
@@ -1,11 +1,124 @@
 #pragma once
 
+#include <vector>
+#include <string>
+
 #include <glm/glm.hpp>
 
 #include "MathHelper.hpp"
 #include "SceneNode.hpp"
 #include "Light.hpp"
 #include "Image.hpp"
+#include "RenderListener.hpp"
+#include "GBuffer.hpp"
+#include "RelightCache.hpp"
+#include "IncrementalCache.hpp"
+#include "TileFarm.hpp"
+#include "RenderCheckpoint.hpp"
+#include "CostMap.hpp"
+
+// Number of threads used to render an image, can be set at compile-time
+#ifndef RT_NUM_THREADS
+#define RT_NUM_THREADS 8
+#endif
+
+// Settings that trade rendering time for image quality
+struct RenderSettings
+{
+	// Adaptive anti-aliasing. Every pixel gets one sample, and pixels whose
+	// colour differs from a neighbour's by more than the threshold, or that
+	// see a different object, are refined with up to this many samples.
+	int aa_max_samples;
+	double aa_threshold;
+
+	// Progressive rendering, used when there is more than one pass. Each
+	// pass adds a sample to every pixel of the tiles that are still noisy,
+	// and a tile stops once the average standard error of its pixels is
+	// below the threshold, after at least the minimum number of passes (never
+	// fewer than 2, as one sample gives no estimate of the error).
+	int passes;
+	int min_passes;
+	double variance_threshold;
+
+	// Wall-clock time allowed for the render in seconds, or 0 for no
+	// limit. With a budget the render is progressive: a coarse preview
+	// first, then a full pass, then more samples for the noisiest tiles,
+	// and it stops with the best image so far when the time is up.
+	double time_budget;
+
+	// Number of lights sampled at each hit, picked at random in proportion
+	// to how much they are likely to add. 0 uses every light.
+	int light_samples;
+
+	// Lights are skipped at hits where their falloff brings them below this
+	// in every colour component, without casting a shadow ray. 0 keeps them.
+	double light_cutoff;
+
+	// Reflections are followed at most this many bounces deep, and not at
+	// all once they would scale the colour by no more than the minimum
+	// throughput. Reflections that would add less than the roulette
+	// threshold are followed at random in proportion, and weighted up to
+	// make up for it. A roulette threshold of 0 turns this off.
+	int max_depth;
+	double min_throughput;
+	double roulette_threshold;
+
+	// Deferred shading. When set, the primary hits of each tile are written
+	// to this G-buffer and then shaded from it in a second sweep, and a
+	// G-buffer already filled for the same view is shaded from directly.
+	// Only one sample is taken per pixel.
+	GBuffer *gbuffer;
+
+	// Relighting. When set, the render records in this cache the surface
+	// points each pixel sees and which lights reach them, taking one sample
+	// per pixel and using every light. A later render of the same view with
+	// the lights in the same places only redoes the lighting from the cache.
+	RelightCache *relight;
+
+	// Incremental rendering. When set, the render keeps its image in this
+	// cache along with what the rays of each tile met, and a later render
+	// of the same view, lights and settings only traces the tiles that the
+	// scene edits since then could have changed.
+	IncrementalCache *incremental;
+
+	// Distributed rendering. When set, the tiles of single pass renders are
+	// shared with other processes through this farm, as its coordinator or
+	// as one of its workers.
+	TileFarm *farm;
+
+	// Checkpointing. When set, finished tiles are saved to this checkpoint
+	// as the render goes, and a render that finds a checkpoint of itself
+	// there carries on from it. Relighting, deferred and incremental renders
+	// and the workers of distributed ones are not checkpointed.
+	RenderCheckpoint *checkpoint;
+
+	// Cost map. When set, the time, rays and intersection tests of every
+	// sample are added to its pixel in this map, which must be the size of
+	// the image. Deferred and relighting renders, and tiles rendered by the
+	// workers of distributed ones, are not measured.
+	CostMap *cost_map;
+
+	// Statistics. The rays, intersection tests and shading of every render
+	// are printed when it finishes, and when this is set they are also
+	// appended to this file as a line of JSON.
+	std::string stats_file;
+
+	// Crop window. When the frame size is set, the image is the window of
+	// a frame of that size with its top left corner at the crop position,
+	// rendered with the camera of the whole frame.
+	uint crop_x, crop_y;
+	uint frame_width, frame_height;
+
+	// The defaults take a single sample per pixel
+	RenderSettings()
+		: aa_max_samples(1), aa_threshold(0.1),
+		  passes(1), min_passes(4), variance_threshold(0.01),
+		  time_budget(0.0), light_samples(0), light_cutoff(0.0),
+		  max_depth(1), min_throughput(0.0), roulette_threshold(0.0),
+		  gbuffer(NULL), relight(NULL), incremental(NULL), farm(NULL),
+		  checkpoint(NULL), cost_map(NULL),
+		  crop_x(0), crop_y(0), frame_width(0), frame_height(0) {}
+};
 
 void rt_Render(
 	// What to render
@@ -22,4 +135,46 @@ void rt_Render(
 
 	// Lighting parameters
 	const glm::vec3 &ambient,
-	const std::list<Light *> &lights);
+	const std::list<Light *> &lights,
+
+	// Optional observer notified as rows of the image are completed
+	RenderListener *listener = NULL,
+
+	// Quality settings
+	const RenderSettings &settings = RenderSettings());
+
+// A camera to render from, and the image it renders to
+struct RenderView
+{
+	Image *image;
+
+	// Viewing parameters
+	glm::vec3 eye, view, up;
+	double fovy;
+
+	// Optional observer notified as rows of the image are completed
+	RenderListener *listener;
+};
+
+// Whether renders with these settings can share their setup between views.
+// Progressive, deferred, relighting, incremental, distributed and
+// checkpointed renders keep state for a single view.
+bool rt_views_share_render(const RenderSettings &settings);
+
+// Render the scene from several cameras at once, as for stereo pairs. The
+// scene is prepared once, and the tiles of every view are rendered by the
+// same threads. Settings that cannot be shared render the views one after
+// another.
+void rt_RenderViews(
+	// What to render
+	SceneNode *root,
+
+	// The cameras to render from, and the images to render to
+	const std::vector<RenderView> &views,
+
+	// Lighting parameters
+	const glm::vec3 &ambient,
+	const std::list<Light *> &lights,
+
+	// Quality settings
+	const RenderSettings &settings = RenderSettings());
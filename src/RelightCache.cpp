@@ -0,0 +1,93 @@
+#include "RelightCache.hpp"
+
+//---------------------------------------------------------------------------------------
+bool RelightKey::operator==(const RelightKey &other) const
+{
+	return view == other.view && root == other.root &&
+		   light_positions == other.light_positions &&
+		   max_depth == other.max_depth && min_throughput == other.min_throughput &&
+		   roulette_threshold == other.roulette_threshold;
+}
+
+//---------------------------------------------------------------------------------------
+RelightCache::RelightCache()
+	: m_filled(false), m_words(0)
+{
+}
+
+//---------------------------------------------------------------------------------------
+bool RelightCache::matches(const RelightKey &key) const
+{
+	return m_filled && m_key == key;
+}
+
+//---------------------------------------------------------------------------------------
+void RelightCache::prepare(const RelightKey &key, int num_tiles, size_t num_lights, const Scene &scene)
+{
+	m_key = key;
+	m_filled = false;
+	m_words = (num_lights + 63) / 64;
+
+	m_tiles.clear();
+	m_tiles.resize(num_tiles);
+
+	m_materials.clear();
+	for (size_t i = 0; i < scene.numMaterials(); i++)
+	{
+		m_materials.push_back(scene.material(i));
+	}
+}
+
+//---------------------------------------------------------------------------------------
+void RelightCache::markFilled()
+{
+	m_filled = true;
+}
+
+//---------------------------------------------------------------------------------------
+void RelightCache::clear()
+{
+	m_filled = false;
+	m_tiles.clear();
+}
+
+//---------------------------------------------------------------------------------------
+size_t RelightCache::words() const
+{
+	return m_words;
+}
+
+//---------------------------------------------------------------------------------------
+size_t RelightCache::numTiles() const
+{
+	return m_tiles.size();
+}
+
+//---------------------------------------------------------------------------------------
+RelightTile &RelightCache::tile(int index)
+{
+	return m_tiles[index];
+}
+
+//---------------------------------------------------------------------------------------
+const RelightTile &RelightCache::tile(int index) const
+{
+	return m_tiles[index];
+}
+
+//---------------------------------------------------------------------------------------
+const SceneMaterial &RelightCache::material(unsigned int index) const
+{
+	return m_materials[index];
+}
+
+//---------------------------------------------------------------------------------------
+size_t RelightCache::size() const
+{
+	size_t count = 0;
+	for (const RelightTile &tile : m_tiles)
+	{
+		count += tile.vertices.size();
+	}
+	return count;
+}
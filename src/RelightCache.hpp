@@ -0,0 +1,108 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "GBuffer.hpp"
+#include "Scene.hpp"
+
+// What a relighting cache was captured for. Anything that changes where
+// rays go or which lights they can see makes the cache unusable, while
+// light colours, falloff and the ambient light can change freely.
+struct RelightKey
+{
+	GBufferView view;
+
+	const SceneNode *root;
+
+	// Visibility depends on where the lights are and how many there are
+	std::vector<glm::vec3> light_positions;
+
+	// Settings that decide which reflections are followed
+	int max_depth;
+	double min_throughput;
+	double roulette_threshold;
+
+	bool operator==(const RelightKey &other) const;
+};
+
+// A point where a path from the camera met a surface, with everything
+// needed to shade it again
+struct RelightVertex
+{
+	glm::vec3 point;
+	glm::vec3 normal;
+
+	// Where the ray that hit the point came from
+	glm::vec3 origin;
+
+	// How much the point's colour is scaled by on its way to the camera
+	glm::vec3 weight;
+
+	unsigned int material;
+};
+
+// The vertices of the pixels of one tile. The vertices of pixel i of the
+// tile are first[i] up to first[i + 1], and each vertex has 'words' words
+// of light visibility bits.
+struct RelightTile
+{
+	uint x0, y0, x1, y1;
+
+	std::vector<uint> first;
+	std::vector<RelightVertex> vertices;
+	std::vector<uint64_t> visibility;
+
+	// Background seen by each pixel, already weighted
+	std::vector<glm::vec3> background;
+};
+
+/**
+ * Everything needed to light an image again without tracing any rays: for
+ * each pixel, the surface points its primary and reflected rays hit, and
+ * which lights each point can see.
+ *
+ * A render fills the cache tile by tile, and a later render of the same view
+ * with lights in the same places recomputes the image from it using only the
+ * lighting arithmetic, so light colours, falloff and the ambient light can be
+ * changed quickly. Changes to the scene are not noticed, so clear() should
+ * be called after editing it.
+ */
+class RelightCache
+{
+  public:
+	RelightCache();
+
+	// Whether the cache holds a capture for 'key'
+	bool matches(const RelightKey &key) const;
+
+	// Get ready to capture a render for 'key' with 'num_tiles' tiles, with
+	// the materials of 'scene'.
+	void prepare(const RelightKey &key, int num_tiles, size_t num_lights, const Scene &scene);
+
+	// Record that the capture is complete, or throw it away.
+	void markFilled();
+	void clear();
+
+	// Words of visibility bits for each vertex
+	size_t words() const;
+
+	size_t numTiles() const;
+	RelightTile &tile(int index);
+	const RelightTile &tile(int index) const;
+
+	const SceneMaterial &material(unsigned int index) const;
+
+	// Total number of vertices stored
+	size_t size() const;
+
+  private:
+	RelightKey m_key;
+	bool m_filled;
+	size_t m_words;
+
+	std::vector<RelightTile> m_tiles;
+	std::vector<SceneMaterial> m_materials;
+};
@@ -0,0 +1,227 @@
+#include "RenderCheckpoint.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CHECKPOINT_MAGIC "RTCKPT02"
+
+// Every version of the format starts with this, so a checkpoint left by an
+// older version can be started again in its place
+#define CHECKPOINT_MAGIC_PREFIX "RTCKPT"
+
+struct RenderCheckpoint::Header
+{
+	char magic[8];
+	uint64_t key;
+	uint32_t width, height;
+	uint32_t num_tiles;
+	uint32_t progressive;
+};
+
+struct RenderCheckpoint::TileRecord
+{
+	int32_t samples;
+	uint32_t converged;
+	double error;
+};
+
+//---------------------------------------------------------------------------------------
+RenderCheckpoint::RenderCheckpoint(const std::string &path, double interval)
+	: m_path(path), m_interval(interval),
+	  m_map(NULL), m_size(0),
+	  m_header(NULL), m_tiles(NULL), m_colours(NULL), m_squares(NULL)
+{
+}
+
+//---------------------------------------------------------------------------------------
+RenderCheckpoint::~RenderCheckpoint()
+{
+	close();
+}
+
+//---------------------------------------------------------------------------------------
+const std::string &RenderCheckpoint::path() const
+{
+	return m_path;
+}
+
+//---------------------------------------------------------------------------------------
+double RenderCheckpoint::interval() const
+{
+	return m_interval;
+}
+
+//---------------------------------------------------------------------------------------
+bool RenderCheckpoint::open(uint64_t key, uint width, uint height, int num_tiles, bool progressive)
+{
+	close();
+
+	// The luminance sums of a progressive render follow the colours, lined
+	// up for doubles
+	size_t pixels = (size_t)width * height;
+	size_t colours_offset = sizeof(Header) + num_tiles * sizeof(TileRecord);
+	size_t squares_offset = (colours_offset + pixels * 3 * sizeof(float) + 7) & ~(size_t)7;
+	size_t size = progressive ? squares_offset + pixels * 2 * sizeof(double) : squares_offset;
+
+	int fd = ::open(m_path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		std::cerr << "could not open checkpoint " << m_path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		std::cerr << "could not open checkpoint " << m_path << ": " << strerror(errno) << std::endl;
+		::close(fd);
+		return false;
+	}
+
+	// Only a new file or a checkpoint is written over, so that a mistyped
+	// path cannot wipe out anything else
+	char prefix[sizeof(CHECKPOINT_MAGIC_PREFIX) - 1];
+	if (info.st_size > 0 && (pread(fd, prefix, sizeof(prefix), 0) != (ssize_t)sizeof(prefix) ||
+							 memcmp(prefix, CHECKPOINT_MAGIC_PREFIX, sizeof(prefix)) != 0))
+	{
+		std::cerr << m_path << " is not a checkpoint, so it is left alone" << std::endl;
+		::close(fd);
+		return false;
+	}
+
+	// A file of the right size might be a checkpoint of this render
+	bool resume = false;
+	if ((size_t)info.st_size == size)
+	{
+		Header header;
+		resume = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+				 memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+				 header.key == key && header.width == width && header.height == height &&
+				 header.num_tiles == (uint32_t)num_tiles && header.progressive == (uint32_t)progressive;
+	}
+
+	// Otherwise it starts again, zeroed so that no tile is done
+	if (!resume && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0))
+	{
+		std::cerr << "could not create checkpoint " << m_path << ": " << strerror(errno) << std::endl;
+		::close(fd);
+		return false;
+	}
+
+	void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (mapping == MAP_FAILED)
+	{
+		std::cerr << "could not map checkpoint " << m_path << std::endl;
+		return false;
+	}
+
+	unsigned char *bytes = static_cast<unsigned char *>(mapping);
+	m_map = mapping;
+	m_size = size;
+	m_header = reinterpret_cast<Header *>(bytes);
+	m_tiles = reinterpret_cast<TileRecord *>(bytes + sizeof(Header));
+	m_colours = reinterpret_cast<float *>(bytes + colours_offset);
+	m_squares = progressive ? reinterpret_cast<double *>(bytes + squares_offset) : NULL;
+
+	if (!resume)
+	{
+		memcpy(m_header->magic, CHECKPOINT_MAGIC, sizeof(m_header->magic));
+		m_header->key = key;
+		m_header->width = width;
+		m_header->height = height;
+		m_header->num_tiles = num_tiles;
+		m_header->progressive = progressive;
+	}
+
+	return resume;
+}
+
+//---------------------------------------------------------------------------------------
+bool RenderCheckpoint::isOpen() const
+{
+	return m_map != NULL;
+}
+
+//---------------------------------------------------------------------------------------
+int RenderCheckpoint::samples(int tile) const
+{
+	return m_tiles[tile].samples;
+}
+
+//---------------------------------------------------------------------------------------
+double RenderCheckpoint::error(int tile) const
+{
+	return m_tiles[tile].error;
+}
+
+//---------------------------------------------------------------------------------------
+bool RenderCheckpoint::converged(int tile) const
+{
+	return m_tiles[tile].converged != 0;
+}
+
+//---------------------------------------------------------------------------------------
+void RenderCheckpoint::setTile(int tile, int samples, double error, bool converged)
+{
+	// The pixels must be in the file before the count that says they are,
+	// in case the process is killed in between
+	std::atomic_thread_fence(std::memory_order_release);
+
+	m_tiles[tile].error = error;
+	m_tiles[tile].converged = converged;
+	m_tiles[tile].samples = samples;
+
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+//---------------------------------------------------------------------------------------
+float *RenderCheckpoint::colours()
+{
+	return m_colours;
+}
+
+//---------------------------------------------------------------------------------------
+double *RenderCheckpoint::squares()
+{
+	return m_squares;
+}
+
+//---------------------------------------------------------------------------------------
+void RenderCheckpoint::sync()
+{
+	if (m_map)
+	{
+		msync(m_map, m_size, MS_ASYNC);
+	}
+}
+
+//---------------------------------------------------------------------------------------
+void RenderCheckpoint::close()
+{
+	if (m_map)
+	{
+		munmap(m_map, m_size);
+	}
+	m_map = NULL;
+	m_size = 0;
+	m_header = NULL;
+	m_tiles = NULL;
+	m_colours = NULL;
+	m_squares = NULL;
+}
+
+//---------------------------------------------------------------------------------------
+void RenderCheckpoint::finish()
+{
+	close();
+	unlink(m_path.c_str());
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+typedef unsigned int uint;
+
+// A 64-bit FNV-1a hash of everything that decides the pixels of a render,
+// so that a checkpoint is only resumed by the render it was saved from
+struct CheckpointKey
+{
+	uint64_t hash;
+
+	CheckpointKey() : hash(14695981039346656037ULL) {}
+
+	void add(const void *data, size_t size)
+	{
+		const unsigned char *bytes = static_cast<const unsigned char *>(data);
+		for (size_t i = 0; i < size; i++)
+		{
+			hash = (hash ^ bytes[i]) * 1099511628211ULL;
+		}
+	}
+
+	// Values must not have padding, which would hash whatever it holds
+	template <typename T>
+	void add(const T &value)
+	{
+		add(&value, sizeof(T));
+	}
+};
+
+/**
+ * The progress of a render kept in a file, so that a render that is killed
+ * can carry on from where it got to instead of starting again. The file is
+ * mapped into memory and tiles are copied into it as they finish, so a
+ * process that is killed loses nothing already copied, and sync() writes
+ * it out in case the machine goes too.
+ *
+ * For each tile the file holds the number of samples each of its pixels has
+ * (0 for tiles not rendered yet, 1 for finished tiles of single pass
+ * renders), its estimated error and whether it has converged. For single
+ * pass renders it holds the colour of each pixel, and for progressive ones
+ * the sum of the samples of each pixel and of their luminance and squared
+ * luminance.
+ */
+class RenderCheckpoint
+{
+  public:
+	// Checkpoint to 'path', syncing it every 'interval' seconds
+	RenderCheckpoint(const std::string &path, double interval);
+	~RenderCheckpoint();
+
+	const std::string &path() const;
+	double interval() const;
+
+	// Map the file for a render with the given key and size. Returns true
+	// if it holds a checkpoint of the same render to resume from, otherwise
+	// it is started again with no tiles done. A file that is not empty and
+	// not a checkpoint is refused, and the checkpoint is left closed.
+	bool open(uint64_t key, uint width, uint height, int num_tiles, bool progressive);
+	bool isOpen() const;
+
+	// The saved state of a tile
+	int samples(int tile) const;
+	double error(int tile) const;
+	bool converged(int tile) const;
+
+	// Record the state of a tile, after its pixels have been copied in. A
+	// tile saved before is set to 0 samples while it is copied over.
+	void setTile(int tile, int samples, double error, bool converged);
+
+	// Three floats for each pixel in row order: the colours of a single
+	// pass render, or the sums of the samples of a progressive one
+	float *colours();
+
+	// Two doubles for each pixel of a progressive render, the sums of the
+	// luminance of its samples and of their squares, otherwise NULL
+	double *squares();
+
+	// Start writing the mapping out to the file
+	void sync();
+
+	// Unmap the file, keeping it to resume from, or removing it once the
+	// render is safely written
+	void close();
+	void finish();
+
+  private:
+	struct Header;
+	struct TileRecord;
+
+	std::string m_path;
+	double m_interval;
+
+	void *m_map;
+	size_t m_size;
+
+	Header *m_header;
+	TileRecord *m_tiles;
+	float *m_colours;
+	double *m_squares;
+};
@@ -0,0 +1,4 @@
+#include "RenderCounters.hpp"
+
+// Zeroed like any other static, for each thread as it starts
+thread_local RenderCounters rt_counters;
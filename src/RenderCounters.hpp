@@ -0,0 +1,71 @@
+#pragma once
+
+/**
+ * Counts of the work a thread has done while rendering. Every thread has
+ * its own, so counting takes no locks and threads never write to the same
+ * cache lines. The counts only go up, and the renderer reads how much they
+ * moved over whatever it is measuring.
+ *
+ * The struct is kept trivial, so that the thread's copy is zeroed like any
+ * other static and reaching it costs no more than reaching a global.
+ */
+struct RenderCounters
+{
+	// Rays traced from the camera, towards lights and off mirrors
+	long primary_rays;
+	long shadow_rays;
+	long reflection_rays;
+
+	// Nodes of the scene graph, or instances of the flattened scene, that a
+	// ray was tested against
+	long node_visits;
+
+	// Intersection tests with boxes (including the bounds of meshes),
+	// spheres and mesh triangles
+	long box_tests;
+	long sphere_tests;
+	long triangle_tests;
+
+	// Hits shaded
+	long shading_calls;
+
+	long rays() const
+	{
+		return primary_rays + shadow_rays + reflection_rays;
+	}
+
+	long primitiveTests() const
+	{
+		return box_tests + sphere_tests + triangle_tests;
+	}
+
+	void add(const RenderCounters &other)
+	{
+		primary_rays += other.primary_rays;
+		shadow_rays += other.shadow_rays;
+		reflection_rays += other.reflection_rays;
+		node_visits += other.node_visits;
+		box_tests += other.box_tests;
+		sphere_tests += other.sphere_tests;
+		triangle_tests += other.triangle_tests;
+		shading_calls += other.shading_calls;
+	}
+
+	// The counts since the counters stood at 'start'
+	RenderCounters since(const RenderCounters &start) const
+	{
+		RenderCounters delta = *this;
+		delta.primary_rays -= start.primary_rays;
+		delta.shadow_rays -= start.shadow_rays;
+		delta.reflection_rays -= start.reflection_rays;
+		delta.node_visits -= start.node_visits;
+		delta.box_tests -= start.box_tests;
+		delta.sphere_tests -= start.sphere_tests;
+		delta.triangle_tests -= start.triangle_tests;
+		delta.shading_calls -= start.shading_calls;
+		return delta;
+	}
+};
+
+// The counters of the calling thread
+extern thread_local RenderCounters rt_counters;
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+
+#include "Image.hpp"
+
+/**
+ * Receives notifications from rt_Render as parts of the image are completed.
+ *
+ * The callbacks are made from the render threads themselves, so any
+ * implementation must be safe to call concurrently.
+ */
+class RenderListener
+{
+  public:
+	virtual ~RenderListener() {}
+
+	// The tile at ('x', 'y') of size 'w' by 'h' has been rendered. In a
+	// progressive render this happens again on each pass over the tile.
+	virtual void tileDone(const Image &, uint, uint, uint, uint) {}
+
+	// Row 'y' of 'image' has its final value and will not be written again.
+	virtual void rowDone(const Image &, uint) {}
+
+	// Pass 'pass' of a progressive render is over. This is called from the
+	// thread that called rt_Render, while no tiles are being rendered.
+	virtual void passDone(const Image &, int) {}
+};
+
+/**
+ * Passes notifications on to each of a number of listeners, so that
+ * several can follow the same render.
+ */
+class RenderListenerGroup : public RenderListener
+{
+  public:
+	void add(RenderListener *listener)
+	{
+		m_listeners.push_back(listener);
+	}
+
+	bool empty() const
+	{
+		return m_listeners.empty();
+	}
+
+	virtual void tileDone(const Image &image, uint x, uint y, uint w, uint h)
+	{
+		for (RenderListener *listener : m_listeners)
+		{
+			listener->tileDone(image, x, y, w, h);
+		}
+	}
+
+	virtual void rowDone(const Image &image, uint y)
+	{
+		for (RenderListener *listener : m_listeners)
+		{
+			listener->rowDone(image, y);
+		}
+	}
+
+	virtual void passDone(const Image &image, int pass)
+	{
+		for (RenderListener *listener : m_listeners)
+		{
+			listener->passDone(image, pass);
+		}
+	}
+
+  private:
+	std::vector<RenderListener *> m_listeners;
+};
@@ -0,0 +1,322 @@
+#include "RenderServer.hpp"
+#include "scene_lua.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Requests larger than this are refused, as a guard against runaway clients
+#define RENDER_SERVER_MAX_REQUEST (16 * 1024 * 1024)
+
+// Seconds a client may take to send its whole request, so that one that
+// never finishes cannot hold up the requests after it
+#define RENDER_SERVER_TIMEOUT 10
+
+// Answers a request that is not queued, and closes the connection
+static void server_refuse(int fd, const char *reason)
+{
+	std::string text = std::string("error ") + reason + "\n";
+	send(fd, text.data(), text.size(), MSG_NOSIGNAL);
+	close(fd);
+}
+
+//---------------------------------------------------------------------------------------
+RenderServer::RenderServer(const std::string &path)
+	: m_path(path), m_listenFd(-1), m_lua(NULL), m_stopping(false)
+{
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_hasRequest, NULL);
+}
+
+//---------------------------------------------------------------------------------------
+RenderServer::~RenderServer()
+{
+	if (m_lua)
+	{
+		close_lua(m_lua);
+	}
+	pthread_cond_destroy(&m_hasRequest);
+	pthread_mutex_destroy(&m_lock);
+}
+
+//---------------------------------------------------------------------------------------
+bool RenderServer::run()
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (m_path.size() >= sizeof(addr.sun_path))
+	{
+		std::cerr << "Socket path " << m_path << " is too long" << std::endl;
+		return false;
+	}
+	strncpy(addr.sun_path, m_path.c_str(), sizeof(addr.sun_path) - 1);
+
+	// A socket left behind by an earlier server is replaced, but not one a
+	// server is still listening on, nor anything that is not a socket
+	struct stat info;
+	if (lstat(m_path.c_str(), &info) == 0)
+	{
+		if (!S_ISSOCK(info.st_mode))
+		{
+			std::cerr << m_path << " exists and is not a socket" << std::endl;
+			return false;
+		}
+
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		bool refused = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) != 0 && errno == ECONNREFUSED;
+		if (probe >= 0)
+		{
+			close(probe);
+		}
+		if (!refused)
+		{
+			std::cerr << "A server is already listening on " << m_path << std::endl;
+			return false;
+		}
+		unlink(m_path.c_str());
+	}
+
+	m_listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_listenFd < 0 || bind(m_listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(m_listenFd, 16) < 0)
+	{
+		std::cerr << "Could not listen on " << m_path << ": " << strerror(errno) << std::endl;
+		if (m_listenFd >= 0)
+		{
+			close(m_listenFd);
+		}
+		return false;
+	}
+
+	m_lua = open_lua();
+
+	pthread_t jobs;
+	int ret = pthread_create(&jobs, NULL, runJobs, this);
+	if (ret)
+	{
+		std::cerr << "Application had to abort:  pthread_Create failed with error code: " << ret << std::endl;
+		exit(4);
+	}
+
+	std::cout << "Render server listening on " << m_path << std::endl;
+
+	// Requests are read here and queued for the job thread, so that clients
+	// can send them while a render is running
+	while (true)
+	{
+		int fd = accept(m_listenFd, NULL, NULL);
+
+		pthread_mutex_lock(&m_lock);
+		bool stopping = m_stopping;
+		pthread_mutex_unlock(&m_lock);
+		if (stopping)
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+			break;
+		}
+		if (fd < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			std::cerr << "Render server could not accept a connection: " << strerror(errno) << std::endl;
+			break;
+		}
+
+		Request request;
+		request.fd = fd;
+
+		// The whole request must arrive before the deadline, however
+		// slowly it trickles in
+		std::chrono::steady_clock::time_point deadline =
+			std::chrono::steady_clock::now() + std::chrono::seconds(RENDER_SERVER_TIMEOUT);
+		bool timed_out = false;
+
+		char buffer[4096];
+		ssize_t count = 0;
+		while (request.text.size() <= RENDER_SERVER_MAX_REQUEST)
+		{
+			long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+								 deadline - std::chrono::steady_clock::now())
+								 .count();
+			struct pollfd client;
+			client.fd = fd;
+			client.events = POLLIN;
+			int ready = remaining > 0 ? poll(&client, 1, remaining) : 0;
+			if (ready < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (ready == 0)
+			{
+				timed_out = true;
+				break;
+			}
+
+			count = ready < 0 ? -1 : read(fd, buffer, sizeof(buffer));
+			if (count < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (count <= 0)
+			{
+				break;
+			}
+			request.text.append(buffer, count);
+		}
+
+		// A request that was cut short must not be run
+		if (request.text.size() > RENDER_SERVER_MAX_REQUEST)
+		{
+			server_refuse(fd, "request too large");
+			continue;
+		}
+		if (timed_out)
+		{
+			server_refuse(fd, "request timed out");
+			continue;
+		}
+		if (count < 0)
+		{
+			server_refuse(fd, strerror(errno));
+			continue;
+		}
+
+		pthread_mutex_lock(&m_lock);
+		m_queue.push_back(request);
+		pthread_cond_signal(&m_hasRequest);
+		pthread_mutex_unlock(&m_lock);
+	}
+
+	// Let the job thread finish what is queued
+	pthread_mutex_lock(&m_lock);
+	m_stopping = true;
+	pthread_cond_signal(&m_hasRequest);
+	pthread_mutex_unlock(&m_lock);
+	pthread_join(jobs, NULL);
+
+	close(m_listenFd);
+	unlink(m_path.c_str());
+	std::cout << "Render server stopped" << std::endl;
+
+	return true;
+}
+
+//---------------------------------------------------------------------------------------
+void *RenderServer::runJobs(void *arg)
+{
+	RenderServer &server = *static_cast<RenderServer *>(arg);
+
+	while (true)
+	{
+		pthread_mutex_lock(&server.m_lock);
+		while (server.m_queue.empty() && !server.m_stopping)
+		{
+			pthread_cond_wait(&server.m_hasRequest, &server.m_lock);
+		}
+		if (server.m_queue.empty())
+		{
+			pthread_mutex_unlock(&server.m_lock);
+			break;
+		}
+		Request request = server.m_queue.front();
+		server.m_queue.pop_front();
+		pthread_mutex_unlock(&server.m_lock);
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::string message;
+		bool ok = server.handle(request.text, message);
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::ostringstream reply;
+		if (ok)
+		{
+			reply << "ok " << elapsed << "s\n";
+		}
+		else
+		{
+			reply << "error " << message << "\n";
+		}
+
+		// The client may have gone, which is not worth stopping for
+		std::string text = reply.str();
+		send(request.fd, text.data(), text.size(), MSG_NOSIGNAL);
+		close(request.fd);
+	}
+
+	return NULL;
+}
+
+//---------------------------------------------------------------------------------------
+bool RenderServer::handle(const std::string &text, std::string &message)
+{
+	// The command is the first line, and anything after it is the body
+	size_t end = text.find('\n');
+	std::string line = text.substr(0, end);
+	std::string body = end == std::string::npos ? std::string() : text.substr(end + 1);
+
+	std::istringstream words(line);
+	std::string command;
+	words >> command;
+
+	if (command == "load")
+	{
+		std::string path;
+		std::getline(words >> std::ws, path);
+		if (path.empty())
+		{
+			message = "load needs the path of a script";
+			return false;
+		}
+		std::cout << "Loading " << path << std::endl;
+		return run_lua_file(m_lua, path, message);
+	}
+	else if (command == "eval")
+	{
+		return run_lua_string(m_lua, body, "=request", message);
+	}
+	else if (command == "render")
+	{
+		std::string output;
+		int width = 0, height = 0;
+		if (!(words >> output >> width >> height) || width <= 0 || height <= 0)
+		{
+			message = "render needs an output file, a width and a height";
+			return false;
+		}
+
+		// The overrides run to the end of the request
+		std::string overrides;
+		std::getline(words >> std::ws, overrides);
+		if (!body.empty())
+		{
+			overrides += "\n" + body;
+		}
+		return render_lua_scene(m_lua, output, width, height, overrides, message);
+	}
+	else if (command == "shutdown")
+	{
+		pthread_mutex_lock(&m_lock);
+		m_stopping = true;
+		pthread_mutex_unlock(&m_lock);
+
+		// Wake the accepting thread so that it notices
+		::shutdown(m_listenFd, SHUT_RDWR);
+		return true;
+	}
+
+	message = "unknown request '" + command + "'";
+	return false;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <deque>
+#include <string>
+
+#include <pthread.h>
+
+struct lua_State;
+
+/**
+ * A long-running renderer that keeps one Lua interpreter, with the scenes
+ * and meshes loaded into it, between jobs, so that many small renders do
+ * not each pay for starting Lua and parsing meshes again.
+ *
+ * Clients connect to a Unix domain socket, send a single request and close
+ * their side for writing. The server answers with one line, "ok" followed
+ * by the time the job took in seconds, or "error" followed by the reason,
+ * and closes the connection. Requests larger than 16 MB, or that take more
+ * than 10 seconds to send, are refused without being run. The requests are:
+ *
+ *     load <path>                  run a Lua script
+ *     eval                         run the rest of the request as Lua
+ *     render <output> <w> <h> [t]  render the scene in the globals
+ *     shutdown                     stop the server
+ *
+ * Scripts build scenes in the globals of the interpreter, which a render
+ * takes 'scene', 'lights', 'ambient', 'camera' and 'options' from, and the
+ * optional table constructor 't' can replace (see render_lua_scene).
+ *
+ * Requests are queued as they arrive and run one at a time, in order, each
+ * render using all of the renderer's worker pool.
+ */
+class RenderServer
+{
+  public:
+	RenderServer(const std::string &path);
+	~RenderServer();
+
+	// Serve requests until one asks the server to stop. Returns false if
+	// the socket could not be opened.
+	bool run();
+
+  private:
+	struct Request
+	{
+		int fd;
+		std::string text;
+	};
+
+	static void *runJobs(void *server);
+
+	// Carry out a request, giving the reply in 'message'
+	bool handle(const std::string &text, std::string &message);
+
+	std::string m_path;
+	int m_listenFd;
+	lua_State *m_lua;
+
+	std::deque<Request> m_queue;
+	bool m_stopping;
+
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_hasRequest;
+};
@@ -0,0 +1,127 @@
+#include "Scene.hpp"
+#include "PhongMaterial.hpp"
+#include "RenderCounters.hpp"
+
+//---------------------------------------------------------------------------------------
+Scene::Scene(SceneNode *root)
+{
+	// Geometry without a material is shaded with the first entry, a plain grey
+	SceneMaterial fallback;
+	fallback.type = MaterialType::Phong;
+	fallback.kd = glm::vec3(0.5);
+	fallback.ks = glm::vec3(0.0);
+	fallback.shininess = 1.0;
+	m_materials.push_back(fallback);
+	m_materialIndices[NULL] = 0;
+
+	flatten(root, glm::mat4());
+}
+
+//---------------------------------------------------------------------------------------
+unsigned int Scene::addMaterial(const Material *material)
+{
+	auto found = m_materialIndices.find(material);
+	if (found != m_materialIndices.end())
+	{
+		return found->second;
+	}
+
+	SceneMaterial entry;
+	entry.type = material->m_materialType;
+	switch (entry.type)
+	{
+	case MaterialType::Phong:
+	{
+		const PhongMaterial *phong = static_cast<const PhongMaterial *>(material);
+		entry.kd = phong->diffuse();
+		entry.ks = phong->specular();
+		entry.shininess = phong->shininess();
+		break;
+	}
+	}
+
+	unsigned int index = m_materials.size();
+	m_materials.push_back(entry);
+	m_materialIndices[material] = index;
+	return index;
+}
+
+//---------------------------------------------------------------------------------------
+void Scene::flatten(SceneNode *node, const glm::mat4 &parent)
+{
+	glm::mat4 trans = parent * node->get_transform();
+
+	if (node->m_nodeType == NodeType::GeometryNode)
+	{
+		const GeometryNode *geometry = static_cast<const GeometryNode *>(node);
+
+		SceneInstance instance;
+		instance.node = geometry;
+		instance.material_index = addMaterial(geometry->m_material);
+		if (geometry->m_nodeId >= m_nodeMaterials.size())
+		{
+			m_nodeMaterials.resize(geometry->m_nodeId + 1, 0);
+		}
+		m_nodeMaterials[geometry->m_nodeId] = instance.material_index;
+		instance.trans = trans;
+		instance.invtrans = glm::inverse(trans);
+
+		// The box in world coordinates holds all eight transformed corners
+		glm::vec3 lo, hi;
+		instance.bounded = geometry->m_primitive && geometry->m_primitive->bounds(lo, hi);
+		if (instance.bounded)
+		{
+			for (int corner = 0; corner < 8; corner++)
+			{
+				glm::vec4 point((corner & 1) ? hi.x : lo.x, (corner & 2) ? hi.y : lo.y, (corner & 4) ? hi.z : lo.z, 1.0);
+				glm::vec3 world(trans * point);
+				instance.lo = corner ? glm::min(instance.lo, world) : world;
+				instance.hi = corner ? glm::max(instance.hi, world) : world;
+			}
+		}
+		m_instances.push_back(instance);
+	}
+
+	for (SceneNode *child : node->children)
+	{
+		flatten(child, trans);
+	}
+}
+
+//---------------------------------------------------------------------------------------
+size_t Scene::size() const
+{
+	return m_instances.size();
+}
+
+//---------------------------------------------------------------------------------------
+size_t Scene::numMaterials() const
+{
+	return m_materials.size();
+}
+
+//---------------------------------------------------------------------------------------
+const SceneInstance &Scene::instance(size_t index) const
+{
+	return m_instances[index];
+}
+
+//---------------------------------------------------------------------------------------
+bool Scene::intersect(size_t index, const Ray &ray, Intersection &i) const
+{
+	const SceneInstance &instance = m_instances[index];
+	rt_counters.node_visits++;
+
+	// Intersect in the model coordinates of the instance
+	Ray model_ray = ray.transform(instance.invtrans);
+	if (!instance.node->m_primitive->intersect(model_ray, i))
+	{
+		return false;
+	}
+
+	i.transform(instance.trans);
+	i.material = instance.node->m_material;
+	i.object_id = instance.node->m_nodeId;
+	i.material_index = instance.material_index;
+	return true;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+
+#include <glm/glm.hpp>
+
+#include "MathHelper.hpp"
+#include "SceneNode.hpp"
+#include "GeometryNode.hpp"
+#include "Material.hpp"
+
+// A material as shading uses it, copied out of the Material objects of the
+// scene into one table so that hits can refer to it by index
+struct SceneMaterial
+{
+	MaterialType type;
+
+	// Phong parameters
+	glm::vec3 kd;
+	glm::vec3 ks;
+	double shininess;
+};
+
+// A geometry node placed in the world by the transforms on the path to it
+struct SceneInstance
+{
+	const GeometryNode *node;
+
+	// Where the material of the node is in the material table of the scene
+	unsigned int material_index;
+
+	// Combined transform from the root, and its inverse
+	glm::mat4 trans;
+	glm::mat4 invtrans;
+
+	// Box around the instance in world coordinates, if its primitive has
+	// bounds
+	bool bounded;
+	glm::vec3 lo, hi;
+};
+
+/**
+ * A flattened copy of a scene graph, holding every geometry node with the
+ * transform of the path to it. A node reached along several paths appears
+ * once for each, so an instance can be tested on its own without walking
+ * the graph from the root.
+ *
+ * Building a scene also fills in its material table. Intersections with
+ * instances carry the index of their material, and hits found by walking
+ * the graph look it up by node with materialIndex(), so the nodes are left
+ * as they were and can be shared by scenes being rendered at once.
+ */
+class Scene
+{
+  public:
+	Scene(SceneNode *root);
+
+	// Number of instances in the scene
+	size_t size() const;
+
+	const SceneInstance &instance(size_t index) const;
+
+	// The material with the index carried by an intersection
+	const SceneMaterial &material(unsigned int index) const
+	{
+		return m_materials[index];
+	}
+
+	// Number of materials in the table
+	size_t numMaterials() const;
+
+	// The index of the material of the geometry node with the given id
+	unsigned int materialIndex(unsigned int node_id) const
+	{
+		return node_id < m_nodeMaterials.size() ? m_nodeMaterials[node_id] : 0;
+	}
+
+	// Intersect 'ray' with a single instance, giving the intersection in
+	// world coordinates.
+	bool intersect(size_t index, const Ray &ray, Intersection &i) const;
+
+  private:
+	void flatten(SceneNode *node, const glm::mat4 &parent);
+	unsigned int addMaterial(const Material *material);
+
+	std::vector<SceneInstance> m_instances;
+	std::vector<SceneMaterial> m_materials;
+	std::unordered_map<const Material *, unsigned int> m_materialIndices;
+
+	// Material index of each geometry node, by node id
+	std::vector<unsigned int> m_nodeMaterials;
+};
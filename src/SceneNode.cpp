@@ -1,5 +1,6 @@
 #include "SceneNode.hpp"
 #include "MathHelper.hpp"
+#include "RenderCounters.hpp"
 #include "cs488-framework/MathUtils.hpp"
 
 #include <iostream>
@@ -128,6 +129,7 @@ bool SceneNode::intersect(Ray &ray, Intersection &i) const
 	{
 		Intersection inter;
 
+		rt_counters.node_visits++;
 		if (node->intersect(model_ray, inter))
 		{
 			// Get the intersection value
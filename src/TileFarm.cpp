@@ -0,0 +1,566 @@
+#include "TileFarm.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define FARM_MAGIC 0x4d524652 // 'RFRM' when read as bytes
+
+#define FARM_ACCEPT 0
+#define FARM_SKIP 1
+#define FARM_WAIT 2
+
+// Seconds a worker may take to answer before its tiles are given to others
+#define FARM_TIMEOUT 120
+
+// Seconds a new connection has to say hello before it is dropped
+#define FARM_HELLO_TIMEOUT 2
+
+// Times a worker tries to reach the coordinator, a tenth of a second apart,
+// before giving up on a render. Waiting for the coordinator to get to the
+// render does not count.
+#define FARM_CONNECT_ATTEMPTS 50
+
+// A coordinator's connection to one worker
+struct FarmConnection
+{
+	TileFarm *farm;
+	TileFarmSource *source;
+	int fd;
+	uint threads;
+};
+
+// Writes all of 'size' bytes, returning false if the other side has gone
+static bool farm_write_all(int fd, const void *data, size_t size)
+{
+	const char *bytes = static_cast<const char *>(data);
+	while (size > 0)
+	{
+		ssize_t written = send(fd, bytes, size, MSG_NOSIGNAL);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		bytes += written;
+		size -= written;
+	}
+	return true;
+}
+
+// Reads all of 'size' bytes, returning false on a timeout or if the other
+// side has gone
+static bool farm_read_all(int fd, void *data, size_t size)
+{
+	char *bytes = static_cast<char *>(data);
+	while (size > 0)
+	{
+		ssize_t count = recv(fd, bytes, size, 0);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return false;
+		bytes += count;
+		size -= count;
+	}
+	return true;
+}
+
+static bool farm_write_words(int fd, const uint *words, int count)
+{
+	std::vector<unsigned char> out(count * 4);
+	for (int i = 0; i < count; i++)
+	{
+		out[i * 4] = words[i] & 0xFF;
+		out[i * 4 + 1] = (words[i] >> 8) & 0xFF;
+		out[i * 4 + 2] = (words[i] >> 16) & 0xFF;
+		out[i * 4 + 3] = (words[i] >> 24) & 0xFF;
+	}
+	return farm_write_all(fd, &out[0], out.size());
+}
+
+static bool farm_read_words(int fd, uint *words, int count)
+{
+	std::vector<unsigned char> in(count * 4);
+	if (!farm_read_all(fd, &in[0], in.size()))
+	{
+		return false;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		words[i] = in[i * 4] | (in[i * 4 + 1] << 8) | (in[i * 4 + 2] << 16) | ((uint)in[i * 4 + 3] << 24);
+	}
+	return true;
+}
+
+// Gives up on reads and writes that take longer than 'seconds'
+static void farm_set_timeout(int fd, int seconds)
+{
+	struct timeval timeout;
+	timeout.tv_sec = seconds;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+//---------------------------------------------------------------------------------------
+TileFarm::TileFarm(bool coordinator, const std::string &host, int port)
+	: m_coordinator(coordinator),
+	  m_host(host),
+	  m_port(port),
+	  m_fd(-1),
+	  m_render(0),
+	  m_width(0), m_height(0),
+	  m_source(NULL),
+	  m_accepting(false),
+	  m_finished(false),
+	  m_workers(0)
+{
+	pthread_mutex_init(&m_lock, NULL);
+
+	if (!m_coordinator)
+	{
+		return;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (!host.empty() && inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+	{
+		std::cerr << "Could not listen for workers on " << host << ": not an IPv4 address" << std::endl;
+		return;
+	}
+
+	m_fd = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	if (m_fd >= 0)
+	{
+		setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	}
+	if (m_fd < 0 || bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(m_fd, 64) < 0)
+	{
+		std::cerr << "Could not listen for workers on " << (host.empty() ? "127.0.0.1" : host) << ":" << port << ": " << strerror(errno) << std::endl;
+		if (m_fd >= 0)
+		{
+			close(m_fd);
+		}
+		m_fd = -1;
+	}
+}
+
+//---------------------------------------------------------------------------------------
+TileFarm::~TileFarm()
+{
+	if (m_fd >= 0)
+	{
+		close(m_fd);
+	}
+	pthread_mutex_destroy(&m_lock);
+}
+
+//---------------------------------------------------------------------------------------
+bool TileFarm::isOpen() const
+{
+	return !m_coordinator || m_fd >= 0;
+}
+
+//---------------------------------------------------------------------------------------
+bool TileFarm::isCoordinator() const
+{
+	return m_coordinator;
+}
+
+//---------------------------------------------------------------------------------------
+void TileFarm::beginRender(uint width, uint height, TileFarmSource *source)
+{
+	m_render++;
+	m_width = width;
+	m_height = height;
+	m_source = source;
+	m_workers = 0;
+	m_accepting = true;
+
+	if (m_fd < 0)
+	{
+		return;
+	}
+
+	int ret = pthread_create(&m_acceptor, NULL, acceptWorkers, this);
+	if (ret)
+	{
+		std::cerr << "Application had to abort:  pthread_Create failed with error code: " << ret << std::endl;
+		exit(4);
+	}
+}
+
+//---------------------------------------------------------------------------------------
+int TileFarm::endRender()
+{
+	pthread_mutex_lock(&m_lock);
+	bool started = m_accepting && m_fd >= 0;
+	m_accepting = false;
+	pthread_mutex_unlock(&m_lock);
+
+	if (started)
+	{
+		pthread_join(m_acceptor, NULL);
+	}
+
+	// The connections end once there are no tiles left to hand out
+	for (pthread_t connection : m_connections)
+	{
+		pthread_join(connection, NULL);
+	}
+	m_connections.clear();
+	m_source = NULL;
+
+	return m_workers;
+}
+
+//---------------------------------------------------------------------------------------
+void TileFarm::finishRenders()
+{
+	m_source = NULL;
+	m_finished = true;
+	m_accepting = true;
+
+	if (m_fd < 0)
+	{
+		return;
+	}
+
+	int ret = pthread_create(&m_acceptor, NULL, acceptWorkers, this);
+	if (ret)
+	{
+		std::cerr << "Application had to abort:  pthread_Create failed with error code: " << ret << std::endl;
+		exit(4);
+	}
+}
+
+//---------------------------------------------------------------------------------------
+void *TileFarm::acceptWorkers(void *arg)
+{
+	TileFarm &farm = *static_cast<TileFarm *>(arg);
+
+	while (true)
+	{
+		pthread_mutex_lock(&farm.m_lock);
+		bool accepting = farm.m_accepting;
+		pthread_mutex_unlock(&farm.m_lock);
+		if (!accepting)
+		{
+			break;
+		}
+
+		// Look at the flag again every tenth of a second
+		struct pollfd listener;
+		listener.fd = farm.m_fd;
+		listener.events = POLLIN;
+		if (poll(&listener, 1, 100) <= 0)
+		{
+			continue;
+		}
+
+		int fd = accept(farm.m_fd, NULL, NULL);
+		if (fd < 0)
+		{
+			continue;
+		}
+
+		// The connection says hello on its own thread, so that one which
+		// never does cannot hold up the others
+		FarmConnection *connection = new FarmConnection;
+		connection->farm = &farm;
+		connection->source = farm.m_source;
+		connection->fd = fd;
+		connection->threads = 1;
+
+		pthread_t thread;
+		int ret = pthread_create(&thread, NULL, serveWorker, connection);
+		if (ret)
+		{
+			std::cerr << "Application had to abort:  pthread_Create failed with error code: " << ret << std::endl;
+			exit(4);
+		}
+		farm.m_connections.push_back(thread);
+	}
+
+	return NULL;
+}
+
+//---------------------------------------------------------------------------------------
+bool TileFarm::greetWorker(FarmConnection &connection)
+{
+	TileFarm &farm = *connection.farm;
+	int fd = connection.fd;
+	farm_set_timeout(fd, FARM_HELLO_TIMEOUT);
+
+	uint hello[5];
+	if (!farm_read_words(fd, hello, 5) || hello[0] != FARM_MAGIC)
+	{
+		return false;
+	}
+
+	// Workers are only wanted for the render in progress, which does not
+	// change while its connections are served
+	uint reply = FARM_ACCEPT;
+	if (farm.m_finished)
+	{
+		reply = FARM_SKIP;
+	}
+	else if (hello[1] > farm.m_render)
+	{
+		reply = FARM_WAIT;
+	}
+	else if (hello[1] < farm.m_render)
+	{
+		reply = FARM_SKIP;
+	}
+	else if (hello[2] != farm.m_width || hello[3] != farm.m_height)
+	{
+		std::cerr << "A worker is rendering a " << hello[2] << "x" << hello[3] << " image, not "
+				  << farm.m_width << "x" << farm.m_height << std::endl;
+		reply = FARM_SKIP;
+	}
+
+	if (!farm_write_words(fd, &reply, 1) || reply != FARM_ACCEPT)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&farm.m_lock);
+	farm.m_workers++;
+	pthread_mutex_unlock(&farm.m_lock);
+
+	connection.threads = std::max(hello[4], 1u);
+	farm_set_timeout(fd, FARM_TIMEOUT);
+	return true;
+}
+
+//---------------------------------------------------------------------------------------
+void *TileFarm::serveWorker(void *arg)
+{
+	FarmConnection *connection = static_cast<FarmConnection *>(arg);
+	int fd = connection->fd;
+
+	if (!greetWorker(*connection))
+	{
+		close(fd);
+		delete connection;
+		return NULL;
+	}
+	TileFarmSource &source = *connection->source;
+
+	std::vector<FarmTile> batch;
+	std::vector<float> pixels;
+	bool alive = true;
+
+	while (alive)
+	{
+		batch.clear();
+		FarmTile tile;
+		while (batch.size() < connection->threads && source.takeTile(tile))
+		{
+			batch.push_back(tile);
+		}
+
+		std::vector<uint> words;
+		words.push_back(batch.size());
+		for (const FarmTile &t : batch)
+		{
+			uint rect[5] = {t.tile, t.x, t.y, t.w, t.h};
+			words.insert(words.end(), rect, rect + 5);
+		}
+		alive = farm_write_words(fd, &words[0], words.size());
+
+		if (batch.empty())
+		{
+			break;
+		}
+
+		// The tiles come back in any order
+		size_t received = 0;
+		std::vector<char> done(batch.size(), 0);
+		while (alive && received < batch.size())
+		{
+			uint header[5];
+			alive = farm_read_words(fd, header, 5);
+
+			size_t index = 0;
+			while (alive && index < batch.size() && (batch[index].tile != header[0] || done[index]))
+			{
+				index++;
+			}
+			alive = alive && index < batch.size() && header[3] == batch[index].w && header[4] == batch[index].h;
+
+			if (alive)
+			{
+				pixels.resize(header[3] * header[4] * 3);
+				alive = farm_read_all(fd, &pixels[0], pixels.size() * sizeof(float));
+			}
+			if (alive)
+			{
+				source.tileReceived(batch[index], &pixels[0]);
+				done[index] = 1;
+				received++;
+			}
+		}
+
+		if (!alive)
+		{
+			std::cerr << "A worker stopped answering, its tiles will be rendered again" << std::endl;
+			for (size_t i = 0; i < batch.size(); i++)
+			{
+				if (!done[i])
+				{
+					source.tileLost(batch[i]);
+				}
+			}
+		}
+	}
+
+	close(fd);
+	delete connection;
+
+	return NULL;
+}
+
+//---------------------------------------------------------------------------------------
+bool TileFarm::joinRender(uint width, uint height, int threads)
+{
+	m_render++;
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo *address = NULL;
+	std::string port = std::to_string(m_port);
+	if (getaddrinfo(m_host.c_str(), port.c_str(), &hints, &address) != 0 || !address)
+	{
+		std::cerr << "Could not find the coordinator " << m_host << std::endl;
+		return false;
+	}
+
+	bool joined = false;
+	int attempts = 0;
+	while (!joined && attempts < FARM_CONNECT_ATTEMPTS)
+	{
+		m_fd = socket(AF_INET, SOCK_STREAM, 0);
+		uint reply = FARM_WAIT;
+		if (m_fd >= 0 && connect(m_fd, address->ai_addr, address->ai_addrlen) == 0)
+		{
+			farm_set_timeout(m_fd, FARM_TIMEOUT);
+			uint hello[5] = {FARM_MAGIC, m_render, width, height, (uint)threads};
+			if (!farm_write_words(m_fd, hello, 5) || !farm_read_words(m_fd, &reply, 1))
+			{
+				attempts++;
+			}
+		}
+		else
+		{
+			attempts++;
+		}
+
+		if (reply == FARM_ACCEPT)
+		{
+			joined = true;
+		}
+		else
+		{
+			if (m_fd >= 0)
+			{
+				close(m_fd);
+			}
+			m_fd = -1;
+
+			if (reply == FARM_SKIP)
+			{
+				break;
+			}
+			usleep(100 * 1000);
+		}
+	}
+
+	freeaddrinfo(address);
+	return joined;
+}
+
+//---------------------------------------------------------------------------------------
+bool TileFarm::nextBatch(std::vector<FarmTile> &batch)
+{
+	batch.clear();
+
+	uint count;
+	if (m_fd < 0 || !farm_read_words(m_fd, &count, 1))
+	{
+		return false;
+	}
+
+	for (uint i = 0; i < count; i++)
+	{
+		uint rect[5];
+		if (!farm_read_words(m_fd, rect, 5))
+		{
+			return false;
+		}
+
+		FarmTile tile;
+		tile.tile = rect[0];
+		tile.x = rect[1];
+		tile.y = rect[2];
+		tile.w = rect[3];
+		tile.h = rect[4];
+		batch.push_back(tile);
+	}
+
+	return !batch.empty();
+}
+
+//---------------------------------------------------------------------------------------
+bool TileFarm::sendTile(const FarmTile &tile, const Image &image)
+{
+	std::vector<float> pixels(tile.w * tile.h * 3);
+	float *out = &pixels[0];
+	for (uint j = tile.y; j < tile.y + tile.h; j++)
+	{
+		for (uint i = tile.x; i < tile.x + tile.w; i++)
+		{
+			*out++ = image(i, j, 0);
+			*out++ = image(i, j, 1);
+			*out++ = image(i, j, 2);
+		}
+	}
+
+	uint header[5] = {tile.tile, tile.x, tile.y, tile.w, tile.h};
+	return m_fd >= 0 && farm_write_words(m_fd, header, 5) &&
+		   farm_write_all(m_fd, &pixels[0], pixels.size() * sizeof(float));
+}
+
+//---------------------------------------------------------------------------------------
+void TileFarm::leaveRender()
+{
+	if (m_fd >= 0)
+	{
+		close(m_fd);
+	}
+	m_fd = -1;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "Image.hpp"
+
+// A tile handed to a worker, by its index and its rectangle in the image
+struct FarmTile
+{
+	uint tile;
+	uint x, y, w, h;
+};
+
+struct FarmConnection;
+
+// Where a coordinator's connections get tiles to hand out and give back
+// the tiles workers have rendered. Calls come from the connection threads,
+// so implementations must be safe to call concurrently.
+class TileFarmSource
+{
+  public:
+	virtual ~TileFarmSource() {}
+
+	// The next tile to render, or false when there are none left
+	virtual bool takeTile(FarmTile &tile) = 0;
+
+	// A tile rendered by a worker, as RGB floats in row order
+	virtual void tileReceived(const FarmTile &tile, const float *pixels) = 0;
+
+	// A tile given to a worker that went away, to be rendered again
+	virtual void tileLost(const FarmTile &tile) = 0;
+};
+
+/**
+ * Shares the tiles of renders between processes over TCP. The coordinator
+ * runs the scene script and writes the output, and hands batches of tiles
+ * to worker processes running the same script, which send back the pixels.
+ *
+ * Both sides count their renders, so the n-th gr.render of a worker helps
+ * with the n-th render of the coordinator. A worker that arrives after a
+ * render is over skips it, and one that arrives early waits for it.
+ *
+ * Each worker is given as many tiles at a time as it has threads, and asks
+ * for more as it finishes them, so faster workers take more of the image.
+ * Tiles held by a worker that disconnects or stops answering are rendered
+ * again by someone else.
+ *
+ * Messages are 32-bit little-endian words, and pixels are 32-bit floats in
+ * the byte order of the machines, which must match:
+ *
+ *     worker hello:   magic ('RFRM'), render, width, height, threads
+ *     reply:          FARM_ACCEPT, FARM_SKIP or FARM_WAIT
+ *     batch:          count, then tile, x, y, width, height for each tile;
+ *                     a count of 0 ends the render
+ *     tile:           tile, x, y, width, height, then the RGB pixels
+ */
+class TileFarm
+{
+  public:
+	// A coordinator listening on 'port' of the address 'host', or of the
+	// loopback address if 'host' is empty, or a worker connecting to the
+	// coordinator at 'host' and 'port'. The protocol has no authentication,
+	// so coordinators should only listen beyond this machine on trusted
+	// networks.
+	TileFarm(bool coordinator, const std::string &host, int port);
+	~TileFarm();
+
+	bool isOpen() const;
+	bool isCoordinator() const;
+
+	// Coordinator: accept workers for a render of the given size and hand
+	// them tiles from 'source' in the background, until endRender() is
+	// called once there are no tiles left. Returns the number of workers
+	// that took part.
+	void beginRender(uint width, uint height, TileFarmSource *source);
+	int endRender();
+
+	// Coordinator: once there are no more renders, turn away the workers
+	// still to join one, so that they skip the rest of their script instead
+	// of waiting on a render that will not come. This lasts until
+	// endRender() is called, after the workers have exited.
+	void finishRenders();
+
+	// Worker: join the coordinator's render of the given size, as a worker
+	// with 'threads' threads. Returns false if the render is not wanted.
+	bool joinRender(uint width, uint height, int threads);
+
+	// Worker: the next tiles to render, or false when the render is over.
+	bool nextBatch(std::vector<FarmTile> &batch);
+
+	// Worker: send the pixels of a rendered tile.
+	bool sendTile(const FarmTile &tile, const Image &image);
+
+	void leaveRender();
+
+  private:
+	static void *acceptWorkers(void *farm);
+	static void *serveWorker(void *connection);
+
+	// Read the hello of a new connection and answer it. Returns true if it
+	// is a worker joining the render in progress.
+	static bool greetWorker(FarmConnection &connection);
+
+	bool m_coordinator;
+	std::string m_host;
+	int m_port;
+
+	// Listening socket of a coordinator, or a worker's connection
+	int m_fd;
+
+	// Number of renders so far
+	uint m_render;
+
+	// The render being handed out by a coordinator
+	uint m_width, m_height;
+	TileFarmSource *m_source;
+	bool m_accepting;
+	bool m_finished;
+	pthread_t m_acceptor;
+	std::vector<pthread_t> m_connections;
+	int m_workers;
+	pthread_mutex_t m_lock;
+};
@@ -0,0 +1,253 @@
+#include "TileStream.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define TILE_STREAM_MAGIC 0x4c495452 // 'RTIL' when read as bytes
+
+// Writes all of 'size' bytes, returning false if the reader has gone away.
+// Sockets are written without raising SIGPIPE.
+static bool tile_write_all(int fd, bool socket, const void *data, size_t size)
+{
+	const char *bytes = static_cast<const char *>(data);
+	while (size > 0)
+	{
+		ssize_t written = socket ? send(fd, bytes, size, MSG_NOSIGNAL) : write(fd, bytes, size);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		bytes += written;
+		size -= written;
+	}
+	return true;
+}
+
+// Stores a 32-bit value in little-endian order
+static void tile_put_u32(unsigned char *out, uint value)
+{
+	out[0] = value & 0xFF;
+	out[1] = (value >> 8) & 0xFF;
+	out[2] = (value >> 16) & 0xFF;
+	out[3] = (value >> 24) & 0xFF;
+}
+
+//---------------------------------------------------------------------------------------
+TileStreamer::TileStreamer(const std::string &target, uint width, uint height)
+	: m_target(target),
+	  m_fd(-1),
+	  m_socket(false),
+	  m_savedStdout(-1),
+	  m_started(false),
+	  m_finished(false)
+{
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_hasRecord, NULL);
+
+	if (m_target == "-")
+	{
+		// Keep the real standard output for the stream and point the
+		// standard output descriptor at standard error, so that progress
+		// messages cannot end up in the middle of the binary data
+		std::cout << std::flush;
+		m_fd = dup(STDOUT_FILENO);
+		m_savedStdout = dup(STDOUT_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	}
+	else if (m_target.compare(0, 5, "unix:") == 0)
+	{
+		std::string path = m_target.substr(5);
+
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+		m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		m_socket = true;
+		if (m_fd >= 0 && connect(m_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		{
+			close(m_fd);
+			m_fd = -1;
+		}
+	}
+	else
+	{
+		// Opening a FIFO blocks until the reader is there
+		m_fd = open(m_target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+
+	if (m_fd < 0)
+	{
+		std::cerr << "Could not open tile stream " << m_target << ": " << strerror(errno) << std::endl;
+		return;
+	}
+
+	if (!writeRecord(TILE_STREAM_BEGIN, 0, 0, width, height, NULL))
+	{
+		std::cerr << "Tile stream " << m_target << " was closed by the reader" << std::endl;
+		return;
+	}
+
+	int ret = pthread_create(&m_thread, NULL, WriterThread_Run, this);
+	if (ret)
+	{
+		std::cerr << "Application had to abort:  pthread_Create failed with error code: " << ret << std::endl;
+		exit(4);
+	}
+	m_started = true;
+}
+
+//---------------------------------------------------------------------------------------
+TileStreamer::~TileStreamer()
+{
+	finish();
+	pthread_cond_destroy(&m_hasRecord);
+	pthread_mutex_destroy(&m_lock);
+}
+
+//---------------------------------------------------------------------------------------
+bool TileStreamer::isOpen() const
+{
+	return m_fd >= 0;
+}
+
+//---------------------------------------------------------------------------------------
+bool TileStreamer::writeRecord(uint type, uint x, uint y, uint w, uint h, const float *pixels)
+{
+	unsigned char header[24];
+	tile_put_u32(header, TILE_STREAM_MAGIC);
+	tile_put_u32(header + 4, type);
+	tile_put_u32(header + 8, x);
+	tile_put_u32(header + 12, y);
+	tile_put_u32(header + 16, w);
+	tile_put_u32(header + 20, h);
+
+	bool ok = tile_write_all(m_fd, m_socket, header, sizeof(header));
+	if (ok && pixels)
+	{
+		ok = tile_write_all(m_fd, m_socket, pixels, w * h * 3 * sizeof(float));
+	}
+
+	// Stop streaming once the reader has gone, the render carries on
+	if (!ok)
+	{
+		close(m_fd);
+		m_fd = -1;
+	}
+	return ok;
+}
+
+//---------------------------------------------------------------------------------------
+void TileStreamer::tileDone(const Image &image, uint x, uint y, uint w, uint h)
+{
+	if (!m_started)
+	{
+		return;
+	}
+
+	// Gather the tile into one block outside of the lock
+	Record record;
+	record.x = x;
+	record.y = y;
+	record.w = w;
+	record.h = h;
+	record.pixels.resize(w * h * 3);
+	float *out = &record.pixels[0];
+	for (uint j = y; j < y + h; j++)
+	{
+		for (uint i = x; i < x + w; i++)
+		{
+			*out++ = image(i, j, 0);
+			*out++ = image(i, j, 1);
+			*out++ = image(i, j, 2);
+		}
+	}
+
+	pthread_mutex_lock(&m_lock);
+	m_queue.push_back(std::move(record));
+	pthread_cond_signal(&m_hasRecord);
+	pthread_mutex_unlock(&m_lock);
+}
+
+//---------------------------------------------------------------------------------------
+void *TileStreamer::WriterThread_Run(void *streamer)
+{
+	static_cast<TileStreamer *>(streamer)->writeQueued();
+	return NULL;
+}
+
+//---------------------------------------------------------------------------------------
+void TileStreamer::writeQueued()
+{
+	while (true)
+	{
+		pthread_mutex_lock(&m_lock);
+		while (m_queue.empty() && !m_finished)
+		{
+			pthread_cond_wait(&m_hasRecord, &m_lock);
+		}
+		if (m_queue.empty())
+		{
+			pthread_mutex_unlock(&m_lock);
+			break;
+		}
+		Record record = std::move(m_queue.front());
+		m_queue.pop_front();
+		pthread_mutex_unlock(&m_lock);
+
+		// Only this thread writes to the target once it has started. Tiles
+		// that arrive after the reader has gone are dropped.
+		if (m_fd >= 0 && !writeRecord(TILE_STREAM_TILE, record.x, record.y, record.w, record.h, &record.pixels[0]))
+		{
+			std::cerr << "Tile stream " << m_target << " was closed by the reader" << std::endl;
+		}
+	}
+}
+
+//---------------------------------------------------------------------------------------
+void TileStreamer::finish()
+{
+	if (m_started)
+	{
+		pthread_mutex_lock(&m_lock);
+		m_finished = true;
+		pthread_cond_signal(&m_hasRecord);
+		pthread_mutex_unlock(&m_lock);
+
+		pthread_join(m_thread, NULL);
+		m_started = false;
+	}
+
+	pthread_mutex_lock(&m_lock);
+	if (m_fd >= 0)
+	{
+		writeRecord(TILE_STREAM_END, 0, 0, 0, 0, NULL);
+		if (m_fd >= 0)
+		{
+			close(m_fd);
+		}
+		m_fd = -1;
+	}
+
+	// Give standard output back
+	if (m_savedStdout >= 0)
+	{
+		std::cout << std::flush;
+		dup2(m_savedStdout, STDOUT_FILENO);
+		close(m_savedStdout);
+		m_savedStdout = -1;
+	}
+	pthread_mutex_unlock(&m_lock);
+}
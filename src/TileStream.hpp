@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+#include "Image.hpp"
+#include "RenderListener.hpp"
+
+// Record types in a tile stream
+#define TILE_STREAM_BEGIN 0
+#define TILE_STREAM_TILE 1
+#define TILE_STREAM_END 2
+
+/**
+ * Sends tiles to another process as soon as they are rendered.
+ *
+ * The stream is a sequence of records, each starting with six 32-bit
+ * little-endian words:
+ *
+ *     magic ('RTIL'), type, x, y, width, height
+ *
+ * A render begins with a TILE_STREAM_BEGIN record giving the size of the
+ * whole image, then has a TILE_STREAM_TILE record for every tile, followed
+ * by width * height RGB triples of 32-bit floats in row order, and ends
+ * with a TILE_STREAM_END record. Colours are not clamped.
+ *
+ * The target may be "-" for standard output, "unix:<path>" to connect to a
+ * Unix domain socket, or the path of a FIFO or file. While streaming to
+ * standard output, any text written to it is sent to standard error instead.
+ *
+ * Tiles are written by a thread of the streamer's own, so a slow reader does
+ * not hold up the render threads. Tiles waiting for it queue up in memory.
+ * Writing to a FIFO or standard output after the reader has gone raises
+ * SIGPIPE, which the program must ignore for the stream to end quietly.
+ */
+class TileStreamer : public RenderListener
+{
+  public:
+	TileStreamer(const std::string &target, uint width, uint height);
+	virtual ~TileStreamer();
+
+	// Whether the target could be opened
+	bool isOpen() const;
+
+	virtual void tileDone(const Image &image, uint x, uint y, uint w, uint h);
+
+	// Wait for the queued tiles to be written, send the end of the frame
+	// and close the target.
+	void finish();
+
+  private:
+	struct Record
+	{
+		uint x, y, w, h;
+		std::vector<float> pixels;
+	};
+
+	static void *WriterThread_Run(void *streamer);
+	void writeQueued();
+	bool writeRecord(uint type, uint x, uint y, uint w, uint h, const float *pixels);
+
+	std::string m_target;
+	int m_fd;
+	bool m_socket;
+
+	// Where standard output was moved to while it carries the stream
+	int m_savedStdout;
+
+	// Tiles waiting to be written, guarded by m_lock
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_hasRecord;
+	std::deque<Record> m_queue;
+
+	pthread_t m_thread;
+	bool m_started;
+	bool m_finished;
+};
@@ -0,0 +1,277 @@
+#include "ToneMap.hpp"
+#include "Image.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Number of samples of the transfer curve over [0, 1]
+#define TONEMAP_CURVE_SIZE 4096
+
+// Coefficients of the filmic curve (Narkowicz's fit to the ACES tone curve)
+#define FILMIC_A 2.51f
+#define FILMIC_B 0.03f
+#define FILMIC_C 2.43f
+#define FILMIC_D 0.59f
+#define FILMIC_E 0.14f
+
+static const int BAYER_4X4[4][4] = {
+	{0, 8, 2, 10},
+	{12, 4, 14, 6},
+	{3, 11, 1, 9},
+	{15, 7, 13, 5}};
+
+// Exposure and tone operator for a single component, the result is in
+// [0, 1]. The clamps send NaN to 0 before the operator and to 1 after it,
+// as _mm_max_ps and _mm_min_ps do in the SSE2 path.
+static inline float tonemap_operator(float x, float scale, ToneOperator op)
+{
+	x *= scale;
+	x = !(x > 0.0f) ? 0.0f : x;
+
+	switch (op)
+	{
+	case ToneOperator::Reinhard:
+		x = x / (1.0f + x);
+		break;
+	case ToneOperator::Filmic:
+		x = (x * (FILMIC_A * x + FILMIC_B)) / (x * (FILMIC_C * x + FILMIC_D) + FILMIC_E);
+		break;
+	default:
+		break;
+	}
+
+	return !(x < 1.0f) ? 1.0f : x;
+}
+
+//---------------------------------------------------------------------------------------
+ToneMapper::ToneMapper(const ToneMapSettings &settings)
+	: m_settings(settings),
+	  m_scale(pow(2.0, settings.exposure)),
+	  m_linear(!settings.srgb && settings.gamma == 1.0)
+{
+	if (m_settings.bit_depth != 16)
+	{
+		m_settings.bit_depth = 8;
+	}
+
+	// Sample the transfer curve once, so the per-pixel cost is a lookup
+	if (!m_linear)
+	{
+		m_curve.resize(TONEMAP_CURVE_SIZE + 1);
+		for (int i = 0; i <= TONEMAP_CURVE_SIZE; i++)
+		{
+			double v = (double)i / TONEMAP_CURVE_SIZE;
+			if (m_settings.srgb)
+			{
+				v = (v <= 0.0031308) ? 12.92 * v : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+			}
+			else
+			{
+				v = pow(v, 1.0 / m_settings.gamma);
+			}
+			m_curve[i] = v;
+		}
+	}
+
+	// Thresholds of an ordered dither, repeated for each component of a pixel
+	for (int y = 0; y < 4; y++)
+	{
+		for (int i = 0; i < 12; i++)
+		{
+			m_dither[y][i] = m_settings.dither ? (BAYER_4X4[y][i / 3] + 0.5f) / 16.0f : 0.0f;
+		}
+	}
+}
+
+//---------------------------------------------------------------------------------------
+uint ToneMapper::bytesPerPixel() const
+{
+	return 3 * (m_settings.bit_depth / 8);
+}
+
+//---------------------------------------------------------------------------------------
+int ToneMapper::bitDepth() const
+{
+	return m_settings.bit_depth;
+}
+
+//---------------------------------------------------------------------------------------
+void ToneMapper::mapRow(const double *src, uint width, uint y, float *scratch, unsigned char *out) const
+{
+	size_t n = width * 3;
+	size_t i = 0;
+	ToneOperator op = m_settings.op;
+
+	// Exposure and tone operator
+#if defined(__SSE2__)
+	const __m128 scale = _mm_set1_ps(m_scale);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(src + i));
+		__m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2));
+		__m128 x = _mm_max_ps(_mm_mul_ps(_mm_movelh_ps(lo, hi), scale), zero);
+
+		if (op == ToneOperator::Reinhard)
+		{
+			x = _mm_div_ps(x, _mm_add_ps(one, x));
+		}
+		else if (op == ToneOperator::Filmic)
+		{
+			__m128 num = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(FILMIC_A), x), _mm_set1_ps(FILMIC_B)));
+			__m128 den = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(FILMIC_C), x), _mm_set1_ps(FILMIC_D))), _mm_set1_ps(FILMIC_E));
+			x = _mm_div_ps(num, den);
+		}
+
+		_mm_storeu_ps(scratch + i, _mm_min_ps(x, one));
+	}
+#endif
+	for (; i < n; i++)
+	{
+		scratch[i] = tonemap_operator(src[i], m_scale, op);
+	}
+
+	// Transfer curve, interpolated from the samples
+	if (!m_linear)
+	{
+		for (i = 0; i < n; i++)
+		{
+			float pos = scratch[i] * TONEMAP_CURVE_SIZE;
+			int index = std::min((int)pos, TONEMAP_CURVE_SIZE - 1);
+			float t = pos - index;
+			scratch[i] = m_curve[index] + t * (m_curve[index + 1] - m_curve[index]);
+		}
+	}
+
+	// Dither and quantize. The values are never negative, so truncation
+	// is the same as taking the floor.
+	const float *dither = m_dither[y & 3];
+	const int max_value = (1 << m_settings.bit_depth) - 1;
+	bool wide = m_settings.bit_depth == 16;
+	i = 0;
+
+#if defined(__SSE2__)
+	const __m128 levels = _mm_set1_ps((float)max_value);
+	const __m128i max_int = _mm_set1_epi32(max_value);
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(scratch + i), levels), _mm_loadu_ps(dither + i % 12));
+		__m128i q = _mm_cvttps_epi32(v);
+
+		// Clamp to the largest value (there is no SSE2 min for 32-bit ints)
+		__m128i over = _mm_cmpgt_epi32(q, max_int);
+		q = _mm_or_si128(_mm_andnot_si128(over, q), _mm_and_si128(over, max_int));
+
+		if (wide)
+		{
+			int values[4];
+			_mm_storeu_si128((__m128i *)values, q);
+			for (int k = 0; k < 4; k++)
+			{
+				out[2 * (i + k)] = values[k] >> 8;
+				out[2 * (i + k) + 1] = values[k] & 0xFF;
+			}
+		}
+		else
+		{
+			__m128i packed = _mm_packus_epi16(_mm_packs_epi32(q, q), _mm_setzero_si128());
+			int bytes = _mm_cvtsi128_si32(packed);
+			memcpy(out + i, &bytes, 4);
+		}
+	}
+#endif
+	for (; i < n; i++)
+	{
+		int q = std::min((int)(scratch[i] * max_value + dither[i % 12]), max_value);
+		if (wide)
+		{
+			out[2 * i] = q >> 8;
+			out[2 * i + 1] = q & 0xFF;
+		}
+		else
+		{
+			out[i] = q;
+		}
+	}
+}
+
+//---------------------------------------------------------------------------------------
+void ToneMapper::mapRows(const Image &image, uint y, uint count, unsigned char *out) const
+{
+	uint width = image.width();
+	std::vector<float> scratch(width * 3);
+	size_t stride = width * bytesPerPixel();
+
+	for (uint row = y; row < y + count; row++)
+	{
+		mapRow(image.data() + row * width * 3, width, row, &scratch[0], out);
+		out += stride;
+	}
+}
+
+// A block of rows mapped on its own thread by ToneMapper::mapImage
+struct ToneMapJob
+{
+	const ToneMapper *mapper;
+	const Image *image;
+	unsigned char *out;
+	uint y0, y1;
+};
+
+static void *ToneMapJob_Run(void *job_args)
+{
+	ToneMapJob &job = *static_cast<ToneMapJob *>(job_args);
+	job.mapper->mapRows(*job.image, job.y0, job.y1 - job.y0, job.out);
+	return NULL;
+}
+
+//---------------------------------------------------------------------------------------
+void ToneMapper::mapImage(const Image &image, unsigned char *out, int num_threads) const
+{
+	uint height = image.height();
+	size_t stride = image.width() * bytesPerPixel();
+	int num_jobs = std::max(1, std::min<int>(num_threads, height));
+
+	std::vector<ToneMapJob> jobs(num_jobs);
+	std::vector<pthread_t> threads(num_jobs);
+	std::vector<bool> started(num_jobs, false);
+
+	for (int i = 0; i < num_jobs; i++)
+	{
+		ToneMapJob &job = jobs[i];
+		job.mapper = this;
+		job.image = &image;
+		job.y0 = (uint)((unsigned long)height * i / num_jobs);
+		job.y1 = (uint)((unsigned long)height * (i + 1) / num_jobs);
+		job.out = out + job.y0 * stride;
+	}
+
+	// The first block is mapped on this thread while the rest run
+	for (int i = 1; i < num_jobs; i++)
+	{
+		started[i] = pthread_create(&threads[i], NULL, ToneMapJob_Run, &jobs[i]) == 0;
+		if (!started[i])
+		{
+			ToneMapJob_Run(&jobs[i]);
+		}
+	}
+	ToneMapJob_Run(&jobs[0]);
+
+	for (int i = 1; i < num_jobs; i++)
+	{
+		if (started[i])
+		{
+			pthread_join(threads[i], NULL);
+		}
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+
+typedef unsigned int uint;
+
+class Image;
+
+// How high dynamic range colours are brought into [0, 1]
+enum class ToneOperator
+{
+	Clamp,
+	Reinhard,
+	Filmic
+};
+
+// Settings for converting the rendered image to integer pixels
+struct ToneMapSettings
+{
+	// Exposure adjustment in stops, applied before the tone operator
+	double exposure;
+	ToneOperator op;
+
+	// Encode with the sRGB curve, otherwise with a power of 1 / gamma
+	bool srgb;
+	double gamma;
+
+	// Add ordered dither before quantizing, to break up banding
+	bool dither;
+
+	// Bits per component of the output, 8 or 16
+	int bit_depth;
+
+	// The defaults reproduce a plain clamp and truncation to 8 bits
+	ToneMapSettings()
+		: exposure(0.0), op(ToneOperator::Clamp),
+		  srgb(false), gamma(1.0),
+		  dither(false), bit_depth(8) {}
+};
+
+/**
+ * Converts rows of an image to packed integer RGB as a single pass of
+ * exposure, tone operator, transfer curve, clamp, dither and quantization.
+ *
+ * The arithmetic is done four components at a time with SSE2 when it is
+ * available, and whole images are split over several threads, so the pass
+ * is limited by memory bandwidth rather than by the maths.
+ *
+ * 16-bit output is written most significant byte first, as PNG expects.
+ */
+class ToneMapper
+{
+  public:
+	ToneMapper(const ToneMapSettings &settings);
+
+	// Bytes used by each pixel of the output
+	uint bytesPerPixel() const;
+	int bitDepth() const;
+
+	// Map 'count' rows of 'image' starting at row 'y' into 'out'.
+	void mapRows(const Image &image, uint y, uint count, unsigned char *out) const;
+
+	// Map all of 'image' into 'out', using 'num_threads' threads.
+	void mapImage(const Image &image, unsigned char *out, int num_threads) const;
+
+  private:
+	void mapRow(const double *src, uint width, uint y, float *scratch, unsigned char *out) const;
+
+	ToneMapSettings m_settings;
+
+	// Linear scale from the exposure
+	float m_scale;
+
+	// Transfer curve sampled over [0, 1], unused when it is linear
+	bool m_linear;
+	std::vector<float> m_curve;
+
+	// Dither thresholds for each row of a 4x4 pattern, laid out per component
+	float m_dither[4][12];
+};
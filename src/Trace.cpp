@@ -0,0 +1,129 @@
+#include "Trace.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <chrono>
+
+#include <pthread.h>
+#include <unistd.h>
+
+std::atomic<bool> trace_enabled(false);
+
+struct TraceEvent
+{
+	const char *name;
+	double start;
+	double end;
+};
+
+// The events of one thread. Only the thread adds to it, but the lock keeps
+// the trace from being written while it does.
+struct TraceBuffer
+{
+	int tid;
+	pthread_mutex_t lock;
+	std::vector<TraceEvent> events;
+};
+
+// Every thread that has recorded a span, in the order they first did. The
+// buffers last as long as the process, as their threads might still be
+// running when the trace is written.
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TraceBuffer *> trace_buffers;
+static std::string trace_filename;
+static std::chrono::steady_clock::time_point trace_origin;
+
+static thread_local TraceBuffer *trace_buffer = NULL;
+
+//---------------------------------------------------------------------------------------
+void trace_start(const std::string &filename)
+{
+	pthread_mutex_lock(&trace_lock);
+	trace_filename = filename;
+	trace_origin = std::chrono::steady_clock::now();
+	pthread_mutex_unlock(&trace_lock);
+
+	trace_enabled.store(true);
+}
+
+//---------------------------------------------------------------------------------------
+double trace_now()
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - trace_origin).count();
+}
+
+//---------------------------------------------------------------------------------------
+void trace_record(const char *name, double start, double end)
+{
+	if (!trace_buffer)
+	{
+		TraceBuffer *buffer = new TraceBuffer();
+		pthread_mutex_init(&buffer->lock, NULL);
+
+		pthread_mutex_lock(&trace_lock);
+		buffer->tid = trace_buffers.size() + 1;
+		trace_buffers.push_back(buffer);
+		pthread_mutex_unlock(&trace_lock);
+
+		trace_buffer = buffer;
+	}
+
+	TraceEvent event;
+	event.name = name;
+	event.start = start;
+	event.end = end;
+
+	pthread_mutex_lock(&trace_buffer->lock);
+	trace_buffer->events.push_back(event);
+	pthread_mutex_unlock(&trace_buffer->lock);
+}
+
+//---------------------------------------------------------------------------------------
+bool trace_finish()
+{
+	if (!trace_enabled.exchange(false))
+	{
+		return true;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+
+	std::ofstream out(trace_filename);
+	if (!out)
+	{
+		std::cerr << "could not write trace " << trace_filename << std::endl;
+		pthread_mutex_unlock(&trace_lock);
+		return false;
+	}
+
+	// Complete events, with a name for the timeline of each thread. Span
+	// names are string literals, so they need no escaping.
+	int pid = getpid();
+	out.setf(std::ios::fixed);
+	out.precision(3);
+	bool first = true;
+	out << "{\"traceEvents\": [" << std::endl;
+	for (TraceBuffer *buffer : trace_buffers)
+	{
+		out << (first ? "" : ",\n")
+			<< "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"tid\": " << buffer->tid
+			<< ", \"args\": {\"name\": \"thread " << buffer->tid << "\"}}";
+		first = false;
+
+		pthread_mutex_lock(&buffer->lock);
+		for (const TraceEvent &event : buffer->events)
+		{
+			out << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": " << pid
+				<< ", \"tid\": " << buffer->tid << ", \"ts\": " << event.start
+				<< ", \"dur\": " << event.end - event.start << "}";
+		}
+		buffer->events.clear();
+		pthread_mutex_unlock(&buffer->lock);
+	}
+	out << "\n], \"displayTimeUnit\": \"ms\"}" << std::endl;
+
+	pthread_mutex_unlock(&trace_lock);
+
+	return out.good();
+}
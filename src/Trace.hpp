@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+
+/**
+ * A timeline of what each thread was doing, written as a trace_event JSON
+ * file that chrome://tracing and Perfetto can show. Code marks the spans
+ * worth seeing with TRACE_SCOPE, and each span is recorded when it ends as
+ * a complete event on the timeline of its thread.
+ *
+ * Nothing is recorded until trace_start() is called. Until then a span is a
+ * relaxed load of a flag, and building with RT_NO_TRACING removes them.
+ * Each thread keeps its events to itself, so recording takes no lock that
+ * another thread holds, other than while the trace is being written.
+ */
+
+// Start recording spans, to be written to 'filename' by trace_finish()
+void trace_start(const std::string &filename);
+
+// Stop recording and write the spans out. Returns false if the file could
+// not be written, and true if it was or nothing was being traced.
+bool trace_finish();
+
+// Set while spans are being recorded
+extern std::atomic<bool> trace_enabled;
+
+// Microseconds since the trace started
+double trace_now();
+
+// Record a span of the calling thread. 'name' must outlive the trace.
+void trace_record(const char *name, double start, double end);
+
+// Records a span from its construction to the end of its scope
+class TraceScope
+{
+  public:
+	explicit TraceScope(const char *name)
+		: m_name(NULL), m_start(0.0)
+	{
+		if (trace_enabled.load(std::memory_order_relaxed))
+		{
+			m_name = name;
+			m_start = trace_now();
+		}
+	}
+
+	~TraceScope()
+	{
+		if (m_name)
+		{
+			trace_record(m_name, m_start, trace_now());
+		}
+	}
+
+  private:
+	TraceScope(const TraceScope &);
+	TraceScope &operator=(const TraceScope &);
+
+	const char *m_name;
+	double m_start;
+};
+
+#define TRACE_JOIN_NAME(a, b) a##b
+#define TRACE_SCOPE_NAME(a, b) TRACE_JOIN_NAME(a, b)
+
+// Trace the rest of the enclosing scope as a span called 'name', which
+// must be a string literal
+#ifdef RT_NO_TRACING
+#define TRACE_SCOPE(name)
+#else
+#define TRACE_SCOPE(name) TraceScope TRACE_SCOPE_NAME(trace_scope_, __LINE__)(name)
+#endif
@@ -0,0 +1,121 @@
+#include "WorkerPool.hpp"
+#include "Raytracer.hpp"
+
+#include <iostream>
+#include <cstdlib>
+
+//---------------------------------------------------------------------------------------
+WorkerPool::WorkerPool(int num_threads)
+	: m_next(0), m_running(0), m_stopping(false)
+{
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_hasWork, NULL);
+	pthread_cond_init(&m_idle, NULL);
+
+	m_threads.resize(num_threads);
+	for (int i = 0; i < num_threads; i++)
+	{
+		int ret = pthread_create(&m_threads[i], NULL, run, this);
+		if (ret)
+		{
+			std::cerr << "Application had to abort:  pthread_Create failed with error code: " << ret << std::endl;
+			exit(4);
+		}
+	}
+}
+
+//---------------------------------------------------------------------------------------
+WorkerPool::~WorkerPool()
+{
+	pthread_mutex_lock(&m_lock);
+	m_stopping = true;
+	pthread_cond_broadcast(&m_hasWork);
+	pthread_mutex_unlock(&m_lock);
+
+	for (pthread_t thread : m_threads)
+	{
+		pthread_join(thread, NULL);
+	}
+
+	pthread_cond_destroy(&m_idle);
+	pthread_cond_destroy(&m_hasWork);
+	pthread_mutex_destroy(&m_lock);
+}
+
+//---------------------------------------------------------------------------------------
+int WorkerPool::size() const
+{
+	return m_threads.size();
+}
+
+//---------------------------------------------------------------------------------------
+void WorkerPool::start(Task task, void **args, int count)
+{
+	pthread_mutex_lock(&m_lock);
+	for (int i = 0; i < count; i++)
+	{
+		Job job;
+		job.task = task;
+		job.arg = args[i];
+		m_jobs.push_back(job);
+	}
+	pthread_cond_broadcast(&m_hasWork);
+	pthread_mutex_unlock(&m_lock);
+}
+
+//---------------------------------------------------------------------------------------
+void WorkerPool::wait()
+{
+	pthread_mutex_lock(&m_lock);
+	while (m_running > 0 || m_next < m_jobs.size())
+	{
+		pthread_cond_wait(&m_idle, &m_lock);
+	}
+
+	// Everything has been run, so the list can start again
+	m_jobs.clear();
+	m_next = 0;
+	pthread_mutex_unlock(&m_lock);
+}
+
+//---------------------------------------------------------------------------------------
+WorkerPool &WorkerPool::shared()
+{
+	static WorkerPool pool(RT_NUM_THREADS);
+	return pool;
+}
+
+//---------------------------------------------------------------------------------------
+void *WorkerPool::run(void *arg)
+{
+	WorkerPool &pool = *static_cast<WorkerPool *>(arg);
+
+	pthread_mutex_lock(&pool.m_lock);
+	while (true)
+	{
+		while (!pool.m_stopping && pool.m_next >= pool.m_jobs.size())
+		{
+			pthread_cond_wait(&pool.m_hasWork, &pool.m_lock);
+		}
+		if (pool.m_stopping)
+		{
+			break;
+		}
+
+		Job job = pool.m_jobs[pool.m_next++];
+		pool.m_running++;
+		pthread_mutex_unlock(&pool.m_lock);
+
+		job.task(job.arg);
+
+		pthread_mutex_lock(&pool.m_lock);
+		pool.m_running--;
+		if (pool.m_running == 0 && pool.m_next >= pool.m_jobs.size())
+		{
+			pthread_cond_broadcast(&pool.m_idle);
+		}
+	}
+	pthread_mutex_unlock(&pool.m_lock);
+
+	return NULL;
+}
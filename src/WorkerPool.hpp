@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+
+#include <pthread.h>
+
+/**
+ * A fixed set of threads that run tasks handed to them, so that renders do
+ * not start and stop threads of their own for every pass. A process that
+ * renders many images, such as the render server, keeps the same threads
+ * for all of them.
+ *
+ * Tasks have the signature of a pthread start routine, and their return
+ * value is ignored.
+ */
+class WorkerPool
+{
+  public:
+	typedef void *(*Task)(void *);
+
+	WorkerPool(int num_threads);
+	~WorkerPool();
+
+	int size() const;
+
+	// Run 'task' on each of the 'count' arguments, returning at once. The
+	// tasks are taken by the threads in order as they become free.
+	void start(Task task, void **args, int count);
+
+	// Wait until every task that has been started has returned.
+	void wait();
+
+	// The pool of RT_NUM_THREADS threads the renderer uses, started on
+	// first use
+	static WorkerPool &shared();
+
+  private:
+	struct Job
+	{
+		Task task;
+		void *arg;
+	};
+
+	static void *run(void *pool);
+
+	std::vector<pthread_t> m_threads;
+	std::vector<Job> m_jobs;
+	size_t m_next;
+
+	// Jobs handed out but not finished yet
+	int m_running;
+	bool m_stopping;
+
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_hasWork;
+	pthread_cond_t m_idle;
+};
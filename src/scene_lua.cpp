@@ -44,7 +44,7 @@
 #include <vector>
 #include <map>
 
-#include "luRaytracer88.hpp"
+#include "lua488.hpp"
 
 #include "Light.hpp"
 #include "Mesh.hpp"
@@ -54,10 +54,28 @@
 #include "Material.hpp"
 #include "PhongMaterial.hpp"
 #include "Raytracer.hpp"
+#include "PngWriter.hpp"
+#include "TileStream.hpp"
+#include "TileFarm.hpp"
+#include "CostMap.hpp"
+#include "Trace.hpp"
 
 typedef std::map<std::string, Mesh *> MeshMap;
 static MeshMap mesh_map;
 
+// What renders with relighting turned on have captured. Any command that
+// changes the scene graph throws it away.
+static RelightCache relight_cache;
+
+// The last render with incremental rendering turned on, which is kept
+// across scene edits so that the next one can trace only what they changed
+static IncrementalCache incremental_cache;
+
+// The primary hits of the last deferred render, which a later one of the
+// same view shades from. Any command that changes the scene graph throws
+// it away.
+static GBuffer gbuffer_cache;
+
 // Uncomment the following line to enable debugging messages
 // #define GRLUA_ENABLE_DEBUG
 
@@ -131,6 +149,109 @@ void get_tuple(lua_State *L, int arg, T *data, int n)
   }
 }
 
+// Time budget for renders that do not give one, from the command line
+static double default_time_budget = 0.0;
+
+void set_default_time_budget(double seconds)
+{
+  default_time_budget = seconds;
+}
+
+// Seconds between checkpoints of renders that do not say, from the command
+// line, or 0 for none
+static double default_checkpoint_interval = 0.0;
+
+void set_checkpoint_interval(double seconds)
+{
+  default_checkpoint_interval = seconds;
+}
+
+// File the statistics of every render are appended to, from the command
+// line, or empty for none
+static std::string default_stats_file;
+
+void set_stats_file(const std::string &filename)
+{
+  default_stats_file = filename;
+}
+
+// Other processes the renders are shared with, if any
+static TileFarm *tile_farm = NULL;
+
+void set_tile_farm(TileFarm *farm)
+{
+  tile_farm = farm;
+}
+
+// Useful functions to retrieve an optional named value from a table of
+// options. If the table or the key is missing, the default is returned.
+static double get_opt_number(lua_State *L, int arg, const char *key, double def)
+{
+  if (lua_isnoneornil(L, arg))
+  {
+    return def;
+  }
+
+  luaL_checktype(L, arg, LUA_TTABLE);
+  lua_getfield(L, arg, key);
+  double value = lua_isnil(L, -1) ? def : luaL_checknumber(L, -1);
+  lua_pop(L, 1);
+
+  return value;
+}
+
+static bool get_opt_bool(lua_State *L, int arg, const char *key, bool def)
+{
+  if (lua_isnoneornil(L, arg))
+  {
+    return def;
+  }
+
+  luaL_checktype(L, arg, LUA_TTABLE);
+  lua_getfield(L, arg, key);
+  bool value = lua_isnil(L, -1) ? def : lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  return value;
+}
+
+static std::string get_opt_string(lua_State *L, int arg, const char *key, const std::string &def)
+{
+  if (lua_isnoneornil(L, arg))
+  {
+    return def;
+  }
+
+  luaL_checktype(L, arg, LUA_TTABLE);
+  lua_getfield(L, arg, key);
+  std::string value = lua_isnil(L, -1) ? def : luaL_checkstring(L, -1);
+  lua_pop(L, 1);
+
+  return value;
+}
+
+// Retrieves an optional n-tuple from a table of options, returning false
+// if it is not there
+template <typename T>
+static bool get_opt_tuple(lua_State *L, int arg, const char *key, T *data, int n)
+{
+  if (lua_isnoneornil(L, arg))
+  {
+    return false;
+  }
+
+  luaL_checktype(L, arg, LUA_TTABLE);
+  lua_getfield(L, arg, key);
+  bool present = !lua_isnil(L, -1);
+  if (present)
+  {
+    get_tuple(L, lua_gettop(L), data, n);
+  }
+  lua_pop(L, 1);
+
+  return present;
+}
+
 // Create a node
 extern "C" int gr_node_cmd(lua_State *L)
 {
@@ -275,6 +396,7 @@ extern "C" int gr_mesh_cmd(lua_State *L)
   if (i == mesh_map.end())
   {
     mesh = new Mesh(obj_fname);
+    mesh_map[sfname] = mesh;
   }
   else
   {
@@ -314,15 +436,139 @@ extern "C" int gr_light_cmd(lua_State *L)
   return 1;
 }
 
-// Render a scene
-extern "C" int gr_render_cmd(lua_State *L)
+// What is left to do for the output of a render once its image is done
+struct FrameOutput
 {
-  GRLUA_DEBUG_CALL;
+  std::string filename;
+  std::string format;
+  Image *image;
+
+  // Listeners that were following the render
+  TileStreamer *tiles;
+  PngPreviewWriter *previews;
+  PngStreamer *png;
+
+  // Where a crop window goes in the existing output, if it is merged
+  bool crop_merge;
+  int crop_x, crop_y;
+
+  int compression;
+  ToneMapSettings tonemap;
 
+  // Removed once the output is written, or NULL
+  RenderCheckpoint *checkpoint;
+
+  // Where the time of the render went, written as heat maps named with the
+  // prefix, or NULL
+  CostMap *costs;
+  std::string costs_prefix;
+};
+
+// Finish writing a frame and free everything it used. Returns whether the
+// output was written.
+static bool finish_frame(FrameOutput *out)
+{
+  if (out->tiles)
+  {
+    out->tiles->finish();
+    delete out->tiles;
+  }
+
+  delete out->previews;
+
+  const Image &im = *out->image;
+  const std::string &filename = out->filename;
+  bool saved;
+  if (out->png)
+  {
+    saved = out->png->finish();
+    delete out->png;
+  }
+  else if (out->crop_merge && out->format == "pfm")
+  {
+    saved = im.mergePfm(filename, out->crop_x, out->crop_y);
+  }
+  else if (out->crop_merge)
+  {
+    saved = im.mergePng(filename, out->crop_x, out->crop_y, out->compression, RT_NUM_THREADS, out->tonemap);
+  }
+  else if (out->format == "pfm")
+  {
+    // Raw floating-point output, without any clamping or quantization
+    saved = im.savePfm(filename);
+  }
+  else
+  {
+    saved = im.savePng(filename, out->compression, RT_NUM_THREADS, out->tonemap);
+  }
+
+  // The checkpoint is no longer needed once the output is safely written
+  if (saved && out->checkpoint)
+  {
+    out->checkpoint->finish();
+  }
+
+  if (out->costs && !out->costs->save(out->costs_prefix))
+  {
+    std::cerr << "Could not write the cost map " << out->costs_prefix << std::endl;
+  }
+
+  delete out->checkpoint;
+  delete out->costs;
+  delete out->image;
+  delete out;
+  return saved;
+}
+
+// The outputs of the cameras of a render
+typedef std::vector<FrameOutput *> FrameOutputs;
+
+static void finish_frames(FrameOutputs *outputs)
+{
+  for (FrameOutput *out : *outputs)
+  {
+    finish_frame(out);
+  }
+  delete outputs;
+}
+
+static void *finish_frames_thread(void *outputs)
+{
+  finish_frames(static_cast<FrameOutputs *>(outputs));
+  return NULL;
+}
+
+// A camera of a render, and where its image goes
+struct CameraOutput
+{
+  std::string output;
+  std::string format;
+  glm::vec3 eye, view, up;
+  double fovy;
+};
+
+// The format of an output, which follows the file extension unless the
+// options give one
+static std::string output_format(const std::string &filename, const std::string &option)
+{
+  if (!option.empty())
+  {
+    return option;
+  }
+  bool is_pfm = filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".pfm") == 0;
+  return is_pfm ? "pfm" : "png";
+}
+
+// Render the scene given by the gr.render arguments on the stack, returning
+// what is left to write the output of each camera. Frames of a sequence are
+// rendered incrementally unless they say otherwise.
+static FrameOutputs *render_frame(lua_State *L, bool in_sequence)
+{
   gr_node_ud *root = (gr_node_ud *)luaL_checkudata(L, 1, "gr.node");
   luaL_argcheck(L, root != 0, 1, "Root node expected");
 
-  const char *filename = luaL_checkstring(L, 2);
+  // The output is a file name, or a list of cameras that each have one
+  luaL_argcheck(L, lua_type(L, 2) == LUA_TSTRING || lua_istable(L, 2), 2, "Output file name or list of cameras expected");
 
   int width = luaL_checknumber(L, 3);
   int height = luaL_checknumber(L, 4);
@@ -336,6 +582,52 @@ extern "C" int gr_render_cmd(lua_State *L)
 
   double fov = luaL_checknumber(L, 8);
 
+  // Each camera in a list has an output, and takes the eye, view, up and
+  // fovy it does not give from the arguments
+  std::string format_option = get_opt_string(L, 11, "format", "");
+  luaL_argcheck(L, format_option.empty() || format_option == "png" || format_option == "pfm", 11, "format must be 'png' or 'pfm'");
+
+  std::vector<CameraOutput> cameras;
+  if (lua_istable(L, 2))
+  {
+    int camera_count = int(lua_rawlen(L, 2));
+    luaL_argcheck(L, camera_count >= 1, 2, "List of cameras expected");
+    for (int i = 1; i <= camera_count; i++)
+    {
+      lua_rawgeti(L, 2, i);
+      int arg = lua_gettop(L);
+      luaL_argcheck(L, lua_istable(L, arg), 2, "Camera table expected");
+
+      CameraOutput camera;
+      camera.output = get_opt_string(L, arg, "output", "");
+      luaL_argcheck(L, !camera.output.empty(), 2, "Every camera needs an output");
+      camera.eye = eye;
+      camera.view = view;
+      camera.up = up;
+      get_opt_tuple(L, arg, "eye", &camera.eye[0], 3);
+      get_opt_tuple(L, arg, "view", &camera.view[0], 3);
+      get_opt_tuple(L, arg, "up", &camera.up[0], 3);
+      camera.fovy = get_opt_number(L, arg, "fovy", fov);
+      cameras.push_back(camera);
+
+      lua_pop(L, 1);
+    }
+  }
+  else
+  {
+    CameraOutput camera;
+    camera.output = lua_tostring(L, 2);
+    camera.eye = eye;
+    camera.view = view;
+    camera.up = up;
+    camera.fovy = fov;
+    cameras.push_back(camera);
+  }
+  for (CameraOutput &camera : cameras)
+  {
+    camera.format = output_format(camera.output, format_option);
+  }
+
   double ambient_data[3];
   get_tuple(L, 9, ambient_data, 3);
   glm::vec3 ambient(ambient_data[0], ambient_data[1], ambient_data[2]);
@@ -355,9 +647,331 @@ extern "C" int gr_render_cmd(lua_State *L)
     lua_pop(L, 1);
   }
 
-  Image im(width, height);
-  Raytracer_Render(root->node, im, eye, view, up, fov, ambient, lights);
-  im.savePng(filename);
+  // Optional settings, given as a table of named values
+  // The zlib level, or its default when not given
+  double compression_level = get_opt_number(L, 11, "compression", Z_DEFAULT_COMPRESSION);
+  luaL_argcheck(L, compression_level == Z_DEFAULT_COMPRESSION ||
+                   (compression_level >= 0 && compression_level <= 9 && compression_level == (int)compression_level),
+                11, "compression must be a whole number between 0 and 9");
+  int compression = compression_level;
+  bool stream_png = get_opt_bool(L, 11, "stream", true);
+
+  // How colours are converted to integers for PNG output
+  ToneMapSettings tonemap;
+  tonemap.exposure = get_opt_number(L, 11, "exposure", 0.0);
+  tonemap.gamma = get_opt_number(L, 11, "gamma", 1.0);
+  tonemap.srgb = get_opt_bool(L, 11, "srgb", false);
+  tonemap.dither = get_opt_bool(L, 11, "dither", false);
+  tonemap.bit_depth = get_opt_number(L, 11, "bit_depth", 8);
+  luaL_argcheck(L, tonemap.gamma > 0.0, 11, "gamma must be positive");
+  luaL_argcheck(L, tonemap.bit_depth == 8 || tonemap.bit_depth == 16, 11, "bit_depth must be 8 or 16");
+
+  std::string tone_op = get_opt_string(L, 11, "tonemap", "clamp");
+  luaL_argcheck(L, tone_op == "clamp" || tone_op == "reinhard" || tone_op == "filmic", 11,
+                "tonemap must be 'clamp', 'reinhard' or 'filmic'");
+  tonemap.op = (tone_op == "reinhard") ? ToneOperator::Reinhard : (tone_op == "filmic") ? ToneOperator::Filmic : ToneOperator::Clamp;
+
+  // Adaptive anti-aliasing, off unless more than one sample is allowed
+  RenderSettings settings;
+  settings.aa_max_samples = get_opt_number(L, 11, "aa_samples", 1);
+  settings.aa_threshold = get_opt_number(L, 11, "aa_threshold", 0.1);
+  luaL_argcheck(L, settings.aa_max_samples >= 1 && settings.aa_max_samples <= 256, 11, "aa_samples must be between 1 and 256");
+  luaL_argcheck(L, settings.aa_threshold >= 0.0, 11, "aa_threshold must not be negative");
+
+  // Progressive rendering stops taking samples in each tile once it is
+  // smooth enough, and can save the image so far as it goes
+  settings.passes = get_opt_number(L, 11, "passes", 1);
+  settings.min_passes = get_opt_number(L, 11, "min_passes", 4);
+  settings.variance_threshold = get_opt_number(L, 11, "variance_threshold", 0.01);
+  luaL_argcheck(L, settings.passes >= 1, 11, "passes must be at least 1");
+  luaL_argcheck(L, settings.min_passes >= 2, 11, "min_passes must be at least 2");
+  settings.time_budget = get_opt_number(L, 11, "time_budget", default_time_budget);
+  luaL_argcheck(L, settings.time_budget >= 0.0, 11, "time_budget must not be negative");
+  std::string preview = get_opt_string(L, 11, "preview", "");
+  double preview_interval = get_opt_number(L, 11, "preview_interval", 10.0);
+
+  // Scenes with many lights can sample a few of them at each hit, and skip
+  // those too dim to matter
+  settings.light_samples = get_opt_number(L, 11, "light_samples", 0);
+  luaL_argcheck(L, settings.light_samples >= 0, 11, "light_samples must not be negative");
+  settings.light_cutoff = get_opt_number(L, 11, "light_cutoff", 0.0);
+  luaL_argcheck(L, settings.light_cutoff >= 0.0, 11, "light_cutoff must not be negative");
+
+  // How far reflections are followed
+  settings.max_depth = get_opt_number(L, 11, "max_depth", 1);
+  settings.min_throughput = get_opt_number(L, 11, "min_throughput", 0.0);
+  settings.roulette_threshold = get_opt_number(L, 11, "roulette", 0.0);
+  luaL_argcheck(L, settings.max_depth >= 0, 11, "max_depth must not be negative");
+  luaL_argcheck(L, settings.min_throughput >= 0.0, 11, "min_throughput must not be negative");
+  luaL_argcheck(L, settings.roulette_threshold >= 0.0, 11, "roulette must not be negative");
+
+  // Deferred shading traces the primary rays into a G-buffer first, or
+  // shades from the one kept from the last render of the same view
+  if (get_opt_bool(L, 11, "deferred", false))
+  {
+    settings.gbuffer = &gbuffer_cache;
+  }
+
+  // Relighting keeps what each pixel sees between renders, so that a render
+  // that only changes the colour or falloff of the lights is quick
+  if (get_opt_bool(L, 11, "relight", false))
+  {
+    settings.relight = &relight_cache;
+  }
+
+  // Incremental rendering reuses the last image, tracing again only the
+  // tiles that scene edits since then could have changed. It is used
+  // by default in a sequence, where most frames only move a few objects,
+  // unless they are shared with other processes or there are several
+  // cameras, which would each replace the image the cache keeps
+  if (get_opt_bool(L, 11, "incremental", in_sequence && !tile_farm && cameras.size() == 1))
+  {
+    settings.incremental = &incremental_cache;
+  }
+
+  // A crop window renders just part of the frame, with the camera of the
+  // whole frame. The result is its own image, or is merged into the
+  // existing output file.
+  int crop[4] = {0, 0, width, height};
+  bool has_crop = get_opt_tuple(L, 11, "crop", crop, 4);
+  bool crop_merge = get_opt_bool(L, 11, "crop_merge", false);
+  if (has_crop)
+  {
+    luaL_argcheck(L, crop[0] >= 0 && crop[1] >= 0 && crop[2] > 0 && crop[3] > 0 &&
+                         crop[0] + crop[2] <= width && crop[1] + crop[3] <= height,
+                  11, "crop must be {x, y, width, height} within the frame");
+    settings.crop_x = crop[0];
+    settings.crop_y = crop[1];
+    settings.frame_width = width;
+    settings.frame_height = height;
+  }
+  int image_width = crop[2];
+  int image_height = crop[3];
+
+  // Another process can follow the render through a stream of tiles, and
+  // previews can be saved as it goes, when there is one camera
+  std::string tile_target = get_opt_string(L, 11, "tile_stream", "");
+  luaL_argcheck(L, cameras.size() == 1 || (tile_target.empty() && preview.empty()), 11,
+                "tile_stream and preview are only for renders with one camera");
+
+  // Where the time goes can be written out as heat maps of the image
+  std::string heatmap = get_opt_string(L, 11, "heatmap", "");
+  luaL_argcheck(L, cameras.size() == 1 || heatmap.empty(), 11, "heatmap is only for renders with one camera");
+
+  // The statistics printed after the render can be kept as JSON lines
+  settings.stats_file = get_opt_string(L, 11, "stats", default_stats_file);
+
+  // A checkpoint is kept next to the output while it renders, so that a
+  // render that is killed can be carried on by running it again. Crop
+  // windows of the same output each have their own.
+  double checkpoint_interval = get_opt_number(L, 11, "checkpoint", default_checkpoint_interval);
+  luaL_argcheck(L, checkpoint_interval >= 0.0, 11, "checkpoint must not be negative");
+
+  // Everything the render allocates below is only freed once it has been
+  // written out, so no Lua error may be raised after this point
+
+  // A worker of a distributed render sends its tiles to the coordinator,
+  // which writes the output. The coordinator renders each camera on its
+  // own, and so does the worker.
+  settings.farm = tile_farm;
+  if (tile_farm && !tile_farm->isCoordinator())
+  {
+    for (const CameraOutput &camera : cameras)
+    {
+      Image im(image_width, image_height);
+      rt_Render(root->node, im, camera.eye, camera.view, camera.up, camera.fovy, ambient, lights, NULL, settings);
+    }
+    return new FrameOutputs;
+  }
+
+  std::string checkpoint_path = cameras[0].output;
+  if (has_crop)
+  {
+    checkpoint_path += "." + std::to_string(crop[0]) + "_" + std::to_string(crop[1]);
+  }
+  if (checkpoint_interval > 0.0 && cameras.size() == 1)
+  {
+    settings.checkpoint = new RenderCheckpoint(checkpoint_path + ".checkpoint", checkpoint_interval);
+  }
+  else if (checkpoint_interval > 0.0)
+  {
+    std::cout << "Checkpoints are only kept for renders with one camera" << std::endl;
+  }
+
+  FrameOutputs *outputs = new FrameOutputs;
+  std::vector<RenderListenerGroup> listeners(cameras.size());
+  std::vector<RenderView> views;
+  for (size_t c = 0; c < cameras.size(); c++)
+  {
+    const CameraOutput &camera = cameras[c];
+
+    FrameOutput *out = new FrameOutput;
+    out->filename = camera.output;
+    out->format = camera.format;
+    out->image = new Image(image_width, image_height);
+    out->tiles = NULL;
+    out->previews = NULL;
+    out->png = NULL;
+    out->crop_merge = crop_merge;
+    out->crop_x = crop[0];
+    out->crop_y = crop[1];
+    out->compression = compression;
+    out->tonemap = tonemap;
+    out->checkpoint = settings.checkpoint;
+    out->costs = NULL;
+    outputs->push_back(out);
+
+    if (!heatmap.empty())
+    {
+      out->costs = new CostMap(image_width, image_height);
+      out->costs_prefix = heatmap;
+      settings.cost_map = out->costs;
+    }
+
+    if (!tile_target.empty())
+    {
+      out->tiles = new TileStreamer(tile_target, image_width, image_height);
+      listeners[c].add(out->tiles);
+    }
+
+    if (!preview.empty())
+    {
+      out->previews = new PngPreviewWriter(preview, preview_interval, tonemap);
+      listeners[c].add(out->previews);
+    }
+
+    // The PNG is compressed row by row as the render completes them, so
+    // that encoding overlaps with rendering instead of following it
+    if (camera.format == "png" && stream_png && !crop_merge)
+    {
+      out->png = new PngStreamer(camera.output, image_width, image_height, compression, tonemap);
+      listeners[c].add(out->png);
+    }
+
+    RenderView v;
+    v.image = out->image;
+    v.eye = camera.eye;
+    v.view = camera.view;
+    v.up = camera.up;
+    v.fovy = camera.fovy;
+    v.listener = listeners[c].empty() ? NULL : &listeners[c];
+    views.push_back(v);
+  }
+
+  // Several cameras share the scene and the threads
+  if (views.size() == 1)
+  {
+    const RenderView &v = views[0];
+    rt_Render(root->node, *v.image, v.eye, v.view, v.up, v.fovy, ambient, lights, v.listener, settings);
+  }
+  else
+  {
+    rt_RenderViews(root->node, views, ambient, lights, settings);
+  }
+
+  return outputs;
+}
+
+// Render a scene
+extern "C" int gr_render_cmd(lua_State *L)
+{
+  GRLUA_DEBUG_CALL;
+
+  finish_frames(render_frame(L, false));
+
+  return 0;
+}
+
+// Render one frame of a sequence from the gr.render arguments, returning
+// its outputs to be written while the next frame renders
+extern "C" int gr_sequence_frame_cmd(lua_State *L)
+{
+  GRLUA_DEBUG_CALL;
+
+  lua_pushlightuserdata(L, render_frame(L, true));
+  return 1;
+}
+
+// Render the frames from 'first' to 'last'. The function is called with
+// each frame number to make the changes for that frame, and returns the
+// arguments gr.render would take for it in a table. The scene, meshes and
+// threads are kept for all frames, and each frame's output is written
+// while the next one renders.
+extern "C" int gr_render_sequence_cmd(lua_State *L)
+{
+  GRLUA_DEBUG_CALL;
+
+  int first = luaL_checkinteger(L, 1);
+  int last = luaL_checkinteger(L, 2);
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+
+  // The frame being written, if any
+  pthread_t writer;
+  bool writing = false;
+
+  bool failed = false;
+  for (int frame = first; frame <= last && !failed; frame++)
+  {
+    std::cout << "Frame " << frame << " of " << first << " to " << last << std::endl;
+
+    // Call the function for the frame's arguments, then render with them
+    lua_pushcfunction(L, gr_sequence_frame_cmd);
+    lua_pushvalue(L, 3);
+    lua_pushinteger(L, frame);
+    failed = lua_pcall(L, 1, 1, 0) != 0;
+    if (!failed && !lua_istable(L, -1))
+    {
+      lua_pop(L, 1);
+      lua_pushfstring(L, "frame %d: the sequence function must return the arguments of gr.render in a table", frame);
+      failed = true;
+    }
+    if (failed)
+    {
+      // Leave the message on top
+      lua_remove(L, -2);
+      break;
+    }
+
+    int args = (int)lua_rawlen(L, -1);
+    for (int i = 1; i <= args; i++)
+    {
+      lua_rawgeti(L, -i, i);
+    }
+    lua_remove(L, -args - 1);
+    failed = lua_pcall(L, args, 1, 0) != 0;
+    if (failed)
+    {
+      break;
+    }
+
+    FrameOutputs *outputs = static_cast<FrameOutputs *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+
+    // Only one frame is written at a time, so output cannot pile up
+    if (writing)
+    {
+      pthread_join(writer, NULL);
+      writing = false;
+    }
+    if (pthread_create(&writer, NULL, finish_frames_thread, outputs) == 0)
+    {
+      writing = true;
+    }
+    else
+    {
+      finish_frames(outputs);
+    }
+  }
+
+  if (writing)
+  {
+    pthread_join(writer, NULL);
+  }
+
+  if (failed)
+  {
+    return lua_error(L);
+  }
 
   return 0;
 }
@@ -402,6 +1016,8 @@ extern "C" int gr_node_add_child_cmd(lua_State *L)
   SceneNode *child = childdata->node;
 
   self->add_child(child);
+  relight_cache.clear();
+  gbuffer_cache.clear();
 
   return 0;
 }
@@ -424,6 +1040,8 @@ extern "C" int gr_node_set_material_cmd(lua_State *L)
   Material *material = matdata->material;
 
   self->setMaterial(material);
+  relight_cache.clear();
+  gbuffer_cache.clear();
 
   return 0;
 }
@@ -446,6 +1064,8 @@ extern "C" int gr_node_scale_cmd(lua_State *L)
   }
 
   self->scale(glm::vec3(values[0], values[1], values[2]));
+  relight_cache.clear();
+  gbuffer_cache.clear();
 
   return 0;
 }
@@ -468,6 +1088,8 @@ extern "C" int gr_node_translate_cmd(lua_State *L)
   }
 
   self->translate(glm::vec3(values[0], values[1], values[2]));
+  relight_cache.clear();
+  gbuffer_cache.clear();
 
   return 0;
 }
@@ -492,6 +1114,8 @@ extern "C" int gr_node_rotate_cmd(lua_State *L)
   double angle = luaL_checknumber(L, 3);
 
   self->rotate(axis, angle);
+  relight_cache.clear();
+  gbuffer_cache.clear();
 
   return 0;
 }
@@ -531,6 +1155,7 @@ static const luaL_Reg grlib_functions[] = {
     {"mesh", gr_mesh_cmd},
     {"light", gr_light_cmd},
     {"render", gr_render_cmd},
+    {"render_sequence", gr_render_sequence_cmd},
     {0, 0}};
 
 // This is where all the member functions for "gr.node" objects are
@@ -555,13 +1180,9 @@ static const luaL_Reg grlib_node_methods[] = {
     {"render", gr_render_cmd},
     {0, 0}};
 
-// This function calls the lua interpreter to define the scene and
-// raytrace it as appropriate.
-bool run_lua(const std::string &filename)
+// Start a lua interpreter with the gr library loaded
+lua_State *open_lua()
 {
-  GRLUA_DEBUG("Importing scene from " << filename);
-
-  // Start a lua interpreter
   lua_State *L = luaL_newstate();
 
   GRLUA_DEBUG("Loading base libraries");
@@ -584,17 +1205,104 @@ bool run_lua(const std::string &filename)
   luaL_setfuncs(L, grlib_functions, 0);
   lua_setglobal(L, "gr");
 
+  return L;
+}
+
+void close_lua(lua_State *L)
+{
+  lua_close(L);
+
+  // The scene the G-buffer was filled from has gone with the interpreter
+  gbuffer_cache.clear();
+}
+
+// Run the function on top of the stack, or report why it could not be
+// loaded
+static bool call_lua_chunk(lua_State *L, int load_status, int nargs, std::string &error)
+{
+  if (load_status || lua_pcall(L, nargs, 0, 0))
+  {
+    const char *message = lua_tostring(L, -1);
+    error = message ? message : "unknown error";
+    lua_pop(L, 1);
+    return false;
+  }
+  return true;
+}
+
+bool run_lua_file(lua_State *L, const std::string &filename, std::string &error)
+{
+  GRLUA_DEBUG("Parsing " << filename);
+  return call_lua_chunk(L, luaL_loadfile(L, filename.c_str()), 0, error);
+}
+
+bool run_lua_string(lua_State *L, const std::string &source, const std::string &name, std::string &error)
+{
+  GRLUA_DEBUG("Parsing " << name);
+  return call_lua_chunk(L, luaL_loadbuffer(L, source.data(), source.size(), name.c_str()), 0, error);
+}
+
+bool render_lua_scene(lua_State *L, const std::string &output, int width, int height,
+                      const std::string &overrides, std::string &error)
+{
+  // The render is a call to gr.render with the scene, lights and camera
+  // from the globals, and anything given in the overrides in their place
+  static const char *render_chunk =
+      "local output, width, height, o = ...\n"
+      "local c = camera or {}\n"
+      "gr.render(o.scene or scene, output, width, height,\n"
+      "          o.eye or c.eye, o.view or c.view, o.up or c.up, o.fovy or c.fovy,\n"
+      "          o.ambient or ambient, o.lights or lights, o.options or options)\n";
+
+  if (luaL_loadstring(L, render_chunk))
+  {
+    return call_lua_chunk(L, 1, 0, error);
+  }
+  lua_pushstring(L, output.c_str());
+  lua_pushinteger(L, width);
+  lua_pushinteger(L, height);
+
+  // The overrides are a Lua table constructor
+  std::string table = "return " + (overrides.empty() ? std::string("{}") : overrides);
+  if (luaL_loadstring(L, table.c_str()) || lua_pcall(L, 0, 1, 0))
+  {
+    error = lua_tostring(L, -1);
+    lua_pop(L, 5);
+    return false;
+  }
+  if (!lua_istable(L, -1))
+  {
+    error = "render overrides must be a table";
+    lua_pop(L, 5);
+    return false;
+  }
+
+  return call_lua_chunk(L, 0, 4, error);
+}
+
+// This function calls the lua interpreter to define the scene and
+// raytrace it as appropriate.
+bool run_lua(const std::string &filename)
+{
+  TRACE_SCOPE("run_lua");
+
+  GRLUA_DEBUG("Importing scene from " << filename);
+
+  // Start a lua interpreter
+  lua_State *L = open_lua();
+
   GRLUA_DEBUG("Parsing the scene");
   // Now parse the actual scene
-  if (luaL_loadfile(L, filename.c_str()) || lua_pcall(L, 0, 0, 0))
+  std::string error;
+  if (!run_lua_file(L, filename, error))
   {
-    std::cerr << "Error loading " << filename << ": " << lua_tostring(L, -1) << std::endl;
+    std::cerr << "Error loading " << filename << ": " << error << std::endl;
     return false;
   }
   GRLUA_DEBUG("Closing the interpreter");
 
   // Close the interpreter, free up any resources not needed
-  lua_close(L);
+  close_lua(L);
 
   return true;
 }
@@ -2,4 +2,43 @@
 
 #include <string>
 
+struct lua_State;
+class TileFarm;
+
 bool run_lua(const std::string &filename);
+
+// A Lua interpreter with the gr library loaded. Scripts run in the same
+// interpreter share its globals, so a scene built by one can be rendered
+// by another, and meshes are only loaded once for all of them.
+lua_State *open_lua();
+void close_lua(lua_State *L);
+
+// Run a script file, or Lua source called 'name' in messages. On failure
+// 'error' holds the Lua error.
+bool run_lua_file(lua_State *L, const std::string &filename, std::string &error);
+bool run_lua_string(lua_State *L, const std::string &source, const std::string &name, std::string &error);
+
+// Render the scene held in the globals 'scene', 'lights' and 'ambient' of
+// 'L' to 'output', from the camera in the global table 'camera' (with eye,
+// view, up and fovy) and with the gr.render options in 'options'.
+// 'overrides' is a Lua table constructor that can replace any of these for
+// this render, such as "{eye = {0, 0, 10}}", or empty for none.
+bool render_lua_scene(lua_State *L, const std::string &output, int width, int height,
+                      const std::string &overrides, std::string &error);
+
+// Time budget in seconds for every gr.render call that does not set its
+// own, 0 for none
+void set_default_time_budget(double seconds);
+
+// Keep a checkpoint of every gr.render call that does not set its own
+// interval, written out every so many seconds, and carry on from one left
+// by an earlier run of the same render. 0 turns checkpoints off.
+void set_checkpoint_interval(double seconds);
+
+// Append the statistics of every gr.render call that does not name its own
+// file to this one, as a line of JSON each. Empty turns it off.
+void set_stats_file(const std::string &filename);
+
+// Share the tiles of every gr.render call with other processes, or NULL to
+// render alone
+void set_tile_farm(TileFarm *farm);